@@ -1,4 +1,6 @@
 #define QUIT_CHAR 'q'
+/* the screen isn't redrawn more often than this many times a second, keys that arrive in between are handled in one go */
+#define MAX_REFRESH_RATE 60
 /* TODO: make script for bulk rename */
 /* TODO: make preview script */
 /* TODO: make opener script */
@@ -7,14 +9,93 @@
 /* TODO: use /tmp for this */
 #define VCD_PATH "/home/joseph/.vcd"
 
+/* keep the listings of big directories on disk so they can be drawn before rereading them ?
+ * a cached listing is reread in the background when the directory's mtime changed
+ */
+#define INDEXLISTINGS 1
+#define INDEX_PATH "/home/joseph/.vcd.index"
+/* an index that isn't used for INDEX_KEEP_DAYS is removed */
+#define INDEX_KEEP_DAYS 30
+/* directories with fewer entries than this are cheap enough to just read */
+#define INDEX_MIN_ENTRIES 256
+
+/* ask stuifm --daemon, when one is running, for listings before reading directories ?
+ * the socket is made in $XDG_RUNTIME_DIR/stuifm, or /tmp/stuifm-uid without it, which only the user can get into
+ */
+#define USEDAEMON 1
+#define DAEMON_SOCKET "daemon.sock"
+#define DAEMON_MAX_LISTINGS 1024
+
+/* directories with at least this many entries are sorted on disk (in $XDG_CACHE_HOME/stuifm or ~/.cache/stuifm, in runs of at most
+ * LARGE_RUN_SIZE bytes) and only a window of them is kept in memory, so memory use doesn't depend on their size
+ * a sorted listing that isn't used for LARGE_KEEP_DAYS is removed
+ */
+#define LARGE_DIRECTORY 1000000
+#define LARGE_KEEP_DAYS 7
+#define LARGE_RUN_SIZE (16 << 20)
+
+/* after no key came for PREFETCH_IDLE_MS (0 turns it off), the directories around the cursor, the parent and the directories next to cwd
+ * are read ahead into memory by a low priority thread, keeping at most PREFETCH_MEMORY bytes of listings
+ * PREFETCH_NEIGHBOURS is how many files above and below the current one are looked at
+ */
+#define PREFETCH_IDLE_MS 200
+#define PREFETCH_MEMORY (128 << 20)
+#define PREFETCH_NEIGHBOURS 2
+
+/* metadata is fetched in batches of statx through io_uring, or spread over this many threads where io_uring isn't available */
+#define STATX_QUEUE_DEPTH 64
+#define STATX_THREADS 8
+
+/* show the git status of files (M modified, ? untracked, U in a conflict) next to their names in repositories ?
+ * it's worked out from .git/index and the files' stat data, and again only when the directory or the index changes
+ */
+#define GITSTATUS 1
+
+/* show how many entries directories have next to their names ? they're counted by COUNT_THREADS threads in the background,
+ * no further than COUNT_LIMIT (shown as 10k+)
+ */
+#define SHOWCOUNTS 1
+#define COUNT_LIMIT 10000
+#define COUNT_THREADS 2
+
+/* on network and FUSE filesystems (nfs, smb, sshfs...) reading a directory or the files' metadata is waited on for at most
+ * FS_DEADLINE_MS, a filesystem that takes longer is marked slow: only the names of its files are read and nothing on it is previewed
+ */
+#define FS_DEADLINE_MS 300
+
+/* threads used for finding duplicates and the like */
+#define WORKER_THREADS 8
+
+/* how many archive indexes are kept in memory, an archive is read again only if it changed */
+#define ARCHIVE_CACHE 8
+
+/* how many tabs can be open at once, each with its own directory, cursor and filters */
+#define TABS_MAX 9
+
+/* when comparing directories, also compare the content of files whose size is the same but mtime isn't ? */
+#define COMPARECONTENT 0
+
+/* the directories visited with h and l, ranked by how often and how recently they were visited, for the jump prompt
+ * every visit is appended to FRECENCY_PATH.log right away and merged into FRECENCY_PATH when a session starts or quits
+ */
+#define FRECENCY_PATH "/home/joseph/.vcd.frecency"
+#define FRECENCY_MAX 1000
+
 #define SELECTEDCOLOR  COLOR_RED
 #define DIRECTORYCOLOR COLOR_BLUE
+/* colour files by their type and extension like ls does, when LS_COLORS is set ? DIRECTORYCOLOR is used if it doesn't set one for directories */
+#define USELSCOLORS 1
 
 /* sort with directories being first ? */
 #define DIRECTORIESFIRST 1
 /* show hidden files ? */
 #define HIDDENFILES 1
 
+/* run commands that don't need the terminal (NoEndWinMask) in one long-lived shell instead of starting one for each ? */
+#define SHELLCOPROCESS 1
+/* a command run in it that hasn't finished after this long is killed with what it started, and the shell started again */
+#define COPROCESS_DEADLINE_MS 30000
+
 /* the draw ratios - similar to the ratios of ranger
  * the ratios themselves are defined like this:
  * {ratios, 0, currentposition} - where currentposition is the position of the column that contains the currentfile - 0 indexed
@@ -58,7 +139,15 @@ static const char *movecommand[] = {"printf \"move selection[y/N]: \"; read ans;
 static const char *trashputcommand[] = {"printf \"put to trash selection[y/N]: \"; read ans; [ $ans = \"y\" ] && trash-put %s; echo %c"};
 static const char *searchcommand[] = {"printf \"search: \"; read ans; printf \"\n$ans\""};
 
-/* TODO: make a list of commands to autostart, a list of commands to run before every event (not just defined events) and after every event. by event i mean keypress */
+/* TODO: make a list of commands to autostart */
+
+/* plugins loaded when stuifm starts, with their full path (see plugin.h). they can bind keys, add to what's drawn after
+ * the names and run hooks before and after every keypress, all inside stuifm instead of running a command for it
+ */
+static const char *plugins[] = {
+	NULL, /* "/home/joseph/.stuifm/example.so", */
+};
+
 /* TODO: bookmark script */
 /* TODO: add the last line output things */
 
@@ -70,6 +159,10 @@ static const char *searchcommand[] = {"printf \"search: \"; read ans; printf \"\
  * - i don't recommend you use the CtrlMask in your config unless it's 100% necessary
  */
 
+/* a binding that asks for something (executecommand, jump, anything that prompts) ends with ReadsInput, so the keys typed
+ * as the answer aren't taken as the next bindings
+ */
+
 static Key keys[] = {
     /* movement */
     {'j',            movev,                 {.i = +1}},
@@ -82,6 +175,7 @@ static Key keys[] = {
     {'G',            last,                  {0}      },
     {'e' & CtrlMask, topofscreenscroll,     {.i = +1}},
     {'y' & CtrlMask, topofscreenscroll,     {.i = -1}},
+    {'z',            jump,                  {0},       ReadsInput},
 
 	/* draw ratio */
 	{'r'           , drawratiosscroll,      {.i = +1}},
@@ -98,19 +192,33 @@ static Key keys[] = {
     {'.',            hiddenfilesswitch,     {0}      },
                                   	     
 	/* rename, bulkrename, yank, move and trash-put using commmands */
-    {'c',            executecommand,        {.v = renamecommand,   .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}},
-    {'y',            executecommand,        {.v = yankcommand,     .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}},
+    {'c',            executecommand,        {.v = renamecommand,   .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}, ReadsInput},
+    {'y',            executecommand,        {.v = yankcommand,     .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}, ReadsInput},
     {'y',            clearselection,        {0}      }, /* in order to clear the selection after yank - might consider making this a mask */
-    {'d',            executecommand,        {.v = movecommand,     .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}},
+    {'d',            executecommand,        {.v = movecommand,     .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}, ReadsInput},
     {'d',            clearselection,        {0}      }, /* in order to clear the selection after copy - might consider making this a mask */
-    {'D',            executecommand,        {.v = trashputcommand, .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}},
+    {'D',            executecommand,        {.v = trashputcommand, .i=NoConfirmationMask|SearchLastLineMask|NoSaveSearchMask}, ReadsInput},
     {'d',            clearselection,        {0}      }, /* in order to clear the selection after copy - might consider making this a mask */
+    {'X',            deleteselection,       {0},       ReadsInput}, /* deletes for good, after asking */
     
     /* searching */
-    {'/',            executecommand,        {.v = searchcommand, .i = NoConfirmationMask|SearchLastLineMask|NoWaitUntilKeyPress}},
+    {'/',            executecommand,        {.v = searchcommand, .i = NoConfirmationMask|SearchLastLineMask|NoWaitUntilKeyPress}, ReadsInput},
     {'n',            search,                {.i = +1}},
     {'N',            search,                {.i = -1}},
+    {'?',            contentsearch,         {0},       ReadsInput}, /* lists the files that contain a pattern */
     
     /* commands */
-    {'!',            executecommand,        {.i = 0} }
+    {'!',            executecommand,        {.i = 0}, ReadsInput},
+
+    /* virtual listings, h goes back to the directory */
+    {'F',            findduplicates,        {0}      },
+    {'C',            comparedirectories,    {0},       ReadsInput},
+    {'S',            syncdirectories,       {0},       ReadsInput},
+    {'x',            extractmember,         {0}      },
+
+    /* tabs, switching to one only redraws unless its directory changed */
+    {'t',            newtab,                {0}      },
+    {'T',            closetab,              {0}      },
+    {'\t',           switchtab,             {.i = +1}},
+    {KEY_BTAB,       switchtab,             {.i = -1}}
 };
@@ -0,0 +1,60 @@
+#!/bin/sh
+# makes the tree the replay scripts run in, the same every time
+# use: fixture.sh directory
+
+set -e
+[ -n "$1" ] || { echo "use: fixture.sh directory"; exit 1; }
+
+# what X deletes, made again before every replay
+scratch() {
+	rm -rf "$1/scratch"
+	mkdir -p "$1/scratch/gone/a/b" "$1/scratch/kept"
+	for f in 1 2 3 4 5; do
+		echo $f > "$1/scratch/gone/$f"
+		echo $f > "$1/scratch/gone/a/$f"
+		echo $f > "$1/scratch/gone/a/b/$f"
+	done
+	echo kept > "$1/scratch/kept/file"
+}
+
+# the rest is only made again when what's in it changed
+version=2
+if [ "$(cat "$1/.done" 2>/dev/null)" = $version ]; then
+	scratch "$1"
+	exit 0
+fi
+
+rm -rf "$1"
+mkdir -p "$1/big" "$1/deep/a/b/c/d/e/f/g/h/i/j" "$1/dups/x" "$1/other/x" "$1/repo/src"
+cd "$1"
+
+# a directory too big to list in one go
+i=0
+while [ $i -lt 20000 ]; do
+	printf '' > "big/file$(printf %05d $i)"
+	i=$((i+1))
+done
+
+echo leaf > deep/a/b/c/d/e/f/g/h/i/j/leaf
+for d in a b c d e; do
+	seq 1 1000 > "dups/$d"
+	seq 1 1000 > "dups/x/$d"
+	seq 1 1000 > "other/$d"
+done
+echo changed >> other/c
+echo only > dups/only
+tar cf deep.tar deep
+
+touch -d 2020-01-01 dups/* dups/x/* other/* other/x
+
+# a repository with a modified and an untracked file, for the git markers
+seq 1 100 > repo/src/tracked
+seq 1 100 > repo/src/modified
+git -C repo init -q
+git -C repo add src
+git -C repo -c user.name=perf -c user.email=perf@localhost commit -q -m fixture
+echo more >> repo/src/modified
+echo new > repo/src/untracked
+
+scratch .
+echo $version > .done
@@ -0,0 +1,60 @@
+#!/bin/sh
+# replays every perf/*.keys in the fixture, fails if an expect fails or a script got slower than perf/baseline
+# use: perftest.sh stuifm [--baseline], --baseline writes perf/baseline from this run instead
+# stuifm --replay runs in a home of its own, without the daemon and plugins, so only the fixture and the page cache are shared
+
+dir=$(dirname "$0")
+bin=$1
+fixture=${PERF_FIXTURE:-${TMPDIR:-/tmp}/stuifm-perf}
+runs=${PERF_RUNS:-5}           # the median run counts, not the fastest, which is only the warmest
+cold=${PERF_COLD:-0}           # 1 drops the page cache before every run (needs root), so what's measured includes the disk
+tolerance=${PERF_TOLERANCE:-150} # percent of the baseline that's still fine
+slack=${PERF_SLACK:-5000}      # microseconds, so scripts this fast don't fail on noise
+
+[ -x "$bin" ] || { echo "use: perftest.sh stuifm [--baseline]"; exit 1; }
+[ "$cold" = 1 ] && ! [ -w /proc/sys/vm/drop_caches ] && { echo "PERF_COLD=1 needs to write /proc/sys/vm/drop_caches"; exit 1; }
+
+failed=0
+results=""
+for script in "$dir"/*.keys; do
+	name=$(basename "$script" .keys)
+	runresults=""
+	i=0
+	while [ $i -lt "$runs" ]; do
+		# scripts can change the fixture (X deletes), what they change is made again
+		sh "$dir/fixture.sh" "$fixture" || exit 1
+		if [ "$cold" = 1 ]; then
+			sync
+			echo 3 > /proc/sys/vm/drop_caches
+		fi
+		if ! out=$("$bin" --replay "$script" "$fixture"); then
+			echo "$out" | grep -v '^step'
+			failed=1
+			break
+		fi
+		runresults="$runresults$(echo "$out" | awk '/^total/ { t = $2 } /^worst/ { w = $2 } END { print t, w }')
+"
+		i=$((i+1))
+	done
+	median=$(printf '%s' "$runresults" | sort -n | awk '{ t[NR] = $1; w[NR] = $2 } END { m = int((NR+1)/2); print t[m], w[m] }')
+	results="$results$name $median
+"
+done
+
+if [ "$2" = "--baseline" ]; then
+	printf '%s' "$results" > "$dir/baseline"
+	echo "wrote $dir/baseline"
+	exit $failed
+fi
+
+printf '%s' "$results" | awk -v tolerance="$tolerance" -v slack="$slack" -v baseline="$dir/baseline" '
+	BEGIN { while ((getline line < baseline) > 0) { split(line, f); total[f[1]] = f[2]; worst[f[1]] = f[3] } }
+	{
+		status = "ok"
+		if (!($1 in total)) status = "no baseline"
+		else if ($2 > total[$1]*tolerance/100 + slack || $3 > worst[$1]*tolerance/100 + slack) { status = "SLOWER"; failed = 1 }
+		printf "%-12s total %8dus (baseline %8dus) worst %8dus (baseline %8dus) %s\n", $1, $2, total[$1], $3, worst[$1], status
+	}
+	END { exit failed }' || failed=1
+
+exit $failed
@@ -0,0 +1,61 @@
+/* See LICENSE file for license details */
+/* the interface between stuifm and its plugins
+ *
+ * a plugin is a shared object with a stuifm_plugin_init function, listed in plugins[] in config.h and loaded with dlopen
+ * when stuifm starts. stuifm_plugin_init gets the api, registers what it needs through it and returns 0, anything else
+ * unloads the plugin (and drops what it registered). everything runs in stuifm's thread, between two keys
+ *
+ * build one with: cc -shared -fPIC -o example.so example.c
+ */
+#ifndef STUIFM_PLUGIN_H
+#define STUIFM_PLUGIN_H
+
+/* raised only when something is changed or removed, members are only ever added at the end of StuifmApi */
+#define STUIFM_PLUGIN_ABI 1
+
+enum { StuifmBeforeKey, StuifmAfterKey }; /* when a hook runs, a run of motions (a held j) is one key */
+
+/* key is what was pressed, data is what was given when it was registered */
+typedef void (*StuifmKeyHandler)(int key, void *data);
+typedef void (*StuifmHook)(int key, void *data);
+
+/* what's drawn after the name of the entry index of the listing, at most size-1 bytes and a 0 in buf; returns how many, 0 for nothing */
+typedef int (*StuifmDecorator)(int index, char *buf, int size, void *data);
+
+typedef struct StuifmApi StuifmApi;
+struct StuifmApi {
+	int abi;
+	int size; /* sizeof(StuifmApi) in stuifm, a plugin built with a newer plugin.h checks it before using newer members */
+
+	/* the listing, 1 to count(), as it is in memory (only a window of a large directory); the strings point in stuifm's
+	 * memory, they aren't copied and stay valid until the listing changes, so don't keep them after returning
+	 */
+	int (*count)(void);
+	int (*current)(void);
+	const char *(*name)(int index);
+	const char *(*directory)(int index); /* what name is in */
+	unsigned int (*known)(int index); /* which of mode, filesize and mtime are known, as STATX_ bits */
+	unsigned int (*mode)(int index);
+	long long (*filesize)(int index);
+	long long (*mtime)(int index);
+	const char *(*cwd)(void);
+
+	/* the selection, 1 to selected() */
+	int (*selected)(void);
+	const char *(*selectedname)(int index);
+	const char *(*selecteddirectory)(int index);
+	int (*isselected)(int index); /* index is of the listing */
+
+	void (*setstatus)(const char *message);
+	void (*setcurrent)(int index);
+	void (*reload)(void); /* reads cwd again, the listing's strings aren't valid after it */
+
+	/* each returns 0, or -1 if it couldn't be registered */
+	int (*bindkey)(int key, StuifmKeyHandler handler, void *data); /* runs after the bindings of key in config.h */
+	int (*decorate)(StuifmDecorator decorator, void *data);
+	int (*hook)(int when, StuifmHook hook, void *data);
+};
+
+int stuifm_plugin_init(const StuifmApi *api);
+
+#endif
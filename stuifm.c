@@ -1,19 +1,44 @@
 /* TODO: restore the current file to be as close to the old current file before a file execution */
 /* See LICENSE file for license details */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#define NCURSES_WIDECHAR 1
 #include <ncurses.h>
+#include <wchar.h>
+#include <locale.h>
 #include <dirent.h>
 #include <regex.h>
+#include <fnmatch.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <linux/limits.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include <dlfcn.h>
+#include <ftw.h>
+
+#include "plugin.h"
 
 /* macros */
 #define COMMAND_MAX 100000
@@ -22,15 +47,6 @@
 
 #define LENGTH(X) (sizeof(X) / sizeof(X[0]))
 
-#define PRINTW(COLOURPAIR, LINE, COLUMN, MAXSIZE, ISSEL, ISDIR, STR) attron(COLOR_PAIR((COLOURPAIR))); \
-                                                                     move((LINE), (COLUMN)); \
-                                                                     if ((ISSEL)) addch('>'); \
-                                                                     if ((ISDIR)) printw("%.*s/", (MAXSIZE)-1-(!!(ISSEL)), (STR)); \
-                                                                     else printw("%.*s", (MAXSIZE)-(!!(ISSEL)), (STR)); \
-																	 for (int j = 1+(!!(ISSEL))+MIN((MAXSIZE), strlen((STR)))+(!!(ISDIR)); j <= MAXSIZE; j++) addch(' '); \
-                                                                     attroff(COLOR_PAIR);
-
-
 #define NUMOFDIGITS(RET, NUM, VAR) VAR = (NUM); \
                                    RET = 0; \
                                    while (VAR) { \
@@ -53,18 +69,518 @@
 #define NoSaveSearchMask 0b100000
 #define NoWaitUntilKeyPress 0b1000000
 
+#define ReadsInput 1
+
 #define VERSION "2.0"
 
+#define INDEX_MAGIC 0x73746669
+#define INDEX_VERSION 3
+#define BACKGROUND_POLL_MS 50
+
+#define DAEMON_RETRY_SECONDS 5
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_TIMEOUT_MS 200
+
+#define DUPLICATE_BLOCK 4096
+#define HASH_BUFSIZE (1 << 20)
+
+#define COPY_BUFSIZE (1 << 20)
+
+#define LARGE_MAGIC 0x7366726c
+#define LARGE_VERSION 1
+#define LARGE_WINDOW 4096
+#define LARGE_BUFSIZE (1 << 16)
+
+#define REPLAY_LINES "40"
+#define REPLAY_COLUMNS "120"
+#define REPLAY_SETTLE_MS 5000
+
+#define ARCHIVE_BLOCK 512
+#define ARCHIVE_BUFSIZE (1 << 16)
+#define LE16(P) ((P)[0] | (P)[1] << 8)
+#define LE32(P) ((unsigned int)LE16(P) | (unsigned int)LE16((P)+2) << 16)
+#define LE64(P) ((unsigned long long)LE32(P) | (unsigned long long)LE32((P)+4) << 32)
+#define BE16(P) ((unsigned int)(P)[0] << 8 | (P)[1])
+#define BE32(P) (BE16(P) << 16 | BE16((P)+2))
+
+#define GIT_REPO_CACHE 4
+#define GIT_DIR_CACHE 16
+
+#define COUNT_CACHE 4096
+
+#define COPROCESS_MARKER '\036'
+
+#define FRECENCY_MAGIC 0x7366726e
+#define FRECENCY_VERSION 1
+#define FRECENCY_AGING 10000
+
+#define PREFETCH_SLOTS 64
+
+#define GREP_BUFSIZE (1 << 20)
+#define GREP_BINARY_CHECK 8192
+
+#define DYNAMIC_PAIRS 256
+
+#define INPUT_BATCH 256
+#define KEYTABLE_SIZE (KEY_MAX+1)
+
+#define METADATA_BATCH (STATX_QUEUE_DEPTH*4)
+#define INFO_STATX_MASK (STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_UID|STATX_GID|STATX_SIZE|STATX_CTIME)
+
+/* enums */
+enum { MarkNone, MarkNew, MarkMissing, MarkChanged }; /* compare results */
+enum { PairNew = 8, PairMissing, PairChanged, PairDynamic }; /* from PairDynamic on, pairs are made for LS_COLORS as they're needed */
+enum { ColourDir, ColourLink, ColourExec, ColourFifo, ColourSocket, ColourBlock, ColourChar, ColourFile, ColourLast };
+enum { CountNone, CountAsked, CountDone, CountFailed }; /* of the entries of a directory */
+enum { FsUnknown, FsLocal, FsRemote }; /* what a mount is, network and FUSE ones being remote */
+enum { ListingDirectory, ListingDuplicates, ListingSearch, ListingCompare, ListingArchive }; /* what fileslist holds, all but the first are virtual */
+enum { ArchiveTar, ArchiveZip }; /* compressed tars are read through zlib like plain ones */
+enum { DaemonCachedOnly = 4 }; /* in a request's flags, next to indexflags(): only a listing the daemon already has, it reads nothing */
+
 /* types/structs */
 typedef struct FileElem FileElem;
 struct FileElem {
 	char name[NAME_MAX], path[PATH_MAX];
+	unsigned int statmask; /* which of the following are known, as in struct statx */
+	mode_t mode;
+	nlink_t nlink;
+	uid_t uid;
+	gid_t gid;
+	off_t size;
+	time_t mtime, ctime;
+	int group; /* which set the entry belongs to in a virtual listing */
+	int mark;
+	int matches; /* lines that matched, in the listing of a content search */
+	int islink; /* mode is what it points to */
+	int width; /* of the name on the screen, worked out once when it's added */
+	short pair; /* its colour, 0 until it's first drawn */
+	char gitmark; /* its git status, 0 until it's first drawn */
+	int countstate, children; /* how many entries a directory has, counted in the background */
 };
 
 typedef struct Files Files;
 struct Files {
 	FileElem *contents;
 	int end, n;
+	int offset, total; /* for a window over a large listing, what it starts after and how big the listing is */
+};
+
+/* a directory too big for memory, sorted on disk: the header and the offsets of the names in one file,
+ * the names (each after its mode) in another, both mmap'd
+ */
+typedef struct LargeHeader LargeHeader;
+struct LargeHeader {
+	unsigned int magic, version;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int flags, total;
+};
+
+typedef struct LargeListing LargeListing;
+struct LargeListing {
+	LargeHeader *header;
+	unsigned long long *offsets;
+	char *names;
+	size_t headersize, namessize;
+	int namesfd;
+};
+
+/* a sorted run being merged */
+typedef struct LargeRun LargeRun;
+struct LargeRun {
+	char *map, *pos;
+	size_t size;
+};
+
+/* on-disk listing index, mmap'd as header, entries then the names */
+typedef struct IndexHeader IndexHeader;
+struct IndexHeader {
+	unsigned int magic, version;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int flags, n;
+	size_t namessize;
+};
+
+typedef struct IndexEntry IndexEntry;
+struct IndexEntry {
+	size_t nameoffset;
+	unsigned int statmask;
+	mode_t mode;
+	int islink;
+	off_t size;
+	time_t mtime;
+};
+
+typedef struct DaemonRequest DaemonRequest;
+struct DaemonRequest {
+	unsigned int magic;
+	int flags;
+	char path[PATH_MAX];
+};
+
+/* a listing held by the daemon, serialized like the on-disk index in a sealed memfd */
+typedef struct CachedListing CachedListing;
+struct CachedListing {
+	char path[PATH_MAX];
+	int flags, memfd, wd;
+	time_t lastused;
+};
+
+typedef struct Revalidation Revalidation;
+struct Revalidation {
+	char path[PATH_MAX];
+	struct stat dirstat;
+	int dirsfirst, hidden, generation, namesonly;
+	Files list;
+};
+
+/* a listing read ahead while waiting for a key, used only while the directory's mtime is what it was before reading it */
+typedef struct Prefetched Prefetched;
+struct Prefetched {
+	char path[PATH_MAX];
+	struct stat dirstat;
+	int flags;
+	int current, topofscreen; /* where the cursor was when it was left, 0 if it was read ahead */
+	long long lastused;
+	Files list;
+};
+
+/* a tab while another one is shown: its directories stay open and its listing is held here, not in the cache the
+ * reading ahead fills, so showing it again doesn't read anything
+ */
+typedef struct Tab Tab;
+struct Tab {
+	char cwd[PATH_MAX], dirpaths[COLUMNS_MAX+1][PATH_MAX];
+	int dirfds[COLUMNS_MAX+1], ndirfds;
+	struct TabListing *listing; /* NULL if there's no listing of cwd to keep (a virtual or large one), it's read again */
+	int current, topofscreen, sortbydirectories, hiddenfiles;
+};
+
+/* a listing kept for the tabs, one for each directory (and sort and filters) however many tabs are on it */
+typedef struct TabListing TabListing;
+struct TabListing {
+	Files list; /* empty while it's lent to the tab that's shown, which works on it as fileslist */
+	struct stat st;
+	int flags, refs, lent;
+};
+
+typedef struct PrefetchJob PrefetchJob;
+struct PrefetchJob {
+	char **paths, cwd[PATH_MAX];
+	int n, size, flags;
+	int parent; /* which of paths has its subdirectories added after it */
+};
+
+typedef struct MetaRequest MetaRequest;
+struct MetaRequest {
+	const char *name;
+	int index, err;
+	struct statx stx;
+};
+
+typedef struct MetaBatch MetaBatch;
+struct MetaBatch {
+	int dirfd, n, next;
+	unsigned int mask;
+	MetaRequest *reqs;
+};
+
+typedef struct Uring Uring;
+struct Uring {
+	int fd;
+	unsigned int entries, *sqhead, *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+typedef struct PreviewElem PreviewElem;
+struct PreviewElem {
+	char name[NAME_MAX];
+	int isdir, needsstat, islink;
+	mode_t type;
+};
+
+/* what a repository's .git/index remembers of a file, the stat data is cut to 32 bits like git does */
+typedef struct GitEntry GitEntry;
+struct GitEntry {
+	char *path; /* from the root of the repository */
+	size_t offset;
+	unsigned int mtime, mtimens, ino, mode, size;
+	int stage; /* not 0 while it's in a conflict */
+};
+
+typedef struct GitRepo GitRepo;
+struct GitRepo {
+	char root[PATH_MAX], gitdir[PATH_MAX];
+	struct stat indexstat; /* the index is read again when this changes */
+	GitEntry *entries; /* sorted by path, like in the index */
+	char *paths;
+	int n;
+	int broken; /* its index couldn't be read, nothing in it is marked */
+	long long lastused;
+};
+
+typedef struct GitMark GitMark;
+struct GitMark {
+	char *name;
+	char mark; /* M modified, ? untracked, U in a conflict */
+};
+
+/* the markers of the entries of one directory that have one, reused while neither the directory nor the index changed */
+typedef struct GitDirStatus GitDirStatus;
+struct GitDirStatus {
+	char path[PATH_MAX];
+	GitRepo *repo;
+	struct timespec dirmtime, indexmtime;
+	GitMark *marks;
+	int n, size;
+	int partial; /* only of the entries a preview shows, never reused */
+	long long lastused;
+};
+
+typedef struct GitPattern GitPattern;
+struct GitPattern {
+	char *pattern, *base; /* base is the directory of the .gitignore it's from, relative to the root */
+	int negate, dironly;
+};
+
+typedef struct GitIgnore GitIgnore;
+struct GitIgnore {
+	GitPattern *patterns;
+	int n, size;
+};
+
+/* an entry of the mount table, its filesystem is asked what it is the first time a directory on it is listed */
+typedef struct Mount Mount;
+struct Mount {
+	char dir[PATH_MAX];
+	int id, len, class;
+	int slow; /* it missed FS_DEADLINE_MS, only names are read from it */
+};
+
+/* a call made on a thread and waited on for FS_DEADLINE_MS, freed by whichever of the two is done with it last */
+typedef struct Bounded Bounded;
+struct Bounded {
+	void *(*func)(void *);
+	void (*release)(void *); /* frees arg once a call that was given up on ends */
+	void *arg;
+	int finished, abandoned;
+};
+
+typedef struct StatfsCall StatfsCall;
+struct StatfsCall {
+	char path[PATH_MAX];
+	struct statfs sf;
+	int err;
+};
+
+typedef struct PreviewRead PreviewRead;
+struct PreviewRead {
+	int fd, k, kept, total;
+	PreviewElem *heap;
+};
+
+typedef struct StatCall StatCall;
+struct StatCall {
+	MetaRequest *reqs;
+	char (*names)[NAME_MAX];
+	int n;
+};
+
+/* a directory to count the entries of, then the count */
+typedef struct CountRequest CountRequest;
+struct CountRequest {
+	char path[PATH_MAX], name[NAME_MAX];
+	int generation, index, count;
+	CountRequest *next;
+};
+
+typedef struct CountCached CountCached;
+struct CountCached {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int count;
+};
+
+/* an extension (or other suffix) from LS_COLORS and the colour pair made for it */
+typedef struct ColourExt ColourExt;
+struct ColourExt {
+	char *ext;
+	short pair;
+};
+
+/* what plugins registered, see plugin.h */
+typedef struct PluginKey PluginKey;
+struct PluginKey {
+	int key;
+	StuifmKeyHandler handler;
+	void *data;
+};
+
+typedef struct PluginDecorator PluginDecorator;
+struct PluginDecorator {
+	StuifmDecorator decorator;
+	void *data;
+};
+
+typedef struct PluginHook PluginHook;
+struct PluginHook {
+	int when;
+	StuifmHook hook;
+	void *data;
+};
+
+typedef struct Frecent Frecent;
+struct Frecent {
+	char *path;
+	double rank;
+	time_t atime;
+};
+
+/* on-disk frecency record, followed by the path and its terminating 0, in the database and in the log of visits */
+typedef struct FrecencyRecord FrecencyRecord;
+struct FrecencyRecord {
+	double rank;
+	long long atime;
+	unsigned short len;
+};
+
+/* xxh64, 4 independent lanes over 32 byte stripes */
+typedef struct HashState HashState;
+struct HashState {
+	unsigned long long v[4], total;
+	unsigned char buf[32];
+	int buflen;
+};
+
+typedef struct DupCandidate DupCandidate;
+struct DupCandidate {
+	char *path;
+	struct stat st;
+	unsigned long long partial, full;
+	int err;
+	struct DupCandidate *first; /* the first of its set, compared with it byte by byte */
+	int differs; /* from the first, the hashes were the same anyway */
+};
+
+typedef struct DupJob DupJob;
+struct DupJob {
+	DupCandidate **cands;
+	int n, next, full, compare;
+};
+
+/* a stack of paths shared by worker threads, done when it's empty and nobody is working on anything */
+typedef struct WorkQueue WorkQueue;
+struct WorkQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **items;
+	int n, size, active;
+	void (*process)(WorkQueue *q, char *item);
+	void *ctx;
+};
+
+/* a content search, it runs in the background and what it finds waits in found until it's moved into the listing */
+typedef struct GrepJob GrepJob;
+struct GrepJob {
+	char pattern[PATH_MAX], **roots;
+	size_t patternlen;
+	regex_t regex;
+	int nroots, literal, hidden, generation, stop, done;
+	pthread_mutex_t lock;
+	Files found;
+	long long lines;
+};
+
+typedef struct CompareEntry CompareEntry;
+struct CompareEntry {
+	char *name;
+	mode_t mode;
+	off_t size;
+	struct timespec mtime;
+};
+
+typedef struct CompareResult CompareResult;
+struct CompareResult {
+	char *rel;
+	int mark;
+	mode_t mode;
+	off_t size;
+};
+
+typedef struct CompareJob CompareJob;
+struct CompareJob {
+	char *a, *b;
+	pthread_mutex_t lock;
+	CompareResult *results;
+	int n, size;
+	long long compared, copied, failed;
+};
+
+/* a member of an archive, offset is where its data starts (in the uncompressed stream for tars) */
+typedef struct ArchiveMember ArchiveMember;
+struct ArchiveMember {
+	char *name;
+	off_t offset, size, csize;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+	int method; /* zip only */
+};
+
+/* built by reading the archive once, kept as long as the archive isn't changed */
+typedef struct ArchiveIndex ArchiveIndex;
+struct ArchiveIndex {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int type, n, size;
+	ArchiveMember *members;
+	long long lastused;
+};
+
+/* a deque per worker, it takes the newest of its own items and steals the oldest ones (the biggest subtrees) from the others */
+typedef struct StealDeque StealDeque;
+struct StealDeque {
+	pthread_mutex_t lock;
+	void **items;
+	int head, tail, size;
+};
+
+typedef struct StealPool StealPool;
+struct StealPool {
+	StealDeque *deques;
+	int nworkers, started;
+	long outstanding; /* queued or being processed */
+	void (*process)(StealPool *pool, int worker, void *item);
+	void *ctx;
+};
+
+/* a directory being deleted, pending counts its own scan and the subdirectories that aren't gone yet */
+typedef struct DeleteNode DeleteNode;
+struct DeleteNode {
+	char name[NAME_MAX];
+	DeleteNode *parent;
+	int parentfd, fd; /* what it's in, kept open by the parent until its last subdirectory is done, and itself */
+	int pending;
+};
+
+typedef struct DeleteJob DeleteJob;
+struct DeleteJob {
+	int counting;
+	long long entries, deleted, failed;
+};
+
+/* keeps the last line of a command's output */
+typedef struct LastLine LastLine;
+struct LastLine {
+	char buf[PATH_MAX], line[PATH_MAX];
+	int k, ok;
 };
 
 typedef struct Arg Arg;
@@ -78,11 +594,87 @@ struct Key {
 	int chr; /* this is int not a char, but i feel like the name chr is more descriptive */
 	void (*func)(const Arg *arg);
 	const Arg arg;
+	int readsinput; /* ReadsInput if func reads keys from the terminal itself (a prompt), no keys are read ahead of it */
 };
 
 /* function declarations */
 static void initialization(void);
 static void getcurrentfiles(void);
+static void scandirectory(int fd, char *dirpath, Files *list, int dirsfirst, int hidden, int namesonly);
+static void opendirfds(void);
+static int  countentries(int fd, int limit);
+static int  largecompare(const char *a, const char *b, int dirsfirst);
+static int  largerecordcompare(const void *a, const void *b, void *arg);
+static FILE *createprivate(char *path);
+static int  openprivate(char *path);
+static int  writerun(char *base, int nrun, char *arena, unsigned int *recs, int n, int dirsfirst);
+static void largesiftdown(LargeRun *runs, int *heap, int n, int i, int dirsfirst);
+static int  mergeruns(char *base, int nruns, LargeHeader *header, int dirsfirst);
+static int  buildlarge(char *base, LargeHeader *header, int dirsfirst, int hidden);
+static int  openlarge(struct stat *dirstat);
+static void prunecache(char *dir, char *prefix, int days);
+static void closelarge(void);
+static void seekwindow(int pos);
+static int  largescan(regex_t *regex, int from, int to, int last);
+static void largesearch(int direction);
+static int  indexflags(int dirsfirst, int hidden);
+static void indexpath(char *buf, dev_t dev, ino_t ino, int flags);
+static int  readindex(char *dirpath, struct stat *dirstat, Files *list);
+static IndexHeader *checkindex(void *map, size_t size, struct stat *dirstat);
+static int  loadindex(void *map, size_t size, char *dirpath, struct stat *dirstat, Files *list);
+static char *indexname(IndexHeader *header, IndexEntry *entry);
+static void writeindex(struct stat *dirstat, Files *list);
+static void serializeindex(FILE *fp, struct stat *dirstat, Files *list, int flags);
+static int  privatedir(char *buf, char *xdg, char *fallback);
+static int  daemonsocketpath(char *buf);
+static int  peerisuser(int sock);
+static void *daemonlisting(char *dirpath, int flags, size_t *size);
+static int  daemonserve(int client, CachedListing *listings, int inotifyfd);
+static void daemoninvalidate(CachedListing *listings, int inotifyfd, int wd);
+static int  rundaemon(void);
+static Revalidation *newrevalidation(struct stat *dirstat);
+static void startrevalidation(struct stat *dirstat);
+static void *revalidate(void *arg);
+static int  checkbackground(void);
+static void prefetchadd(PrefetchJob *job, char *path);
+static void startprefetch(void);
+static void freeprefetchjob(PrefetchJob *job);
+static void *prefetchworker(void *arg);
+static void prefetchdirectory(PrefetchJob *job, char *path, int addsubdirs);
+static Prefetched *findprefetched(char *path, struct stat *dirstat, int flags);
+static void dropprefetched(Prefetched *p);
+static void storeprefetched(char *path, struct stat *dirstat, int flags, Files *list, int cursor, int top);
+static int  takeprefetched(char *path, struct stat *dirstat, Files *list, int *cursor, int *top);
+static void parklisting(void);
+static void settlelisting(Files *list);
+static void showtab(int n);
+static void stashtab(Tab *t);
+static void restoretab(Tab *t);
+static void droptab(Tab *t);
+static int  listingkeepable(void);
+static TabListing *sharelisting(void);
+static int  givebacklisting(Tab *t);
+static void droplisting(TabListing **l);
+static void loadfrecency(void);
+static void savefrecency(void);
+static void readfrecency(void);
+static int  writefrecency(void);
+static void replayvisits(int logfd);
+static void freefrecency(void);
+static void visitdirectory(char *path);
+static void applyvisit(char *path, time_t when);
+static double frecencyscore(Frecent *f, time_t now);
+static int  frecencymatches(char *path, char *query);
+static int  frecencycompare(const void *a, const void *b);
+static void rdrwjump(char *query, int *matches, int nmatches, int sel);
+static void batchstatx(int dirfd, MetaRequest *reqs, int n, unsigned int mask);
+static int  uringsetup(void);
+static int  uringstatx(int dirfd, MetaRequest *reqs, int n, unsigned int mask);
+static void uringreap(MetaRequest *reqs, int *done, int *inflight);
+static void *statxworker(void *arg);
+static void runworkers(int nthreads, void *(*func)(void *), void *arg);
+static void applystatx(FileElem *elem, struct statx *stx);
+static void statvisible(void);
 static void addelem(Files *list, char *path, char *name);
 static void freelistcontents(Files *list);
 static void rmvselection(char *path, char *name);
@@ -90,13 +682,87 @@ static int  isselected(char *path, char *name);
 static void resizedetected(void);
 static void rdrwf(void);
 static void rdrwfmaincolumn(int column, int size);
-static void rdrwfsecondarycolumn(char *comingfrom, char *pathtodraw, int column, int size, int direction, char *highlightedname);
+static void rdrwfsecondarycolumn(int dirfd, char *dirpath, char *comingfrom, int column, int size, int direction, char *highlightedname, GitDirStatus **git);
 static void rdrwfhelper(void);
+static int  previewdirectory(int fd, PreviewElem *heap, int k, int *total);
+static int  previewfromindex(void *map, size_t size, struct stat *dirstat, PreviewElem *heap, int k, int *total);
+static void previewpush(PreviewElem *heap, int *n, int k, PreviewElem *elem);
+static int  previewcompare(const void *a, const void *b);
+static void previewsiftdown(PreviewElem *heap, int n, int i);
 static int  iscurrentonscreen(void);
 static char *getreadablefs(double size, char *ret);
 static char *escapestring(char *str, size_t n);
+static int  joinsprevious(wchar_t *prev, wchar_t wc);
+static int  widestring(const char *str, wchar_t *wstr, int n);
+static int  namewidth(const char *name);
+static void drawcell(int pair, int line, int column, int size, int issel, int isdir, const wchar_t *wstr, int width);
+static void drawtext(int pair, int line, int column, int size, int issel, int isdir, const char *str);
+static void buildkeytable(void);
+static int  keyreadsinput(int c);
+static int  motiondelta(int c);
+static int  readinput(int c, int *input);
+static int  dispatchinput(int *input, int n);
+static long long msnow(void);
 static void loop(void);
+static int  unescapekeys(char *src, char *dst);
+static int  replay(char *script, char *dir);
+static int  replayhome(char *home);
+static int  removeentry(const char *path, const struct stat *st, int type, struct FTW *ftw);
 static void cleanup(void);
+static void startvirtuallisting(int kind, char *label);
+static char *elempath(FileElem *elem, char *buf);
+static char *displayname(FileElem *elem, char *buf);
+static void drawstatus(char *msg);
+static int  prompt(char *question, char *buf, size_t size);
+static void queuepush(WorkQueue *q, char *item);
+static void *queueworker(void *arg);
+static void runqueue(WorkQueue *q, char **first, int n);
+static int  readcompareentries(char *dir, CompareEntry **entries);
+static int  compareentrycompare(const void *a, const void *b);
+static int  compareresultcompare(const void *a, const void *b);
+static void addcompareresult(CompareJob *job, char *rel, char *name, int mark, CompareEntry *e);
+static void compareprocess(WorkQueue *q, char *rel);
+static void syncprocess(WorkQueue *q, char *rel);
+static int  copyfile(char *src, char *dst, struct stat *st);
+static void runcompare(char *a, char *b);
+static void *greprunner(void *arg);
+static void grepprocess(WorkQueue *q, char *path);
+static int  grepbuffer(GrepJob *job, char *text, size_t len);
+static int  checkgrep(void);
+static void freegrepjob(GrepJob *job);
+static void stealpush(StealPool *pool, int worker, void *item);
+static void *stealpop(StealPool *pool, int worker);
+static void *stealworker(void *arg);
+static void runstealpool(StealPool *pool, void **items, int n);
+static void deleteprocess(StealPool *pool, int worker, void *item);
+static long long walkdelete(char **paths, int n, int counting, long long *failed);
+static int  archivetype(char *path);
+static ArchiveMember *addmember(ArchiveIndex *index, char *name);
+static off_t tarnumber(unsigned char *field, int len);
+static int  indextar(char *path, ArchiveIndex *index);
+static int  indexzip(char *path, ArchiveIndex *index);
+static ArchiveIndex *loadarchive(char *path);
+static void listarchive(char *select);
+static int  archiveelemcompare(const void *a, const void *b);
+static int  openarchive(char *path);
+static int  extracttar(ArchiveMember *m, int out);
+static int  extractzip(ArchiveMember *m, int out);
+static void hashinit(HashState *h);
+static void hashupdate(HashState *h, const unsigned char *data, size_t n);
+static unsigned long long hashfinal(HashState *h);
+static int  hashfile(char *path, off_t size, int partial, unsigned long long *out);
+static int  samecontent(char *a, char *b);
+static void dupwalk(char *path, DupCandidate **cands, int *n, int *size);
+static void *duphashworker(void *arg);
+static int  dupcompare(const void *a, const void *b);
+static int  dupinodecompare(const void *a, const void *b);
+static void restorescreen(void);
+static void feedlastline(LastLine *l, char *data, ssize_t n, int echo);
+static int  spawncommand(char *command, int echo, LastLine *l);
+static int  startcoprocess(void);
+static void stopcoprocess(void);
+static int  coprocesscommand(char *command, LastLine *l);
+static void movecursor(int delta);
 static void movev(const Arg *arg);
 static void moveh(const Arg *arg);
 static void first(const Arg *arg);
@@ -109,29 +775,181 @@ static void selectall(const Arg *arg);
 static void directoriesfirst(const Arg *arg);
 static void hiddenfilesswitch(const Arg *arg);
 static void search(const Arg *arg);
+static void jump(const Arg *arg);
+static void findduplicates(const Arg *arg);
+static void contentsearch(const Arg *arg);
+static void comparedirectories(const Arg *arg);
+static void syncdirectories(const Arg *arg);
+static void extractmember(const Arg *arg);
+static void deleteselection(const Arg *arg);
+static void newtab(const Arg *arg);
+static void switchtab(const Arg *arg);
+static void closetab(const Arg *arg);
+static void loadplugins(void);
+static void runhooks(int when, int key);
+static int  pluginbound(int key);
+static int  apicount(void);
+static int  apicurrent(void);
+static const char *apiname(int index);
+static const char *apidirectory(int index);
+static unsigned int apiknown(int index);
+static unsigned int apimode(int index);
+static long long apifilesize(int index);
+static long long apimtime(int index);
+static const char *apicwd(void);
+static int  apiselected(void);
+static const char *apiselectedname(int index);
+static const char *apiselecteddirectory(int index);
+static int  apiisselected(int index);
+static void apisetstatus(const char *message);
+static void apisetcurrent(int index);
+static void apireload(void);
+static int  apibindkey(int key, StuifmKeyHandler handler, void *data);
+static int  apidecorate(StuifmDecorator decorator, void *data);
+static int  apihook(int when, StuifmHook hook, void *data);
 static void executecommand(const Arg *arg);
+static void loadlscolours(void);
+static short sgrpair(char *sgr);
+static unsigned int hashext(char *ext, size_t len);
+static short filepair(char *name, mode_t mode, int islink);
+static short elempair(FileElem *elem);
+static GitRepo *findrepo(char *dirpath, char *rel);
+static void readgitindex(GitRepo *repo, char *path, struct stat *st);
+static void freegitrepo(GitRepo *repo);
+static int  gitlowerbound(GitRepo *repo, char *path);
+static void loadgitignore(GitIgnore *ign, char *file, char *base);
+static int  gitignored(GitIgnore *ign, char *rel, char *name, int isdir);
+static void freegitignore(GitIgnore *ign);
+static GitDirStatus *gitstatus(char *dirpath, int dirfd, PreviewElem *only, int nonly);
+static char gitmark(GitDirStatus *status, char *name);
+static int  gitmarkcompare(const void *a, const void *b);
+static void drawmarker(int pair, int line, int column, char mark);
+static void requestcount(FileElem *elem, int index);
+static void *countworker(void *arg);
+static int  checkcounts(void);
+static void readmounts(void);
+static Mount *mountof(char *path);
+static int  fsremote(Mount *m);
+static void *statfscall(void *arg);
+static int  boundedcall(void *(*func)(void *), void *arg, void (*release)(void *));
+static void *boundedrunner(void *arg);
+static void slowmount(Mount *m);
+static int  isdegraded(void);
+static void readremote(struct stat *dirstat);
+static void *previewreader(void *arg);
+static void freepreviewread(void *arg);
+static void *statcall(void *arg);
+static void freestatcall(void *arg);
 
 /* global variables */
 static Files selected;
 static Files fileslist;
 static int  maxy, maxx, current = 1, topofscreen = 1, sortbydirectories = 0, hiddenfiles = 0, cratio = 0;
-static char status[NAME_MAX], pattern[PATH_MAX], cwd[PATH_MAX];
+static char status[NAME_MAX], pattern[PATH_MAX], cwd[PATH_MAX], listinglabel[PATH_MAX];
+static int listingkind = ListingDirectory; /* the label is what's shown, this is what's checked */
+static char comparea[PATH_MAX], compareb[PATH_MAX];
+static char archivepath[PATH_MAX], archivedir[PATH_MAX]; /* set while browsing an archive */
+static int  replaying = 0; /* headless, the screen is made by replay() */
+static LargeListing large = {.namesfd = -1};
+static int  dirfds[COLUMNS_MAX+1], ndirfds = 0; /* cwd and the directories above it, [0] is cwd */
+static char dirpaths[COLUMNS_MAX+1][PATH_MAX];
+static int  previewfd = -1; /* the directory shown right of the current column */
+static char previewpath[PATH_MAX];
+static pthread_mutex_t backgroundlock = PTHREAD_MUTEX_INITIALIZER;
+static Revalidation *revalidated;
+static int  revalidationgeneration = 0, backgroundpending = 0;
+static int  revalidationsended = 0; /* since checkbackground last looked, kept or not */
+static pthread_mutex_t prefetchlock = PTHREAD_MUTEX_INITIALIZER;
+static Prefetched prefetched[PREFETCH_SLOTS];
+static size_t prefetchedbytes = 0;
+static long long prefetchclock = 0;
+static int  prefetchwanted = 0, prefetchrunning = 0, prefetchstop = 0;
+static struct stat listingstat; /* of cwd when fileslist was read */
+static int  listingflags = -1; /* its indexflags, -1 if it can't be put in the cache when it's left */
+static GrepJob *grepjob;
+static short typepairs[ColourLast], dynamicpairs[DYNAMIC_PAIRS][2];
+static int  ndynamicpairs = 0, lscoloursloaded = 0;
+static ColourExt *extpairs, *suffixpairs;
+static GitRepo gitrepos[GIT_REPO_CACHE];
+static GitDirStatus gitdirs[GIT_DIR_CACHE];
+static GitDirStatus *cwdgit, *previewgit; /* NULL outside of repositories */
+static int previewgitasked = 1; /* previewgit is worked out once for each directory previewed */
+static long long gitclock = 0;
+static pthread_mutex_t countlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t countcond = PTHREAD_COND_INITIALIZER;
+static CountRequest *countqueue, *countdone;
+static CountCached countcache[COUNT_CACHE];
+static int  countthreads = 0, countpending = 0;
+static pthread_mutex_t boundedlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t boundedcond = PTHREAD_COND_INITIALIZER;
+static Mount *mounts, *cwdmount; /* cwdmount is NULL if cwd isn't in the table */
+static int  nmounts = 0, mountssize = 0;
+static FILE *mountsfile;
+static int  extsize = 0, nsuffixes = 0;
+static Frecent *frecent;
+static int  nfrecent = 0, frecentsize = 0;
+static time_t frecencynow;
+static pthread_t uringthread; /* the ring is only used from the thread that draws, others never wait on it */
+static int  uringowned = 0;
+static Uring uring = {.fd = -1};
+static int  uringavailable = -1;
+static int  keyfirst[KEYTABLE_SIZE];
+static int  coprocessin = -1, coprocessout = -1, coprocessseq = 0;
+static pid_t coprocesspid = -1;
+static PluginKey *pluginkeys;
+static PluginDecorator *decorators;
+static PluginHook *pluginhooks;
+static int  npluginkeys = 0, ndecorators = 0, npluginhooks = 0;
+static const StuifmApi pluginapi = {
+	.abi = STUIFM_PLUGIN_ABI,
+	.size = sizeof(StuifmApi),
+	.count = apicount,
+	.current = apicurrent,
+	.name = apiname,
+	.directory = apidirectory,
+	.known = apiknown,
+	.mode = apimode,
+	.filesize = apifilesize,
+	.mtime = apimtime,
+	.cwd = apicwd,
+	.selected = apiselected,
+	.selectedname = apiselectedname,
+	.selecteddirectory = apiselecteddirectory,
+	.isselected = apiisselected,
+	.setstatus = apisetstatus,
+	.setcurrent = apisetcurrent,
+	.reload = apireload,
+	.bindkey = apibindkey,
+	.decorate = apidecorate,
+	.hook = apihook,
+};
+extern char **environ;
 
 #include "config.h"
 
+static int  keynext[LENGTH(keys)];
+static ArchiveIndex archives[ARCHIVE_CACHE];
+static Tab tabs[TABS_MAX];
+static TabListing tablistings[TABS_MAX];
+static int  ntabs = 1, currenttab = 0;
+static char indexdir[PATH_MAX] = INDEX_PATH, frecencypath[PATH_MAX] = FRECENCY_PATH; /* replay() points them into its own home */
+
 /* function definitions */
 void
 initialization(void)
 {
 	static int executedbefore = 0;
+	int i;
 
 	if (!executedbefore) {
 		sortbydirectories = DIRECTORIESFIRST;
 		hiddenfiles = HIDDENFILES;
+		uringthread = pthread_self();
+		uringowned = 1;
 		executedbefore = 1;
 	}
 
-	initscr();
+	if (!replaying) initscr();
 	cbreak();
 	noecho();
 	start_color();
@@ -141,805 +959,6599 @@ initialization(void)
 	init_pair(4, DIRECTORYCOLOR, SELECTEDCOLOR);
 	init_pair(5, COLOR_BLACK, COLOR_RED);
 	init_pair(7, COLOR_BLACK, COLOR_WHITE);
+	init_pair(PairNew, COLOR_GREEN, COLOR_BLACK);
+	init_pair(PairMissing, COLOR_RED, COLOR_BLACK);
+	init_pair(PairChanged, COLOR_YELLOW, COLOR_BLACK);
+	if (USELSCOLORS && !lscoloursloaded) {
+		loadlscolours();
+		lscoloursloaded = 1;
+	}
+	for (i = 0; i < ndynamicpairs; i++) {
+		init_pair(PairDynamic+i, dynamicpairs[i][0], dynamicpairs[i][1]);
+	}
 	scrollok(stdscr, 1);
 	getmaxyx(stdscr, maxy, maxx);
 }
 
 void
-getcurrentfiles(void)
+loadlscolours(void) /* LS_COLORS is parsed once, every entry gets its colour pair right away */
 {
-	freelistcontents(&fileslist);
-
-	int lendir = -1, i;
-	struct dirent **namelist;
-	struct stat pathstat;
-
-	getcwd(cwd, sizeof(cwd));
-	lendir = scandir(".", &namelist, 0, alphasort);
-
-	if (lendir <= 0) return;
+	static const char *types[] = {[ColourDir] = "di", [ColourLink] = "ln", [ColourExec] = "ex", [ColourFifo] = "pi", \
+		[ColourSocket] = "so", [ColourBlock] = "bd", [ColourChar] = "cd", [ColourFile] = "fi"};
+	char *env, *spec, *entry, *value, *save;
+	int i, n = 0, next = 0;
+	short pair;
+
+	if ((env = getenv("LS_COLORS")) == NULL || (spec = strdup(env)) == NULL) return;
+
+	/* the table is twice as big as the number of entries, rounded to a power of two */
+	for (i = 0; spec[i]; i++) n += spec[i] == ':';
+	for (extsize = 16; extsize < 2*(n+1); extsize *= 2);
+	if ((extpairs = (ColourExt *)calloc(extsize, sizeof(ColourExt))) == NULL) {
+		perror("couldn't allocate memory for the colours");
+		exit(1);
+	}
 
-	if (sortbydirectories) {
-		/* put all directories except in . and .. */
-		for (i = 0; i < lendir; i++) {
-			if (stat(namelist[i]->d_name, &pathstat) == 0 && S_ISDIR(pathstat.st_mode) && \
-					strcmp(namelist[i]->d_name, ".") != 0 && \
-					strcmp(namelist[i]->d_name, "..") != 0 && \
-					(hiddenfiles == 0 ? namelist[i]->d_name[0] != '.' : 1))
-				addelem(&fileslist, cwd, namelist[i]->d_name);
-		}
-		/* then everything else */
-		for (i = 0; i < lendir; i++) {
-			if (stat(namelist[i]->d_name, &pathstat) == 0 && !S_ISDIR(pathstat.st_mode) && \
-					(hiddenfiles == 0 ? namelist[i]->d_name[0] != '.' : 1))
-				addelem(&fileslist, cwd, namelist[i]->d_name);
-		}
-		/* then free each element in namelist */
-		for (i = 0; i < lendir; i++) {
-			free(namelist[i]);
+	for (entry = strtok_r(spec, ":", &save); entry; entry = strtok_r(NULL, ":", &save)) {
+		if ((value = strchr(entry, '=')) == NULL) continue;
+		*value++ = 0;
+		if ((pair = sgrpair(value)) == 0) continue;
+
+		if (entry[0] == '*' && entry[1] == '.') {
+			/* extensions go in the hash table, open addressing with linear probing */
+			for (i = 0; entry[i+1]; i++) entry[i+1] = tolower((unsigned char)entry[i+1]);
+			for (i = hashext(entry+1, strlen(entry+1)) & (extsize-1); extpairs[i].ext && strcmp(extpairs[i].ext, entry+1) != 0; i = (i+1) & (extsize-1));
+			if (!extpairs[i].ext) extpairs[i].ext = strdup(entry+1);
+			extpairs[i].pair = pair;
+		} else if (entry[0] == '*' && entry[1]) {
+			/* other suffixes (like *~) are few, they're checked one by one */
+			if ((suffixpairs = (ColourExt *)realloc(suffixpairs, (next+1) * sizeof(ColourExt))) == NULL) {
+				perror("couldn't allocate memory for the colours");
+				exit(1);
+			}
+			suffixpairs[next].ext = strdup(entry+1);
+			suffixpairs[next++].pair = pair;
+		} else {
+			for (i = 0; i < ColourLast; i++) {
+				if (strcmp(entry, types[i]) == 0) typepairs[i] = pair;
+			}
 		}
-	} else {
-		for (i = 0; i < lendir; i++) {
-			if (strcmp(namelist[i]->d_name, ".") != 0 && \
-					strcmp(namelist[i]->d_name, "..") && \
-					(hiddenfiles == 0 ? namelist[i]->d_name[0] != '.' : 1)) {
-				addelem(&fileslist, cwd, namelist[i]->d_name);
-				free(namelist[i]);
+	}
+	nsuffixes = next;
+	free(spec);
+}
+
+short
+sgrpair(char *sgr) /* the colour pair for an LS_COLORS value like 01;34, 0 if it doesn't set a colour */
+{
+	short fg = -1, bg = -1;
+	int i, code, bold = 0;
+	char *p = sgr, *end;
+
+	while (*p) {
+		code = strtol(p, &end, 10);
+		if (end == p) break;
+		p = *end == ';' ? end+1 : end;
+
+		if (code == 1) bold = 1;
+		else if (code >= 30 && code <= 37) fg = code-30;
+		else if (code >= 40 && code <= 47) bg = code-40;
+		else if (code >= 90 && code <= 97) fg = code-90+8;
+		else if (code >= 100 && code <= 107) bg = code-100+8;
+		else if (code == 38 || code == 48) {
+			/* 38;5;n is one of 256 colours, 38;2;r;g;b is skipped */
+			code = code == 38;
+			if (strtol(p, &end, 10) == 5 && *end == ';') {
+				i = strtol(end+1, &end, 10);
+				if (code) fg = i;
+				else bg = i;
+				p = *end == ';' ? end+1 : end;
+			} else {
+				for (i = 0; i < 4 && *p; i++) p = strchr(p, ';') ? strchr(p, ';')+1 : p+strlen(p);
 			}
 		}
 	}
-	current = topofscreen = 1;
-	free(namelist);
+	if (fg < 0 && bg < 0) return 0;
+
+	/* like most terminals, bold makes the first eight colours bright */
+	if (bold && fg >= 0 && fg < 8 && COLORS >= 16) fg += 8;
+	if (fg < 0 || fg >= COLORS) fg = COLOR_WHITE;
+	if (bg < 0 || bg >= COLORS) bg = COLOR_BLACK;
+
+	/* pairs are only made for combinations that aren't there yet */
+	for (i = 0; i < ndynamicpairs; i++) {
+		if (dynamicpairs[i][0] == fg && dynamicpairs[i][1] == bg) return PairDynamic+i;
+	}
+	if (PairDynamic+ndynamicpairs >= MIN(COLOR_PAIRS, PairDynamic+DYNAMIC_PAIRS)) return 0;
+	dynamicpairs[ndynamicpairs][0] = fg;
+	dynamicpairs[ndynamicpairs][1] = bg;
+	init_pair(PairDynamic+ndynamicpairs, fg, bg);
+	return PairDynamic+ndynamicpairs++;
 }
 
-void
-rmvselection(char *path, char *name)
+unsigned int
+hashext(char *ext, size_t len) /* fnv-1a */
 {
-	if (!selected.contents) return;
+	unsigned int h = 2166136261u;
+	size_t i;
 
-	int i, found = 0;
-	for (i = 1; i <= selected.end; i++) {
-		if (strcmp(selected.contents[i].path, path) == 0 && strcmp(selected.contents[i].name, name) == 0) {
-			found = 1;
-		}
+	for (i = 0; i < len; i++) h = (h ^ (unsigned char)ext[i]) * 16777619u;
+	return h;
+}
 
-		if (found) { /* this to remove the element instead of 2 for loops */
-			strncpy(selected.contents[i].path, selected.contents[i+1].path, PATH_MAX);
-			strncpy(selected.contents[i].name, selected.contents[i+1].name, NAME_MAX);
+short
+filepair(char *name, mode_t mode, int islink) /* the colour pair of an entry that isn't selected or current */
+{
+	char ext[NAME_MAX], *p;
+	size_t len, namelen;
+	int i, j;
+
+	if (islink && typepairs[ColourLink]) return typepairs[ColourLink];
+	if (S_ISDIR(mode)) return typepairs[ColourDir] ? typepairs[ColourDir] : 3;
+	if (S_ISFIFO(mode) && typepairs[ColourFifo]) return typepairs[ColourFifo];
+	if (S_ISSOCK(mode) && typepairs[ColourSocket]) return typepairs[ColourSocket];
+	if (S_ISBLK(mode) && typepairs[ColourBlock]) return typepairs[ColourBlock];
+	if (S_ISCHR(mode) && typepairs[ColourChar]) return typepairs[ColourChar];
+	if (S_ISREG(mode) && mode & 0111 && typepairs[ColourExec]) return typepairs[ColourExec];
+
+	/* the longest extension first, so .tar.gz wins over .gz */
+	for (p = strchr(name+1, '.'); extpairs && p; p = strchr(p+1, '.')) {
+		len = strlen(p);
+		for (i = 0; i < (int)len && i < NAME_MAX-1; i++) ext[i] = tolower((unsigned char)p[i]);
+		ext[i] = 0;
+		for (j = hashext(ext, i) & (extsize-1); extpairs[j].ext; j = (j+1) & (extsize-1)) {
+			if (strcmp(extpairs[j].ext, ext) == 0) return extpairs[j].pair;
 		}
 	}
+	namelen = strlen(name);
+	for (i = 0; i < nsuffixes; i++) {
+		len = strlen(suffixpairs[i].ext);
+		if (len <= namelen && strcmp(name+namelen-len, suffixpairs[i].ext) == 0) return suffixpairs[i].pair;
+	}
 
-	if (found) selected.end--;
+	return typepairs[ColourFile] ? typepairs[ColourFile] : 1;
 }
 
-void
-addelem(Files *list, char *path, char *name)
+short
+elempair(FileElem *elem) /* resolved the first time the entry is drawn, then kept with it until its mode changes */
 {
-	if (list->contents == NULL) {
-		list->contents = (FileElem *)malloc(N * sizeof(FileElem));
-		list->n = N;
-		list->end = 0;
-	} else if (list->end+1 >= list->n) {
-		list->contents = (FileElem *)realloc(list->contents, (list->n + N) * sizeof(FileElem));
-		list->n += N;
+	/* the permissions, for the colour of executables, come with statvisible's batch; without them (slow filesystems) it's by type */
+	if (elem->pair) return elem->pair;
+	elem->pair = filepair(elem->name, elem->mode, elem->islink);
+	return elem->pair;
+}
+
+GitRepo *
+findrepo(char *dirpath, char *rel) /* the repository dirpath is in, with dirpath relative to its root (ending with a / unless it's the root) in rel */
+{
+	GitRepo *repo = NULL;
+	struct stat st;
+	char root[PATH_MAX], gitdir[PATH_MAX], line[PATH_MAX], *p;
+	FILE *fp;
+	int i;
+
+	/* the closest .git going up, a file in it means a worktree or submodule and says where the real one is */
+	strncpy(root, dirpath, PATH_MAX);
+	for (;;) {
+		snprintf(gitdir, PATH_MAX, "%s/.git", strcmp(root, "/") == 0 ? "" : root);
+		if (lstat(gitdir, &st) == 0) break;
+		if (strcmp(root, "/") == 0 || (p = strrchr(root, '/')) == NULL) return NULL;
+		if (p == root) p[1] = 0;
+		else p[0] = 0;
+	}
+	if (S_ISREG(st.st_mode)) {
+		if ((fp = fopen(gitdir, "r")) == NULL) return NULL;
+		p = fgets(line, PATH_MAX, fp);
+		fclose(fp);
+		if (!p || strncmp(line, "gitdir: ", 8) != 0) return NULL;
+		line[strcspn(line, "\n")] = 0;
+		if (line[8] == '/') strncpy(gitdir, line+8, PATH_MAX);
+		else snprintf(gitdir, PATH_MAX, "%s/%s", root, line+8);
+	} else if (!S_ISDIR(st.st_mode)) {
+		return NULL;
 	}
 
-	if (list->contents == NULL) {
-		perror("couldn't allocate memory for the file contents");
-		exit(1);
+	/* nothing inside .git itself is shown */
+	i = strlen(root);
+	p = dirpath + (strcmp(root, "/") == 0 ? 1 : i+1);
+	if (strncmp(p, ".git", 4) == 0 && (p[4] == 0 || p[4] == '/')) return NULL;
+	if (dirpath[i] == 0 || (strcmp(root, "/") == 0 && dirpath[1] == 0)) rel[0] = 0;
+	else snprintf(rel, PATH_MAX, "%s/", p);
+
+	for (i = 0; i < GIT_REPO_CACHE; i++) {
+		if (gitrepos[i].root[0] && strcmp(gitrepos[i].root, root) == 0) {
+			repo = &gitrepos[i];
+			break;
+		}
+		if (!repo || gitrepos[i].lastused < repo->lastused) repo = &gitrepos[i];
 	}
-	
-	list->end++; /* this means that lists are 1 indexed, because list->end is initially 0 */
-	strncpy(list->contents[list->end].path, path, PATH_MAX);
-	strncpy(list->contents[list->end].name, name, NAME_MAX);
+	if (strcmp(repo->root, root) != 0) {
+		freegitrepo(repo);
+		strncpy(repo->root, root, PATH_MAX);
+		strncpy(repo->gitdir, gitdir, PATH_MAX);
+	}
+	repo->lastused = ++gitclock;
+
+	/* the index is read again only if it changed */
+	snprintf(line, PATH_MAX, "%s/index", repo->gitdir);
+	if (stat(line, &st) != 0) {
+		memset(&repo->indexstat, 0, sizeof(struct stat));
+		repo->n = 0;
+		repo->broken = 0; /* nothing was added yet */
+	} else if (st.st_ino != repo->indexstat.st_ino || st.st_size != repo->indexstat.st_size || \
+			st.st_mtim.tv_sec != repo->indexstat.st_mtim.tv_sec || st.st_mtim.tv_nsec != repo->indexstat.st_mtim.tv_nsec) {
+		readgitindex(repo, line, &st);
+	}
+	return repo->broken ? NULL : repo;
 }
 
 void
-freelistcontents(Files *list)
+readgitindex(GitRepo *repo, char *path, struct stat *st)
 {
-	if (list->contents == NULL) return;
-	free(list->contents);
-	list->contents = NULL;
-	list->n = 0;
-	list->end = 0;
+	unsigned char *map, *p, *end;
+	char *grown;
+	unsigned int version, n, i, flags, hashsize = 20;
+	size_t strip, len, prevlen = 0, total = 0, prev = 0, arenasize;
+	char config[PATH_MAX], line[NAME_MAX];
+	FILE *fp;
+	int fd, c;
+
+	free(repo->entries);
+	free(repo->paths);
+	repo->entries = NULL;
+	repo->paths = NULL;
+	repo->n = 0;
+	repo->broken = 1; /* until it's read */
+	repo->indexstat = *st;
+
+	/* sha256 repositories have longer object names in the index */
+	snprintf(config, PATH_MAX, "%s/config", repo->gitdir);
+	if ((fp = fopen(config, "r")) != NULL) {
+		while (fgets(line, NAME_MAX, fp)) {
+			if (strstr(line, "objectformat") && strstr(line, "sha256")) hashsize = 32;
+		}
+		fclose(fp);
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) return;
+	map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+	end = map + st->st_size;
+
+	if (st->st_size < 12 || memcmp(map, "DIRC", 4) != 0 || (version = BE32(map+4)) < 2 || version > 4) goto done;
+	/* the count comes from the file, it can't have more entries than fit in it: a corrupt index only goes without markers */
+	n = BE32(map+8);
+	if (n > (st->st_size-12) / (40+hashsize+2)) goto done;
+	arenasize = st->st_size;
+	if ((repo->entries = (GitEntry *)malloc(MAX(n, 1) * sizeof(GitEntry))) == NULL || \
+			(repo->paths = (char *)malloc(arenasize)) == NULL) {
+		goto done;
+	}
+
+	/* each entry: ctime, mtime, dev, ino, mode, uid, gid, size, the object name, flags and the path */
+	for (p = map+12, i = 0; i < n; i++) {
+		if (p+40+hashsize+2 > end) break;
+		flags = BE16(p+40+hashsize);
+		repo->entries[i].mtime = BE32(p+8);
+		repo->entries[i].mtimens = BE32(p+12);
+		repo->entries[i].ino = BE32(p+20);
+		repo->entries[i].mode = BE32(p+24);
+		repo->entries[i].size = BE32(p+36);
+		repo->entries[i].stage = (flags >> 12) & 3;
+		p += 40+hashsize+2;
+		if (version >= 3 && flags & 0x4000) p += 2;
+
+		/* version 4 only stores what differs from the previous path, after how much of its end to drop */
+		strip = prevlen; /* whole paths before version 4 */
+		if (version == 4) {
+			if (p >= end) break;
+			c = *p++;
+			strip = c & 127;
+			while (c & 128 && p < end) {
+				c = *p++;
+				strip = ((strip+1) << 7) | (c & 127);
+			}
+			if (strip > prevlen) break;
+		}
+		if ((len = strnlen((char *)p, end-p)) == (size_t)(end-p) || prevlen-strip+len >= PATH_MAX) break;
+		/* paths of version 4 can take more room than the index, they're kept as offsets until they're all read */
+		while (total + prevlen-strip + len+1 > arenasize) {
+			arenasize *= 2;
+			if ((grown = (char *)realloc(repo->paths, arenasize)) == NULL) goto done;
+			repo->paths = grown;
+		}
+		repo->entries[i].offset = total;
+		memmove(repo->paths+total, repo->paths+prev, prevlen-strip);
+		memcpy(repo->paths+total+prevlen-strip, p, len+1);
+		prev = total;
+		prevlen = prevlen-strip+len;
+		total += prevlen+1;
+
+		if (version == 4) p += len+1;
+		else p += 8 - ((40+hashsize+2 + (version >= 3 && flags & 0x4000 ? 2 : 0) + len) % 8) + len;
+	}
+	if (i < n) goto done; /* it ended early */
+	repo->n = i;
+	for (i = 0; i < (unsigned int)repo->n; i++) repo->entries[i].path = repo->paths+repo->entries[i].offset;
+	repo->broken = 0;
+
+done:
+	munmap(map, st->st_size);
 }
 
+void
+freegitrepo(GitRepo *repo)
+{
+	free(repo->entries);
+	free(repo->paths);
+	memset(repo, 0, sizeof(GitRepo));
+}
 
 int
-isselected(char *path, char *name)
+gitlowerbound(GitRepo *repo, char *path) /* the first entry that isn't before path */
 {
-	if (!selected.contents) return 0;
+	int lo = 0, hi = repo->n, mid;
 
-	int i = 1;
+	while (lo < hi) {
+		mid = (lo+hi)/2;
+		if (strcmp(repo->entries[mid].path, path) < 0) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
 
-	for (i = 1; i <= selected.end; i++) {
-		if (strcmp(selected.contents[i].path, path) == 0 && strcmp(selected.contents[i].name, name) == 0) {
-			return 1;
+void
+loadgitignore(GitIgnore *ign, char *file, char *base)
+{
+	char line[PATH_MAX];
+	FILE *fp;
+	size_t len;
+
+	if ((fp = fopen(file, "r")) == NULL) return;
+	while (fgets(line, PATH_MAX, fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0 || line[0] == '#') continue;
+		len = strlen(line);
+		while (len > 0 && line[len-1] == ' ') line[--len] = 0;
+
+		if (ign->n >= ign->size) {
+			ign->size += N;
+			if ((ign->patterns = (GitPattern *)realloc(ign->patterns, ign->size * sizeof(GitPattern))) == NULL) {
+				perror("couldn't allocate memory for the ignore patterns");
+				exit(1);
+			}
 		}
+		ign->patterns[ign->n].negate = line[0] == '!';
+		ign->patterns[ign->n].dironly = line[len-1] == '/';
+		if (ign->patterns[ign->n].dironly) line[len-1] = 0;
+		ign->patterns[ign->n].pattern = strdup(line + ign->patterns[ign->n].negate);
+		ign->patterns[ign->n].base = strdup(base);
+		ign->n++;
 	}
-
-	return 0;
+	fclose(fp);
 }
 
-void
-resizedetected(void)
+int
+gitignored(GitIgnore *ign, char *rel, char *name, int isdir) /* rel is the path from the root of the repository, name its last part */
 {
-	endwin();
-	initialization();
-	strncpy(status, "window resized", NAME_MAX);
+	GitPattern *pat;
+	char *p;
+	int i, ignored = 0;
+
+	/* the last pattern that matches decides */
+	for (i = 0; i < ign->n; i++) {
+		pat = &ign->patterns[i];
+		if (pat->dironly && !isdir) continue;
+		if (strncmp(rel, pat->base, strlen(pat->base)) != 0) continue;
+
+		/* with a slash anywhere but at the end it's relative to where the .gitignore is, otherwise it matches the name at any depth */
+		p = pat->pattern[0] == '/' ? pat->pattern+1 : pat->pattern;
+		if (strchr(pat->pattern, '/')) {
+			if (fnmatch(p, rel+strlen(pat->base), strstr(p, "**") ? 0 : FNM_PATHNAME) != 0) continue;
+		} else if (fnmatch(p, name, 0) != 0) {
+			continue;
+		}
+		ignored = !pat->negate;
+	}
+	return ignored;
 }
 
 void
-rdrwf(void)
+freegitignore(GitIgnore *ign)
 {
-	struct stat pathstat;
-	struct passwd *pwd;
-	struct group *gr;
-	int i, digitsfiles, digitspos, t1;
-	char fileinfo[NAME_MAX], perms[11], user[NAME_MAX], group[NAME_MAX], readablefilesize[NAME_MAX], date[NAME_MAX];
+	int i;
 
-	if (!iscurrentonscreen()) {
-		if (current >= topofscreen+maxy-4) {
-			topofscreen = current-maxy+5;
-		} else {
-			topofscreen = current;
-		}
+	for (i = 0; i < ign->n; i++) {
+		free(ign->patterns[i].pattern);
+		free(ign->patterns[i].base);
+	}
+	free(ign->patterns);
+}
 
-		if (topofscreen < 1) topofscreen = current;
-		if (topofscreen > fileslist.end) topofscreen = current;
-		if (!iscurrentonscreen()) topofscreen = current;
+GitDirStatus *
+gitstatus(char *dirpath, int dirfd, PreviewElem *only, int nonly) /* the markers of a directory's entries (or of only those), NULL if it isn't in a repository */
+{
+	GitRepo *repo;
+	GitDirStatus *status = NULL;
+	GitIgnore ign = {0};
+	GitEntry *e;
+	struct stat dirstat, st;
+	struct dirent *ent;
+	DIR *dir = NULL;
+	char rel[PATH_MAX], path[PATH_MAX], file[PATH_MAX], *p, *q, *name;
+	int i, j, fd, isdir, ignoredir = 0;
+	char mark;
+
+	if (!GITSTATUS || dirfd < 0 || fstat(dirfd, &dirstat) != 0 || (repo = findrepo(dirpath, rel)) == NULL) return NULL;
+
+	/* what was worked out stays good while neither the directory nor the index changed */
+	for (i = 0; i < GIT_DIR_CACHE; i++) {
+		if (gitdirs[i].repo == repo && !gitdirs[i].partial && !only && strcmp(gitdirs[i].path, dirpath) == 0 && \
+				gitdirs[i].dirmtime.tv_sec == dirstat.st_mtim.tv_sec && gitdirs[i].dirmtime.tv_nsec == dirstat.st_mtim.tv_nsec && \
+				gitdirs[i].indexmtime.tv_sec == repo->indexstat.st_mtim.tv_sec && gitdirs[i].indexmtime.tv_nsec == repo->indexstat.st_mtim.tv_nsec) {
+			gitdirs[i].lastused = ++gitclock;
+			return &gitdirs[i];
+		}
+		/* the statuses being drawn aren't replaced */
+		if (&gitdirs[i] != cwdgit && &gitdirs[i] != previewgit && (!status || gitdirs[i].lastused < status->lastused)) status = &gitdirs[i];
+	}
+
+	for (i = 0; i < status->n; i++) free(status->marks[i].name);
+	free(status->marks);
+	memset(status, 0, sizeof(GitDirStatus));
+	status->repo = repo;
+	strncpy(status->path, dirpath, PATH_MAX);
+	status->dirmtime = dirstat.st_mtim;
+	status->indexmtime = repo->indexstat.st_mtim;
+	status->lastused = ++gitclock;
+	status->partial = only != NULL;
+
+	/* the ignore files from the root down to the directory, a directory on the way that's ignored hides everything under it */
+	snprintf(file, PATH_MAX, "%s/info/exclude", repo->gitdir);
+	loadgitignore(&ign, file, "");
+	for (p = rel;; p++) {
+		/* path is what of rel comes before p: "", then "a/", then "a/b/" */
+		memcpy(path, rel, p-rel);
+		path[p-rel] = 0;
+		if (p > rel) {
+			path[p-rel-1] = 0;
+			q = strrchr(path, '/');
+			if ((ignoredir = gitignored(&ign, path, q ? q+1 : path, 1))) break;
+			path[p-rel-1] = '/';
+		}
+		snprintf(file, PATH_MAX, "%s/%s.gitignore", strcmp(repo->root, "/") == 0 ? "" : repo->root, path);
+		loadgitignore(&ign, file, path);
+		if ((p = strchr(p, '/')) == NULL) break;
+	}
+
+	/* a preview only looks at what it shows, a whole directory is read */
+	if (only) {
+		fd = dirfd;
+	} else if ((fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY)) < 0 || (dir = fdopendir(fd)) == NULL) {
+		if (fd >= 0) close(fd);
+		freegitignore(&ign);
+		return status;
+	}
+	for (i = 0;; i++) {
+		if (only && i >= nonly) break;
+		if (!only && (ent = readdir(dir)) == NULL) break;
+		name = only ? only[i].name : ent->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0) continue;
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+		isdir = S_ISDIR(st.st_mode);
+		snprintf(path, PATH_MAX, "%s%s", rel, name);
+		mark = 0;
+
+		j = gitlowerbound(repo, path);
+		e = j < repo->n ? &repo->entries[j] : NULL;
+		if (e && strcmp(e->path, path) == 0 && isdir) {
+			/* a submodule, in the index itself; what's in it is its own repository's business */
+		} else if (e && strcmp(e->path, path) == 0) {
+			/* tracked: what the index remembers of the file against what it is now */
+			if (e->stage) mark = 'U';
+			else if (e->mtime != (unsigned int)st.st_mtim.tv_sec || e->mtimens != (unsigned int)st.st_mtim.tv_nsec || \
+					e->size != (unsigned int)st.st_size || e->ino != (unsigned int)st.st_ino || \
+					(e->mode & S_IFMT) != (st.st_mode & S_IFMT) || (e->mode & 0100) != (st.st_mode & 0100)) mark = 'M';
+		} else if (isdir) {
+			/* a directory is tracked if something under it is */
+			snprintf(file, PATH_MAX, "%s/", path);
+			j = gitlowerbound(repo, file);
+			if ((j >= repo->n || strncmp(repo->entries[j].path, file, strlen(file)) != 0) && !ignoredir && !gitignored(&ign, path, name, 1)) mark = '?';
+		} else if (!ignoredir && !gitignored(&ign, path, name, 0)) {
+			mark = '?';
+		}
+		if (!mark) continue;
+
+		if (status->n >= status->size) {
+			status->size += N;
+			if ((status->marks = (GitMark *)realloc(status->marks, status->size * sizeof(GitMark))) == NULL) {
+				perror("couldn't allocate memory for the git status");
+				exit(1);
+			}
+		}
+		status->marks[status->n].name = strdup(name);
+		status->marks[status->n++].mark = mark;
+	}
+	if (dir) closedir(dir);
+	freegitignore(&ign);
+
+	/* sorted by name so looking one up is a binary search */
+	qsort(status->marks, status->n, sizeof(GitMark), gitmarkcompare);
+	return status;
+}
+
+char
+gitmark(GitDirStatus *status, char *name) /* ' ' if there's nothing to show */
+{
+	int lo = 0, hi = status->n, mid, cmp;
+
+	while (lo < hi) {
+		mid = (lo+hi)/2;
+		if ((cmp = strcmp(status->marks[mid].name, name)) == 0) return status->marks[mid].mark;
+		if (cmp < 0) lo = mid+1;
+		else hi = mid;
+	}
+	return ' ';
+}
+
+int
+gitmarkcompare(const void *a, const void *b)
+{
+	return strcmp(((const GitMark *)a)->name, ((const GitMark *)b)->name);
+}
+
+void
+drawmarker(int pair, int line, int column, char mark) /* the two columns after a name, its git status */
+{
+	if (mark == 'M') pair = PairChanged;
+	else if (mark != ' ') pair = PairMissing;
+	attron(COLOR_PAIR(pair));
+	mvaddch(line, column, ' ');
+	addch(mark);
+	attroff(COLOR_PAIR(pair));
+}
+
+void
+requestcount(FileElem *elem, int index) /* the directory is counted in the background, checkcounts fills the result in */
+{
+	CountRequest *req;
+	pthread_t thread;
+
+	elem->countstate = CountAsked;
+	if ((req = (CountRequest *)calloc(1, sizeof(CountRequest))) == NULL) return;
+	elempath(elem, req->path);
+	strncpy(req->name, elem->name, NAME_MAX);
+	req->generation = revalidationgeneration;
+	req->index = index;
+
+	/* the newest requests first, they're the rows on the screen now */
+	pthread_mutex_lock(&countlock);
+	req->next = countqueue;
+	countqueue = req;
+	if (countthreads < COUNT_THREADS && pthread_create(&thread, NULL, countworker, NULL) == 0) {
+		pthread_detach(thread);
+		countthreads++;
+	}
+	pthread_cond_signal(&countcond);
+	pthread_mutex_unlock(&countlock);
+	countpending++;
+}
+
+void *
+countworker(void *arg)
+{
+	CountRequest *req;
+	CountCached *cached;
+	struct stat st;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&countlock);
+		while (!countqueue) pthread_cond_wait(&countcond, &countlock);
+		req = countqueue;
+		countqueue = req->next;
+		pthread_mutex_unlock(&countlock);
+
+		/* nothing is read for a listing that's gone */
+		req->count = -1;
+		if (req->generation == __atomic_load_n(&revalidationgeneration, __ATOMIC_RELAXED) && \
+				(fd = open(req->path, O_RDONLY|O_DIRECTORY)) >= 0) {
+			if (fstat(fd, &st) == 0) {
+				cached = &countcache[(st.st_dev*31 + st.st_ino) % COUNT_CACHE];
+				pthread_mutex_lock(&countlock);
+				if (cached->ino == st.st_ino && cached->dev == st.st_dev && \
+						cached->mtime.tv_sec == st.st_mtim.tv_sec && cached->mtime.tv_nsec == st.st_mtim.tv_nsec) req->count = cached->count;
+				pthread_mutex_unlock(&countlock);
+
+				/* only names are read, without sorting or stat, and no further than COUNT_LIMIT */
+				if (req->count < 0) {
+					req->count = countentries(fd, COUNT_LIMIT);
+					pthread_mutex_lock(&countlock);
+					cached->dev = st.st_dev;
+					cached->ino = st.st_ino;
+					cached->mtime = st.st_mtim;
+					cached->count = req->count;
+					pthread_mutex_unlock(&countlock);
+				}
+			}
+			close(fd);
+		}
+
+		pthread_mutex_lock(&countlock);
+		req->next = countdone;
+		countdone = req;
+		pthread_mutex_unlock(&countlock);
+	}
+	return NULL;
+}
+
+int
+checkcounts(void) /* puts the counts that are done in the listing, returns 1 if one of them is there */
+{
+	CountRequest *req, *next;
+	FileElem *elem;
+	int redraw = 0;
+
+	pthread_mutex_lock(&countlock);
+	req = countdone;
+	countdone = NULL;
+	pthread_mutex_unlock(&countlock);
+
+	for (; req; req = next) {
+		next = req->next;
+		countpending--;
+		/* the listing could have been reread since, the name says if it's still the same entry */
+		if (req->generation == revalidationgeneration && req->index >= 1 && req->index <= fileslist.end) {
+			elem = &fileslist.contents[req->index];
+			if (strcmp(elem->name, req->name) == 0 && elem->countstate == CountAsked) {
+				elem->children = req->count;
+				elem->countstate = req->count < 0 ? CountFailed : CountDone;
+				redraw = 1;
+			}
+		}
+		free(req);
+	}
+	return redraw;
+}
+
+void
+readmounts(void) /* only the table is read, none of the filesystems in it are touched */
+{
+	struct pollfd pfd;
+	Mount *old, *m;
+	char *line = NULL, *p, *q;
+	size_t len = 0;
+	int i, id, pos, nold;
+
+	/* it's read again only when poll says a mount came or went */
+	if (!mountsfile) {
+		if ((mountsfile = fopen("/proc/self/mountinfo", "re")) == NULL) return;
+	} else {
+		pfd.fd = fileno(mountsfile);
+		pfd.events = POLLPRI;
+		if (poll(&pfd, 1, 0) <= 0) return;
+		rewind(mountsfile);
+	}
+
+	old = mounts;
+	nold = nmounts;
+	mounts = NULL;
+	nmounts = mountssize = 0;
+	while (getline(&line, &len, mountsfile) > 0) {
+		pos = 0;
+		if (sscanf(line, "%d %*d %*s %*s %n", &id, &pos) != 1 || pos == 0) continue;
+		if (nmounts >= mountssize) {
+			mountssize += N;
+			if ((mounts = (Mount *)realloc(mounts, mountssize * sizeof(Mount))) == NULL) {
+				perror("couldn't allocate memory for the mount table");
+				exit(1);
+			}
+		}
+		m = &mounts[nmounts];
+
+		/* spaces and the like are escaped in octal */
+		for (p = line+pos, q = m->dir; *p && *p != ' ' && q < m->dir+PATH_MAX-1; p++) {
+			if (p[0] == '\\' && p[1] >= '0' && p[1] <= '7' && p[2] >= '0' && p[2] <= '7' && p[3] >= '0' && p[3] <= '7') {
+				*q++ = (p[1]-'0')*64 + (p[2]-'0')*8 + (p[3]-'0');
+				p += 3;
+			} else {
+				*q++ = *p;
+			}
+		}
+		*q = 0;
+		m->id = id;
+		m->len = strcmp(m->dir, "/") == 0 ? 0 : q-m->dir;
+		m->class = FsUnknown;
+		m->slow = 0;
+
+		/* what was found out about a mount is kept for as long as it's mounted */
+		for (i = 0; i < nold; i++) {
+			if (old[i].id == id) {
+				m->class = old[i].class;
+				m->slow = old[i].slow;
+				break;
+			}
+		}
+		nmounts++;
+	}
+	free(line);
+	free(old);
+}
+
+Mount *
+mountof(char *path) /* the longest mount point in front of path, the last one mounted there if it's stacked */
+{
+	Mount *best = NULL;
+	int i;
+
+	for (i = 0; i < nmounts; i++) {
+		if (best && mounts[i].len < best->len) continue;
+		if (strncmp(path, mounts[i].dir, mounts[i].len) == 0 && (path[mounts[i].len] == '/' || path[mounts[i].len] == 0)) best = &mounts[i];
+	}
+	return best;
+}
+
+int
+fsremote(Mount *m) /* 1 for network and FUSE filesystems, statfs is asked once per mount */
+{
+	static const unsigned int magics[] = {
+		0x6969, /* nfs */
+		0x517b, 0xff534d42, 0xfe534d42, /* smb, cifs, smb2 */
+		0x65735546, /* fuse: sshfs and the like */
+		0x01021997, 0x00c36400, 0x73757245, 0x5346414f, 0x6b414653, 0x564c, /* 9p, ceph, coda, afs, kafs, ncp */
+	};
+	StatfsCall *call;
+	int i;
+
+	if (!m) return 0;
+	if (m->class != FsUnknown) return m->class == FsRemote;
+	if ((call = (StatfsCall *)calloc(1, sizeof(StatfsCall))) == NULL) return 0;
+	strncpy(call->path, m->dir, PATH_MAX);
+
+	/* one that doesn't even answer statfs in time is slow, whatever it is */
+	if (boundedcall(statfscall, call, free) != 0) {
+		m->class = FsRemote;
+		slowmount(m);
+		return 1;
+	}
+
+	m->class = FsLocal;
+	for (i = 0; !call->err && i < LENGTH(magics); i++) {
+		if ((unsigned int)call->sf.f_type == magics[i]) m->class = FsRemote;
+	}
+	free(call);
+	return m->class == FsRemote;
+}
+
+void *
+statfscall(void *arg)
+{
+	StatfsCall *call = (StatfsCall *)arg;
+
+	call->err = statfs(call->path, &call->sf) ? errno : 0;
+	return NULL;
+}
+
+int
+boundedcall(void *(*func)(void *), void *arg, void (*release)(void *)) /* 0 if func(arg) ended within FS_DEADLINE_MS, otherwise it's left running and release(arg) is called when it ends */
+{
+	Bounded *b;
+	pthread_t thread;
+	struct timespec deadline;
+	int finished;
+
+	if ((b = (Bounded *)calloc(1, sizeof(Bounded))) == NULL) {
+		func(arg);
+		return 0;
+	}
+	b->func = func;
+	b->arg = arg;
+	b->release = release;
+	if (pthread_create(&thread, NULL, boundedrunner, b) != 0) {
+		free(b);
+		func(arg);
+		return 0;
+	}
+	pthread_detach(thread);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FS_DEADLINE_MS/1000;
+	deadline.tv_nsec += (FS_DEADLINE_MS%1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&boundedlock);
+	while (!b->finished && pthread_cond_timedwait(&boundedcond, &boundedlock, &deadline) != ETIMEDOUT);
+	finished = b->finished;
+	b->abandoned = !finished;
+	pthread_mutex_unlock(&boundedlock);
+
+	if (finished) free(b);
+	return finished ? 0 : -1;
+}
+
+void *
+boundedrunner(void *arg)
+{
+	Bounded *b = (Bounded *)arg;
+	int abandoned;
+
+	b->func(b->arg);
+
+	pthread_mutex_lock(&boundedlock);
+	b->finished = 1;
+	abandoned = b->abandoned;
+	pthread_cond_broadcast(&boundedcond);
+	pthread_mutex_unlock(&boundedlock);
+
+	/* nobody is waiting for it anymore */
+	if (abandoned) {
+		if (b->release) b->release(b->arg);
+		free(b);
+	}
+	return NULL;
+}
+
+void
+slowmount(Mount *m)
+{
+	m->slow = 1;
+	snprintf(status, NAME_MAX, "%s is slow, only names are read from it", m->dir);
+}
+
+int
+isdegraded(void) /* cwd is on a slow filesystem: no previews, no stat of the files, just names */
+{
+	return cwdmount && cwdmount->slow;
+}
+
+void
+readremote(struct stat *dirstat) /* the listing is read on a thread, the screen waits for it at most FS_DEADLINE_MS and gets it later otherwise */
+{
+	Revalidation *r;
+	char saved[NAME_MAX];
+
+	if ((r = newrevalidation(dirstat)) == NULL) return;
+	backgroundpending++;
+	if (boundedcall(revalidate, r, NULL) != 0) {
+		slowmount(cwdmount);
+		return;
+	}
+
+	/* it's answering again */
+	cwdmount->slow = 0;
+
+	/* it's put in the listing like one that comes late */
+	strncpy(saved, status, NAME_MAX);
+	checkbackground();
+	strncpy(status, saved, NAME_MAX);
+}
+
+void *
+previewreader(void *arg)
+{
+	PreviewRead *pr = (PreviewRead *)arg;
+
+	pr->kept = previewdirectory(pr->fd, pr->heap, pr->k, &pr->total);
+	return NULL;
+}
+
+void
+freepreviewread(void *arg)
+{
+	PreviewRead *pr = (PreviewRead *)arg;
+
+	free(pr->heap);
+	free(pr);
+}
+
+void *
+statcall(void *arg)
+{
+	StatCall *call = (StatCall *)arg;
+
+	batchstatx(AT_FDCWD, call->reqs, call->n, INFO_STATX_MASK);
+	return NULL;
+}
+
+void
+freestatcall(void *arg)
+{
+	StatCall *call = (StatCall *)arg;
+
+	free(call->reqs);
+	free(call->names);
+	free(call);
+}
+
+void
+getcurrentfiles(void)
+{
+	struct stat dirstat;
+	int stale, remote;
+	size_t mapsize;
+	void *map;
+
+	parklisting();
+	closelarge();
+	current = topofscreen = 1;
+	revalidationgeneration++; /* whatever is still being reread belongs to another listing */
+	listinglabel[0] = 0;
+	listingkind = ListingDirectory;
+	archivepath[0] = 0;
+
+	cwdgit = NULL; /* so its slot can be reused */
+	opendirfds();
+	readmounts();
+	cwdmount = mountof(cwd);
+	if (ndirfds == 0 || fstat(dirfds[0], &dirstat) != 0) return;
+	remote = fsremote(cwdmount);
+	if (!isdegraded() && !remote) cwdgit = gitstatus(cwd, dirfds[0], NULL, 0); /* it reads the whole directory and up the tree, unbounded */
+	listingstat = dirstat;
+	listingflags = indexflags(sortbydirectories, hiddenfiles);
+
+	/* directories too big to hold are sorted on disk, only a window of them is in memory */
+	if (!remote && dirstat.st_size >= (off_t)LARGE_DIRECTORY*2 && openlarge(&dirstat) == 0) { /* no filesystem takes less than 2 bytes an entry */
+		seekwindow(1);
+		return;
+	}
+
+	/* one read ahead while waiting for a key, or left not long ago, is already in memory */
+	if (takeprefetched(cwd, &dirstat, &fileslist, &current, &topofscreen) == 0) return;
+
+	/* a listing shared by the daemon is the cheapest, then one cached on disk */
+	if (USEDAEMON && !replaying && !remote && (map = daemonlisting(cwd, indexflags(sortbydirectories, hiddenfiles), &mapsize)) != NULL) {
+		stale = loadindex(map, mapsize, cwd, &dirstat, &fileslist);
+		munmap(map, mapsize);
+		if (stale >= 0) {
+			if (stale) startrevalidation(&dirstat);
+			return;
+		}
+	}
+
+	if (INDEXLISTINGS && (stale = readindex(cwd, &dirstat, &fileslist)) >= 0) {
+		/* draw the cached listing now, reread it in the background if the directory changed since */
+		if (stale) startrevalidation(&dirstat);
+		return;
+	}
+
+	/* on a network or FUSE filesystem it's never waited on for long, it's cached once it's there */
+	if (remote) {
+		listingflags = -1;
+		readremote(&dirstat);
+		return;
+	}
+
+	scandirectory(dup(dirfds[0]), cwd, &fileslist, sortbydirectories, hiddenfiles, 0);
+	if (INDEXLISTINGS) writeindex(&dirstat, &fileslist);
+}
+
+void
+opendirfds(void) /* drawing then goes through these instead of walking paths every frame */
+{
+	struct stat st, prevst;
+	char *p;
+	int i;
+
+	for (i = 0; i < ndirfds; i++) close(dirfds[i]);
+	ndirfds = 0;
+	if (previewfd >= 0) close(previewfd);
+	previewfd = -1;
+	previewpath[0] = 0;
+	previewgit = NULL;
+
+	getcwd(cwd, sizeof(cwd));
+	if ((dirfds[0] = open(".", O_RDONLY|O_DIRECTORY)) < 0) return;
+	strncpy(dirpaths[0], cwd, PATH_MAX);
+	ndirfds = 1;
+
+	/* as many levels up as there can be columns, stopping at the root (which is its own parent) */
+	if (fstat(dirfds[0], &prevst) != 0) return;
+	for (i = 1; i <= COLUMNS_MAX; i++) {
+		if ((dirfds[i] = openat(dirfds[i-1], "..", O_RDONLY|O_DIRECTORY)) < 0) break;
+		if (fstat(dirfds[i], &st) != 0 || (st.st_dev == prevst.st_dev && st.st_ino == prevst.st_ino)) {
+			close(dirfds[i]);
+			break;
+		}
+		prevst = st;
+
+		strncpy(dirpaths[i], dirpaths[i-1], PATH_MAX);
+		if ((p = strrchr(dirpaths[i], '/')) != NULL) {
+			if (p == dirpaths[i]) p[1] = 0;
+			else p[0] = 0;
+		}
+		ndirfds++;
+	}
+}
+
+void
+scandirectory(int fd, char *dirpath, Files *list, int dirsfirst, int hidden, int namesonly) /* fd is the directory, it's closed after; dirpath is what the entries are listed under */
+{
+	int lendir, i, j, nreqs, pass;
+	struct dirent **namelist;
+	MetaRequest *reqs;
+	mode_t *modes;
+	char *name;
+
+	if (fd < 0) return;
+	lendir = scandirat(fd, ".", &namelist, 0, alphasort);
+	if (lendir <= 0) {
+		close(fd);
+		return;
+	}
+
+	if ((modes = (mode_t *)calloc(lendir, sizeof(mode_t))) == NULL || \
+			(reqs = (MetaRequest *)malloc(METADATA_BATCH * sizeof(MetaRequest))) == NULL) {
+		perror("couldn't allocate memory for the file contents");
+		exit(1);
+	}
+
+	/* d_type says what most entries are, only the rest (and symlinks, which are followed) need a statx */
+	for (i = 0; i < lendir;) {
+		for (nreqs = 0; i < lendir && nreqs < METADATA_BATCH; i++) {
+			if (namelist[i]->d_type != DT_UNKNOWN && namelist[i]->d_type != DT_LNK) {
+				modes[i] = DTTOIF(namelist[i]->d_type);
+			} else {
+				reqs[nreqs].name = namelist[i]->d_name;
+				reqs[nreqs++].index = i;
+			}
+		}
+		if (namesonly) nreqs = 0; /* what d_type doesn't say stays unknown */
+		batchstatx(fd, reqs, nreqs, STATX_TYPE);
+		for (j = 0; j < nreqs; j++) {
+			modes[reqs[j].index] = reqs[j].err ? 0 : reqs[j].stx.stx_mode;
+		}
+	}
+
+	/* with dirsfirst the first pass puts the directories and the second one everything else */
+	for (pass = 0; pass < (dirsfirst ? 2 : 1); pass++) {
+		for (i = 0; i < lendir; i++) {
+			name = namelist[i]->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+			if (!hidden && name[0] == '.') continue;
+			if (dirsfirst && (S_ISDIR(modes[i]) ? 0 : 1) != pass) continue;
+
+			addelem(list, dirpath, name);
+			list->contents[list->end].mode = modes[i];
+			list->contents[list->end].statmask = modes[i] ? STATX_TYPE : 0;
+			list->contents[list->end].islink = namelist[i]->d_type == DT_LNK;
+		}
+	}
+
+	for (i = 0; i < lendir; i++) {
+		free(namelist[i]);
+	}
+	free(namelist);
+	free(modes);
+	free(reqs);
+	close(fd);
+}
+
+int
+countentries(int fd, int limit) /* stops counting at limit, the directory is rewound after */
+{
+	char buf[LARGE_BUFSIZE];
+	struct dirent64 *ent;
+	long n, pos;
+	int count = 0;
+
+	while (count < limit && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < n; pos += ent->d_reclen) {
+			ent = (struct dirent64 *)(buf+pos);
+			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) count++;
+		}
+	}
+	lseek(fd, 0, SEEK_SET);
+	return count;
+}
+
+int
+largecompare(const char *a, const char *b, int dirsfirst) /* records are the mode followed by the name */
+{
+	mode_t ma, mb;
+
+	if (dirsfirst) {
+		memcpy(&ma, a, sizeof(mode_t));
+		memcpy(&mb, b, sizeof(mode_t));
+		if (S_ISDIR(ma) != S_ISDIR(mb)) return S_ISDIR(ma) ? -1 : 1;
+	}
+	return strcoll(a+sizeof(mode_t), b+sizeof(mode_t));
+}
+
+int
+largerecordcompare(const void *a, const void *b, void *arg)
+{
+	char *arena = (char *)arg;
+
+	/* the first byte of the arena says if directories go first, records start after it */
+	return largecompare(arena + *(const unsigned int *)a, arena + *(const unsigned int *)b, arena[0]);
+}
+
+FILE *
+createprivate(char *path) /* a new file only the user can read, replacing whatever was at path */
+{
+	FILE *fp;
+	int fd;
+
+	unlink(path);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600)) < 0) return NULL;
+	if ((fp = fdopen(fd, "w")) == NULL) close(fd);
+	return fp;
+}
+
+int
+openprivate(char *path) /* opens path to read it if it's a file of the user's, -1 otherwise */
+{
+	struct stat filestat;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0) return -1;
+	if (fstat(fd, &filestat) != 0 || !S_ISREG(filestat.st_mode) || filestat.st_uid != getuid()) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+writerun(char *base, int nrun, char *arena, unsigned int *recs, int n, int dirsfirst)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	arena[0] = dirsfirst;
+	qsort_r(recs, n, sizeof(unsigned int), largerecordcompare, arena);
+
+	snprintf(path, PATH_MAX, "%s.run%d", base, nrun);
+	if ((fp = createprivate(path)) == NULL) return -1;
+	for (i = 0; i < n; i++) {
+		fwrite(arena+recs[i], sizeof(mode_t) + strlen(arena+recs[i]+sizeof(mode_t)) + 1, 1, fp);
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+void
+largesiftdown(LargeRun *runs, int *heap, int n, int i, int dirsfirst)
+{
+	int smallest, l, r, t;
+
+	for (;;) {
+		smallest = i;
+		l = 2*i+1;
+		r = 2*i+2;
+		if (l < n && largecompare(runs[heap[l]].pos, runs[heap[smallest]].pos, dirsfirst) < 0) smallest = l;
+		if (r < n && largecompare(runs[heap[r]].pos, runs[heap[smallest]].pos, dirsfirst) < 0) smallest = r;
+		if (smallest == i) return;
+		t = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = t;
+		i = smallest;
+	}
+}
+
+int
+mergeruns(char *base, int nruns, LargeHeader *header, int dirsfirst) /* merges the sorted runs into the names and their offsets */
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	unsigned long long offset = 0;
+	LargeRun *runs;
+	FILE *names, *offsets;
+	size_t len;
+	int *heap, i, fd, n = 0, ret = 0;
+
+	runs = (LargeRun *)calloc(MAX(nruns, 1), sizeof(LargeRun));
+	heap = (int *)malloc(MAX(nruns, 1) * sizeof(int));
+	if (!runs || !heap) {
+		perror("couldn't allocate memory for merging the listing");
+		exit(1);
+	}
+
+	/* the runs are mmap'd, so only the part of each one being merged is in memory */
+	for (i = 0; i < nruns; i++) {
+		snprintf(path, PATH_MAX, "%s.run%d", base, i);
+		if ((fd = openprivate(path)) < 0) continue;
+		runs[i].size = lseek(fd, 0, SEEK_END);
+		if (runs[i].size && (runs[i].map = (char *)mmap(NULL, runs[i].size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+			madvise(runs[i].map, runs[i].size, MADV_SEQUENTIAL);
+			runs[i].pos = runs[i].map;
+			heap[n++] = i;
+		} else {
+			runs[i].map = NULL;
+		}
+		close(fd);
+		unlink(path);
+	}
+	for (i = n/2-1; i >= 0; i--) largesiftdown(runs, heap, n, i, dirsfirst);
+
+	snprintf(path, PATH_MAX, "%s.names.tmp", base);
+	snprintf(tmp, PATH_MAX, "%s.tmp", base);
+	names = createprivate(path);
+	offsets = createprivate(tmp);
+	if (!names || !offsets) ret = -1;
+
+	header->total = 0;
+	if (ret == 0) fwrite(header, sizeof(LargeHeader), 1, offsets);
+	while (ret == 0 && n > 0) {
+		i = heap[0];
+		len = sizeof(mode_t) + strlen(runs[i].pos+sizeof(mode_t)) + 1;
+		fwrite(runs[i].pos, len, 1, names);
+		fwrite(&offset, sizeof(offset), 1, offsets);
+		offset += len;
+		header->total++;
+
+		runs[i].pos += len;
+		if (runs[i].pos >= runs[i].map+runs[i].size) heap[0] = heap[--n];
+		largesiftdown(runs, heap, n, 0, dirsfirst);
+	}
+
+	/* the header is written again with the total, and only then is it renamed in place */
+	if (ret == 0) {
+		fseek(offsets, 0, SEEK_SET);
+		fwrite(header, sizeof(LargeHeader), 1, offsets);
+	}
+	if (names && fclose(names) != 0) ret = -1;
+	if (offsets && fclose(offsets) != 0) ret = -1;
+
+	snprintf(tmp, PATH_MAX, "%s.names", base);
+	if (ret == 0 && rename(path, tmp) != 0) ret = -1;
+	snprintf(path, PATH_MAX, "%s.tmp", base);
+	if (ret == 0 && rename(path, base) != 0) ret = -1;
+	if (ret != 0) {
+		unlink(path);
+		snprintf(path, PATH_MAX, "%s.names.tmp", base);
+		unlink(path);
+	}
+
+	for (i = 0; i < nruns; i++) {
+		if (runs[i].map) munmap(runs[i].map, runs[i].size);
+	}
+	free(runs);
+	free(heap);
+	return ret;
+}
+
+int
+buildlarge(char *base, LargeHeader *header, int dirsfirst, int hidden) /* reads cwd once, sorting it in runs of LARGE_RUN_SIZE */
+{
+	char buf[LARGE_BUFSIZE], *arena;
+	unsigned int *recs = NULL;
+	struct dirent64 *ent;
+	struct stat st;
+	size_t used = 1, len;
+	long n, pos;
+	int fd, nrecs = 0, size = 0, nruns = 0, ret = 0;
+	mode_t mode;
+
+	if ((fd = open(".", O_RDONLY|O_DIRECTORY)) < 0) return -1;
+	if ((arena = (char *)malloc(LARGE_RUN_SIZE)) == NULL) {
+		perror("couldn't allocate memory for sorting the listing");
+		exit(1);
+	}
+
+	while (ret == 0 && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; ret == 0 && pos < n; pos += ent->d_reclen) {
+			ent = (struct dirent64 *)(buf+pos);
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+			if (!hidden && ent->d_name[0] == '.') continue;
+
+			/* like scandirectory, symlinks show what they point to */
+			if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) mode = DTTOIF(ent->d_type);
+			else mode = fstatat(fd, ent->d_name, &st, 0) == 0 ? st.st_mode : 0;
+
+			len = sizeof(mode_t) + strlen(ent->d_name) + 1;
+			if (used+len > LARGE_RUN_SIZE) {
+				ret = writerun(base, nruns++, arena, recs, nrecs, dirsfirst);
+				used = 1;
+				nrecs = 0;
+			}
+			if (nrecs >= size) {
+				size += N*N;
+				if ((recs = (unsigned int *)realloc(recs, size * sizeof(unsigned int))) == NULL) {
+					perror("couldn't allocate memory for sorting the listing");
+					exit(1);
+				}
+			}
+			recs[nrecs++] = used;
+			memcpy(arena+used, &mode, sizeof(mode_t));
+			strcpy(arena+used+sizeof(mode_t), ent->d_name);
+			used += len;
+		}
+	}
+	if (ret == 0 && nrecs) ret = writerun(base, nruns++, arena, recs, nrecs, dirsfirst);
+
+	free(arena);
+	free(recs);
+	close(fd);
+
+	if (ret == 0) return mergeruns(base, nruns, header, dirsfirst);
+	/* the runs that were written are removed by merging none of them */
+	mergeruns(base, nruns, header, dirsfirst);
+	return -1;
+}
+
+int
+openlarge(struct stat *dirstat) /* maps the sorted listing of cwd, sorting it first if needed; -1 if it isn't that large */
+{
+	static int pruned = 0;
+	LargeHeader header = {0}, counted, *h;
+	char dir[PATH_MAX], base[PATH_MAX], path[PATH_MAX], small[PATH_MAX];
+	size_t size;
+	int fd, rebuilt = 0;
+	void *map;
+	FILE *fp;
+
+	/* on disk in the user's cache, /tmp is shared and often kept in memory */
+	if (privatedir(dir, "XDG_CACHE_HOME", ".cache") != 0) return -1;
+	snprintf(base, PATH_MAX, "%s/large-%llx-%llx-%d", dir, (unsigned long long)dirstat->st_dev, \
+			(unsigned long long)dirstat->st_ino, indexflags(sortbydirectories, hiddenfiles));
+	header.magic = LARGE_MAGIC;
+	header.version = LARGE_VERSION;
+	header.dev = dirstat->st_dev;
+	header.ino = dirstat->st_ino;
+	header.mtime = dirstat->st_mtim;
+	header.flags = indexflags(sortbydirectories, hiddenfiles);
+	/* what was counted and found not that large, so it's only counted again once the directory changed */
+	snprintf(small, PATH_MAX, "%s/small-%llx-%llx", dir, (unsigned long long)dirstat->st_dev, (unsigned long long)dirstat->st_ino);
+
+	for (;;) {
+		if ((fd = openprivate(base)) >= 0) {
+			size = lseek(fd, 0, SEEK_END);
+			map = size >= sizeof(LargeHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+			close(fd);
+			h = (LargeHeader *)map;
+			if (map != MAP_FAILED && h->magic == header.magic && h->version == header.version && h->dev == header.dev && \
+					h->ino == header.ino && h->flags == header.flags && h->mtime.tv_sec == header.mtime.tv_sec && \
+					h->mtime.tv_nsec == header.mtime.tv_nsec && size == sizeof(LargeHeader) + h->total*sizeof(unsigned long long)) {
+				break;
+			}
+			if (map != MAP_FAILED) munmap(map, size);
+		}
+		if (rebuilt) return -1;
+
+		if ((fd = openprivate(small)) >= 0) {
+			size = read(fd, &counted, sizeof(counted));
+			if (size == sizeof(counted) && counted.magic == header.magic && counted.version == header.version && \
+					counted.dev == header.dev && counted.ino == header.ino && counted.mtime.tv_sec == header.mtime.tv_sec && \
+					counted.mtime.tv_nsec == header.mtime.tv_nsec) {
+				futimens(fd, NULL); /* see prunecache */
+				close(fd);
+				return -1;
+			}
+			close(fd);
+		}
+
+		/* only sorted on disk when it's worth it, counting stops as soon as it is */
+		if ((fd = open(".", O_RDONLY|O_DIRECTORY)) < 0) return -1;
+		rebuilt = countentries(fd, LARGE_DIRECTORY);
+		close(fd);
+		if (rebuilt < LARGE_DIRECTORY) {
+			if (!pruned) {
+				prunecache(dir, "small-", LARGE_KEEP_DAYS);
+				pruned = 1;
+			}
+			counted = header;
+			counted.total = rebuilt;
+			if ((fp = createprivate(small)) != NULL) {
+				size = fwrite(&counted, sizeof(counted), 1, fp);
+				if (fclose(fp) != 0 || size != 1) unlink(small);
+			}
+			return -1;
+		}
+
+		drawstatus("sorting a large directory...");
+		prunecache(dir, "large-", LARGE_KEEP_DAYS);
+		if (buildlarge(base, &header, sortbydirectories, hiddenfiles) != 0) return -1;
+	}
+
+	snprintf(path, PATH_MAX, "%s.names", base);
+	if ((large.namesfd = openprivate(path)) < 0) {
+		munmap(map, size);
+		return -1;
+	}
+	/* what's used is kept, see prunecache */
+	utimensat(AT_FDCWD, base, NULL, AT_SYMLINK_NOFOLLOW);
+	futimens(large.namesfd, NULL);
+	large.namessize = lseek(large.namesfd, 0, SEEK_END);
+	if (large.namessize == 0 || (large.names = (char *)mmap(NULL, large.namessize, PROT_READ, MAP_SHARED, large.namesfd, 0)) == MAP_FAILED) {
+		munmap(map, size);
+		close(large.namesfd);
+		large.namesfd = -1;
+		large.names = NULL;
+		return -1;
+	}
+	large.header = h;
+	large.headersize = size;
+	large.offsets = (unsigned long long *)(h+1);
+
+	fileslist.total = h->total;
+	return 0;
+}
+
+void
+prunecache(char *dir, char *prefix, int days) /* removes the files starting with prefix that weren't used for days */
+{
+	struct dirent *ent;
+	struct stat filestat;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL) return;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.' || strncmp(ent->d_name, prefix, strlen(prefix)) != 0 || \
+				fstatat(dirfd(d), ent->d_name, &filestat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(filestat.st_mode)) continue;
+		if (filestat.st_mtime < time(NULL) - days*24*60*60) unlinkat(dirfd(d), ent->d_name, 0);
+	}
+	closedir(d);
+}
+
+void
+closelarge(void)
+{
+	if (large.header) munmap(large.header, large.headersize);
+	if (large.names) munmap(large.names, large.namessize);
+	if (large.namesfd >= 0) close(large.namesfd);
+	memset(&large, 0, sizeof(large));
+	large.namesfd = -1;
+}
+
+void
+seekwindow(int pos) /* puts the cursor on pos of a large listing, moving the window if pos is near its edges */
+{
+	int row = current - topofscreen, offset, i, end;
+	char *rec;
+
+	if (!fileslist.total) return;
+	pos = MAX(1, MIN(pos, fileslist.total));
+	i = pos - fileslist.offset;
+
+	if (fileslist.contents && i >= 1 && i <= fileslist.end && (i > maxy || fileslist.offset == 0) && \
+			(i <= fileslist.end-maxy || fileslist.offset+fileslist.end == fileslist.total)) {
+		current = i;
+		return;
+	}
+
+	offset = MAX(0, MIN(pos - LARGE_WINDOW/2, fileslist.total - LARGE_WINDOW));
+	end = MIN(fileslist.total, offset + LARGE_WINDOW);
+
+	/* the same memory is reused for every window */
+	fileslist.end = 0;
+	for (i = offset+1; i <= end; i++) {
+		rec = large.names + large.offsets[i-1];
+		addelem(&fileslist, cwd, rec+sizeof(mode_t));
+		memcpy(&fileslist.contents[fileslist.end].mode, rec, sizeof(mode_t));
+		fileslist.contents[fileslist.end].statmask = fileslist.contents[fileslist.end].mode ? STATX_TYPE : 0;
+	}
+	fileslist.offset = offset;
+
+	current = pos - offset;
+	topofscreen = MAX(1, current - MAX(row, 0));
+}
+
+int
+largescan(regex_t *regex, int from, int to, int last) /* the first (or last) entry in [from, to] that matches, 0 if none does */
+{
+	char buf[LARGE_BUFSIZE], *name;
+	unsigned long long bufstart = 0, off;
+	ssize_t buflen = 0;
+	int i, found = 0;
+
+	/* read through a buffer instead of the map, so that the scan doesn't stay resident */
+	for (i = from; i <= to; i++) {
+		off = large.offsets[i-1];
+		if (off < bufstart || off + sizeof(mode_t) + NAME_MAX + 1 > bufstart + buflen) {
+			bufstart = off;
+			if ((buflen = pread(large.namesfd, buf, sizeof(buf)-1, off)) <= 0) break;
+			buf[buflen] = 0;
+		}
+		name = buf + (off-bufstart) + sizeof(mode_t);
+		if (regexec(regex, name, 0, NULL, 0) == 0) {
+			found = i;
+			if (!last) break;
+		}
+	}
+	return found;
+}
+
+void
+largesearch(int direction)
+{
+	regex_t regex;
+	int pos = fileslist.offset+current, found;
+
+	if (pattern[0] == 0) {
+		strncpy(status, "please input a pattern", NAME_MAX);
+		return;
+	}
+	if (regcomp(&regex, pattern, 0)) return;
+
+	drawstatus("searching...");
+	status[0] = 0;
+	if (direction >= 0) {
+		found = largescan(&regex, direction ? pos+1 : pos, fileslist.total, 0);
+		if (!found && (found = largescan(&regex, 1, pos, 0))) strncpy(status, "search reached BOTTOM, starting from the topofscreen", NAME_MAX);
+	} else {
+		found = largescan(&regex, 1, pos-1, 1);
+		if (!found && (found = largescan(&regex, pos, fileslist.total, 1))) strncpy(status, "search reached topofscreen, starting from the BOTTOM", NAME_MAX);
+	}
+	regfree(&regex);
+
+	if (!found) {
+		strncpy(status, "no item with that pattern was found", NAME_MAX);
+		return;
+	}
+	seekwindow(found);
+
+	/* put the result in the middle */
+	if (!iscurrentonscreen()) topofscreen = MAX(1, current-maxy/2);
+}
+
+int
+indexflags(int dirsfirst, int hidden)
+{
+	return (dirsfirst ? 1 : 0) | (hidden ? 2 : 0);
+}
+
+void
+indexpath(char *buf, dev_t dev, ino_t ino, int flags)
+{
+	snprintf(buf, PATH_MAX, "%s/%lx-%lx-%d", indexdir, (unsigned long)dev, (unsigned long)ino, flags);
+}
+
+int
+readindex(char *dirpath, struct stat *dirstat, Files *list) /* -1 -> no usable index; 0 -> up to date; 1 -> stale */
+{
+	char path[PATH_MAX];
+	int fd, stale;
+	struct stat filestat;
+	void *map;
+
+	indexpath(path, dirstat->st_dev, dirstat->st_ino, indexflags(sortbydirectories, hiddenfiles));
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &filestat) != 0 || filestat.st_size < (off_t)sizeof(IndexHeader)) {
+		close(fd);
+		return -1;
+	}
+	futimens(fd, NULL); /* what's used is kept, see writeindex */
+	map = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	stale = loadindex(map, filestat.st_size, dirpath, dirstat, list);
+	munmap(map, filestat.st_size);
+	return stale;
+}
+
+IndexHeader *
+checkindex(void *map, size_t size, struct stat *dirstat) /* returns the header if map holds a listing of that directory */
+{
+	IndexHeader *header = (IndexHeader *)map;
+
+	if (size < sizeof(IndexHeader)) return NULL;
+	if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || \
+			header->dev != dirstat->st_dev || header->ino != dirstat->st_ino || header->n < 0 || \
+			(size_t)header->n > (size-sizeof(IndexHeader))/sizeof(IndexEntry) || \
+			header->namessize != size-sizeof(IndexHeader)-header->n*sizeof(IndexEntry)) {
+		return NULL;
+	}
+	return header;
+}
+
+char *
+indexname(IndexHeader *header, IndexEntry *entry) /* NULL unless the name is 0 terminated inside the names of the index */
+{
+	char *names = (char *)((IndexEntry *)(header+1) + header->n);
+
+	if (entry->nameoffset >= header->namessize) return NULL;
+	if (memchr(names+entry->nameoffset, 0, header->namessize-entry->nameoffset) == NULL) return NULL;
+	return names+entry->nameoffset;
+}
+
+int
+loadindex(void *map, size_t size, char *dirpath, struct stat *dirstat, Files *list) /* -1 -> not usable; 0 -> up to date; 1 -> stale */
+{
+	IndexHeader *header;
+	IndexEntry *entries;
+	char *name;
+	int i;
+
+	if ((header = checkindex(map, size, dirstat)) == NULL) return -1;
+	entries = (IndexEntry *)(header+1);
+
+	for (i = 0; i < header->n; i++) {
+		if ((name = indexname(header, &entries[i])) == NULL) break;
+		addelem(list, dirpath, name);
+		list->contents[list->end].statmask = entries[i].statmask & (STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME);
+		list->contents[list->end].mode = entries[i].mode;
+		list->contents[list->end].islink = entries[i].islink;
+		list->contents[list->end].size = entries[i].size;
+		list->contents[list->end].mtime = entries[i].mtime;
+	}
+
+	return header->mtime.tv_sec != dirstat->st_mtim.tv_sec || header->mtime.tv_nsec != dirstat->st_mtim.tv_nsec;
+}
+
+void
+writeindex(struct stat *dirstat, Files *list)
+{
+	static int pruned = 0;
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	FILE *fp;
+
+	if (list->end < INDEX_MIN_ENTRIES) return;
+	/* once a session, the indexes of directories that weren't visited for a while (or are gone) are removed */
+	if (!pruned) {
+		prunecache(indexdir, "", INDEX_KEEP_DAYS);
+		pruned = 1;
+	}
+
+	indexpath(path, dirstat->st_dev, dirstat->st_ino, indexflags(sortbydirectories, hiddenfiles));
+	snprintf(tmppath, PATH_MAX, "%s.%d", path, (int)getpid());
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		if (errno != ENOENT || mkdir(indexdir, 0700) != 0 || (fp = fopen(tmppath, "w")) == NULL) return;
+	}
+
+	serializeindex(fp, dirstat, list, indexflags(sortbydirectories, hiddenfiles));
+	if (fclose(fp) != 0 || rename(tmppath, path) != 0) unlink(tmppath);
+}
+
+void
+serializeindex(FILE *fp, struct stat *dirstat, Files *list, int flags)
+{
+	int i;
+	size_t offset = 0;
+	IndexHeader header = {0};
+	IndexEntry entry = {0};
+
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.dev = dirstat->st_dev;
+	header.ino = dirstat->st_ino;
+	header.mtime = dirstat->st_mtim;
+	header.flags = flags;
+	header.n = list->end;
+	for (i = 1; i <= list->end; i++) {
+		header.namessize += strlen(list->contents[i].name)+1;
+	}
+	fwrite(&header, sizeof(header), 1, fp);
+
+	for (i = 1; i <= list->end; i++) {
+		entry.nameoffset = offset;
+		entry.statmask = list->contents[i].statmask;
+		entry.mode = list->contents[i].mode;
+		entry.islink = list->contents[i].islink;
+		entry.size = list->contents[i].size;
+		entry.mtime = list->contents[i].mtime;
+		fwrite(&entry, sizeof(entry), 1, fp);
+		offset += strlen(list->contents[i].name)+1;
+	}
+	for (i = 1; i <= list->end; i++) {
+		fwrite(list->contents[i].name, strlen(list->contents[i].name)+1, 1, fp);
+	}
+}
+
+int
+privatedir(char *buf, char *xdg, char *fallback) /* a directory only the user can get into, $xdg/stuifm or ~/fallback/stuifm, /tmp/stuifm-uid without either; returns 0 if it's there */
+{
+	struct stat dirstat;
+	char *base, *home;
+
+	if ((base = getenv(xdg)) != NULL && base[0] == '/') {
+		snprintf(buf, PATH_MAX, "%s/stuifm", base);
+	} else if (fallback && (home = getenv("HOME")) != NULL && home[0] == '/') {
+		snprintf(buf, PATH_MAX, "%s/%s", home, fallback);
+		mkdir(buf, 0700);
+		snprintf(buf, PATH_MAX, "%s/%s/stuifm", home, fallback);
+	} else {
+		snprintf(buf, PATH_MAX, "/tmp/stuifm-%d", (int)getuid());
+	}
+
+	/* in a shared directory someone else can make it first, so it's only used if it's the user's and closed to others */
+	if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+	if (lstat(buf, &dirstat) != 0 || !S_ISDIR(dirstat.st_mode) || dirstat.st_uid != getuid() || (dirstat.st_mode & 077)) return -1;
+	return 0;
+}
+
+int
+daemonsocketpath(char *buf) /* returns 0 if buf is the socket's path */
+{
+	char dir[PATH_MAX];
+
+	if (privatedir(dir, "XDG_RUNTIME_DIR", NULL) != 0) return -1;
+	return snprintf(buf, sizeof(((struct sockaddr_un *)0)->sun_path), "%s/%s", dir, DAEMON_SOCKET) < (int)sizeof(((struct sockaddr_un *)0)->sun_path) ? 0 : -1;
+}
+
+int
+peerisuser(int sock) /* whoever is at the other end of sock runs as the user */
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+void *
+daemonlisting(char *dirpath, int flags, size_t *size) /* returns the daemon's listing mmap'd, NULL if there's no daemon to ask or (with DaemonCachedOnly) it hasn't got it */
+{
+	static int sock = -1;
+	static time_t lastfailure = 0;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	DaemonRequest request = {.magic = INDEX_MAGIC};
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct stat filestat;
+	struct timeval timeout = {.tv_sec = DAEMON_TIMEOUT_MS/1000, .tv_usec = DAEMON_TIMEOUT_MS%1000*1000};
+	int reply = -1, fd = -1;
+	void *map;
+
+	if (sock < 0) {
+		/* don't try to reach a daemon that isn't there on every directory change */
+		if (time(NULL)-lastfailure < DAEMON_RETRY_SECONDS) return NULL;
+
+		/* a daemon that takes too long is given up on like one that isn't there, it's only ever faster than reading */
+		if (daemonsocketpath(addr.sun_path) != 0 || (sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0 || \
+				connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || !peerisuser(sock) || \
+				setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+			if (sock >= 0) close(sock);
+			sock = -1;
+			lastfailure = time(NULL);
+			return NULL;
+		}
+	}
+
+	request.flags = flags;
+	strncpy(request.path, dirpath, PATH_MAX-1);
+
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (send(sock, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request) || \
+			recvmsg(sock, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC) != sizeof(reply)) {
+		close(sock);
+		sock = -1;
+		lastfailure = time(NULL);
+		return NULL;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (reply != 0 || fd < 0) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	if (fstat(fd, &filestat) != 0 || filestat.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	*size = filestat.st_size;
+	return map;
+}
+
+int
+daemonserve(int client, CachedListing *listings, int inotifyfd) /* returns -1 when the client went away */
+{
+	DaemonRequest request;
+	CachedListing *l = NULL;
+	Files list = {0};
+	struct stat dirstat;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	int i, reply = 0, fd;
+	FILE *fp;
+	int cachedonly;
+
+	if (recv(client, &request, sizeof(request), MSG_WAITALL) != sizeof(request) || request.magic != INDEX_MAGIC) return -1;
+	request.path[PATH_MAX-1] = 0;
+	cachedonly = request.flags & DaemonCachedOnly;
+	request.flags &= ~DaemonCachedOnly;
+
+	for (i = 0; i < DAEMON_MAX_LISTINGS; i++) {
+		if (listings[i].memfd >= 0 && listings[i].flags == request.flags && strcmp(listings[i].path, request.path) == 0) {
+			l = &listings[i];
+			break;
+		}
+	}
+
+	if (!l && !cachedonly && stat(request.path, &dirstat) == 0 && S_ISDIR(dirstat.st_mode)) {
+		/* take a free slot or the least recently used one */
+		l = &listings[0];
+		for (i = 0; i < DAEMON_MAX_LISTINGS && l->memfd >= 0; i++) {
+			if (listings[i].memfd < 0 || listings[i].lastused < l->lastused) l = &listings[i];
+		}
+		if (l->memfd >= 0) daemoninvalidate(listings, inotifyfd, l->wd);
+
+		/* the watch goes first so nothing that changes while reading is missed */
+		l->wd = inotify_add_watch(inotifyfd, request.path, IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+		scandirectory(open(request.path, O_RDONLY|O_DIRECTORY), request.path, &list, request.flags & 1, request.flags & 2, 0);
+
+		if (l->wd >= 0 && (l->memfd = memfd_create("stuifm-listing", MFD_CLOEXEC|MFD_ALLOW_SEALING)) >= 0) {
+			if ((fd = dup(l->memfd)) >= 0 && (fp = fdopen(fd, "w")) != NULL) {
+				serializeindex(fp, &dirstat, &list, request.flags);
+				fclose(fp);
+			}
+			/* clients map it directly, so it can't change under them */
+			fcntl(l->memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+			strncpy(l->path, request.path, PATH_MAX);
+			l->flags = request.flags;
+		} else {
+			if (l->wd >= 0) daemoninvalidate(listings, inotifyfd, l->wd);
+			l = NULL;
+		}
+		freelistcontents(&list);
+	}
+
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (l) {
+		l->lastused = time(NULL);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &l->memfd, sizeof(int));
+	} else {
+		reply = -1;
+	}
+
+	return sendmsg(client, &msg, MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+}
+
+void
+daemoninvalidate(CachedListing *listings, int inotifyfd, int wd)
+{
+	int i, watched = 0;
+
+	for (i = 0; i < DAEMON_MAX_LISTINGS; i++) {
+		if (listings[i].memfd >= 0 && (wd < 0 || listings[i].wd == wd)) {
+			close(listings[i].memfd);
+			listings[i].memfd = -1;
+			watched = 1;
+		}
+	}
+	if (watched && wd >= 0) inotify_rm_watch(inotifyfd, wd);
+}
+
+int
+rundaemon(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct pollfd fds[DAEMON_MAX_CLIENTS+2];
+	CachedListing *listings;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event)))), *p;
+	struct inotify_event *ev;
+	ssize_t len;
+	int sock, inotifyfd, i, nfds = 2;
+
+	if ((listings = (CachedListing *)calloc(DAEMON_MAX_LISTINGS, sizeof(CachedListing))) == NULL) {
+		perror("couldn't allocate memory for the listings");
+		return 1;
+	}
+	for (i = 0; i < DAEMON_MAX_LISTINGS; i++) {
+		listings[i].memfd = listings[i].wd = -1;
+	}
+
+	if (daemonsocketpath(addr.sun_path) != 0) {
+		fprintf(stderr, "no directory of the user's own for the socket, in XDG_RUNTIME_DIR or /tmp\n");
+		return 1;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "a daemon is already listening on %s\n", addr.sun_path);
+		return 1;
+	}
+	unlink(addr.sun_path); /* left behind by a daemon that died */
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(addr.sun_path, 0600) != 0 || listen(sock, 16) != 0) {
+		perror(addr.sun_path);
+		return 1;
+	}
+	if ((inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = inotifyfd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			return 1;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if ((i = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+				if (nfds < DAEMON_MAX_CLIENTS+2 && peerisuser(i)) {
+					fds[nfds].fd = i;
+					fds[nfds++].events = POLLIN;
+				} else {
+					close(i);
+				}
+			}
+		}
+
+		/* anything that changes in a watched directory drops its listings, they are reread when asked for again */
+		if (fds[1].revents & POLLIN) {
+			while ((len = read(inotifyfd, events, sizeof(events))) > 0) {
+				for (p = events; p < events+len; p += sizeof(struct inotify_event)+ev->len) {
+					ev = (struct inotify_event *)p;
+					daemoninvalidate(listings, inotifyfd, ev->mask & IN_Q_OVERFLOW ? -1 : ev->wd);
+				}
+			}
+		}
+
+		for (i = 2; i < nfds; i++) {
+			if (!fds[i].revents) continue;
+			if (!(fds[i].revents & POLLIN) || daemonserve(fds[i].fd, listings, inotifyfd) != 0) {
+				close(fds[i].fd);
+				fds[i--] = fds[--nfds];
+			}
+		}
+	}
+}
+
+Revalidation *
+newrevalidation(struct stat *dirstat) /* a reread of cwd, to be run on a thread */
+{
+	Revalidation *r;
+
+	if ((r = (Revalidation *)calloc(1, sizeof(Revalidation))) == NULL) return NULL;
+	strncpy(r->path, cwd, PATH_MAX);
+	r->dirstat = *dirstat;
+	r->dirsfirst = sortbydirectories;
+	r->hidden = hiddenfiles;
+	r->generation = revalidationgeneration;
+	r->namesonly = isdegraded();
+	return r;
+}
+
+void
+startrevalidation(struct stat *dirstat)
+{
+	pthread_t thread;
+	Revalidation *r;
+
+	listingflags = -1; /* what's shown is older than dirstat */
+	if ((r = newrevalidation(dirstat)) == NULL) return;
+	if (pthread_create(&thread, NULL, revalidate, r) != 0) {
+		free(r);
+		return;
+	}
+	pthread_detach(thread);
+	backgroundpending++;
+	strncpy(status, "showing cached listing, rereading the directory", NAME_MAX);
+}
+
+void *
+revalidate(void *arg)
+{
+	Revalidation *r = (Revalidation *)arg;
+
+	stat(r->path, &r->dirstat); /* the reread listing is at least as new as this */
+	scandirectory(open(r->path, O_RDONLY|O_DIRECTORY), r->path, &r->list, r->dirsfirst, r->hidden, r->namesonly);
+
+	/* one for an older listing can end after this one, on a slow filesystem */
+	pthread_mutex_lock(&backgroundlock);
+	revalidationsended++;
+	if (revalidated && revalidated->generation > r->generation) {
+		freelistcontents(&r->list);
+		free(r);
+	} else {
+		if (revalidated) {
+			freelistcontents(&revalidated->list);
+			free(revalidated);
+		}
+		revalidated = r;
+	}
+	pthread_mutex_unlock(&backgroundlock);
+	return NULL;
+}
+
+int
+checkbackground(void) /* returns 1 if something finished and the screen should be redrawn */
+{
+	Revalidation *r;
+	char currentname[NAME_MAX] = "";
+	int i, redraw = 0;
+
+	/* the rereads that ended are no longer pending, whether theirs is the listing that's left or not */
+	pthread_mutex_lock(&backgroundlock);
+	r = revalidated;
+	revalidated = NULL;
+	backgroundpending -= revalidationsended;
+	revalidationsended = 0;
+	pthread_mutex_unlock(&backgroundlock);
+
+	if (r) {
+		if (r->generation == revalidationgeneration) {
+			/* swap the listing in, keeping the cursor on the same file */
+			if (fileslist.contents && current <= fileslist.end) strncpy(currentname, fileslist.contents[current].name, NAME_MAX);
+			freelistcontents(&fileslist);
+			fileslist = r->list;
+			writeindex(&r->dirstat, &fileslist);
+			listingstat = r->dirstat;
+			listingflags = r->namesonly ? -1 : indexflags(r->dirsfirst, r->hidden);
+
+			current = 1;
+			for (i = 1; i <= fileslist.end; i++) {
+				if (strcmp(fileslist.contents[i].name, currentname) == 0) {
+					current = i;
+					break;
+				}
+			}
+			if (topofscreen > current) topofscreen = current;
+			strncpy(status, "reread the directory", NAME_MAX);
+			redraw = 1;
+		} else {
+			freelistcontents(&r->list);
+		}
+		free(r);
+	}
+
+	if (grepjob && checkgrep()) redraw = 1;
+	if (countpending && checkcounts()) redraw = 1;
+
+	return redraw;
+}
+
+void
+prefetchadd(PrefetchJob *job, char *path)
+{
+	if (job->n >= job->size) {
+		job->size += N;
+		if ((job->paths = (char **)realloc(job->paths, job->size * sizeof(char *))) == NULL) {
+			perror("couldn't allocate memory for prefetching");
+			exit(1);
+		}
+	}
+	if ((job->paths[job->n++] = strdup(path)) == NULL) {
+		perror("couldn't allocate memory for prefetching");
+		exit(1);
+	}
+}
+
+void
+startprefetch(void) /* reads ahead the directories the cursor could go to next, once keys stop coming */
+{
+	PrefetchJob *job;
+	pthread_t thread;
+	char path[PATH_MAX];
+	int i, d, side;
+
+	if (__atomic_load_n(&prefetchrunning, __ATOMIC_SEQ_CST)) return; /* the last one hasn't stopped yet, this is tried again */
+	prefetchwanted = 0;
+	if (listinglabel[0] || fileslist.total || !fileslist.contents) return;
+
+	if ((job = (PrefetchJob *)calloc(1, sizeof(PrefetchJob))) == NULL) return;
+	job->flags = indexflags(sortbydirectories, hiddenfiles);
+	strncpy(job->cwd, cwd, PATH_MAX);
+
+	/* the current file first, then outwards from it, then the parent and what's next to cwd */
+	for (d = 0; d <= PREFETCH_NEIGHBOURS; d++) {
+		for (side = d ? -1 : 1; side <= 1; side += 2) {
+			i = current + side*d;
+			if (i >= 1 && i <= fileslist.end && S_ISDIR(fileslist.contents[i].mode)) prefetchadd(job, elempath(&fileslist.contents[i], path));
+		}
+	}
+	if (ndirfds > 1) {
+		prefetchadd(job, dirpaths[1]);
+		job->parent = job->n-1;
+	} else {
+		job->parent = -1;
+	}
+
+	__atomic_store_n(&prefetchstop, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prefetchrunning, 1, __ATOMIC_SEQ_CST);
+	if (pthread_create(&thread, NULL, prefetchworker, job) != 0) {
+		__atomic_store_n(&prefetchrunning, 0, __ATOMIC_SEQ_CST);
+		freeprefetchjob(job);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+void
+freeprefetchjob(PrefetchJob *job)
+{
+	int i;
+
+	for (i = 0; i < job->n; i++) free(job->paths[i]);
+	free(job->paths);
+	free(job);
+}
+
+void *
+prefetchworker(void *arg)
+{
+	PrefetchJob *job = (PrefetchJob *)arg;
+	struct sched_param param = {0};
+	int i;
+
+	/* only what would be idle anyway is used, for the cpu and the disk */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13); /* IOPRIO_WHO_PROCESS of this thread, IOPRIO_CLASS_IDLE */
+
+	/* the subdirectories of the parent are added to the job as it's read */
+	for (i = 0; i < job->n && i < PREFETCH_SLOTS && !__atomic_load_n(&prefetchstop, __ATOMIC_SEQ_CST); i++) {
+		prefetchdirectory(job, job->paths[i], i == job->parent);
+	}
+
+	freeprefetchjob(job);
+	__atomic_store_n(&prefetchrunning, 0, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+void
+prefetchdirectory(PrefetchJob *job, char *path, int addsubdirs)
+{
+	Files list = {0};
+	Prefetched *p;
+	struct stat dirstat;
+	char subpath[PATH_MAX];
+	int fd, i, cached = 0;
+
+	if ((fd = open(path, O_RDONLY|O_DIRECTORY)) < 0) return;
+	/* the stat comes before the reading, so a change while reading makes the listing stale */
+	if (fstat(fd, &dirstat) != 0 || dirstat.st_size >= (off_t)LARGE_DIRECTORY*2) {
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&prefetchlock);
+	if ((p = findprefetched(path, &dirstat, job->flags)) != NULL) {
+		cached = 1;
+		for (i = 1; addsubdirs && i <= p->list.end; i++) {
+			if (S_ISDIR(p->list.contents[i].mode)) prefetchadd(job, elempath(&p->list.contents[i], subpath));
+		}
+	}
+	pthread_mutex_unlock(&prefetchlock);
+	if (cached) {
+		close(fd);
+		return;
+	}
+
+	scandirectory(fd, path, &list, job->flags & 1, job->flags & 2, 0);
+	for (i = 1; addsubdirs && i <= list.end; i++) {
+		if (S_ISDIR(list.contents[i].mode) && strcmp(elempath(&list.contents[i], subpath), job->cwd) != 0) prefetchadd(job, subpath);
+	}
+	storeprefetched(path, &dirstat, job->flags, &list, 0, 0);
+}
+
+Prefetched *
+findprefetched(char *path, struct stat *dirstat, int flags) /* prefetchlock is held; a stale listing is dropped */
+{
+	int i;
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (!prefetched[i].list.contents || prefetched[i].flags != flags || strcmp(prefetched[i].path, path) != 0) continue;
+		if (prefetched[i].dirstat.st_dev == dirstat->st_dev && prefetched[i].dirstat.st_ino == dirstat->st_ino && \
+				prefetched[i].dirstat.st_mtim.tv_sec == dirstat->st_mtim.tv_sec && \
+				prefetched[i].dirstat.st_mtim.tv_nsec == dirstat->st_mtim.tv_nsec) {
+			prefetched[i].lastused = ++prefetchclock;
+			return &prefetched[i];
+		}
+		dropprefetched(&prefetched[i]);
+	}
+	return NULL;
+}
+
+void
+dropprefetched(Prefetched *p)
+{
+	prefetchedbytes -= (size_t)p->list.n * sizeof(FileElem);
+	freelistcontents(&p->list);
+}
+
+void
+storeprefetched(char *path, struct stat *dirstat, int flags, Files *list, int cursor, int top)
+{
+	Prefetched *p, *victim;
+	size_t bytes = (size_t)list->n * sizeof(FileElem);
+	int i;
+
+	if (!list->contents || bytes > PREFETCH_MEMORY) {
+		freelistcontents(list);
+		return;
+	}
+
+	pthread_mutex_lock(&prefetchlock);
+	/* the least recently used listings make room, until this one fits and has a slot; taken ones leave empty slots anywhere */
+	for (;;) {
+		p = victim = NULL;
+		for (i = 0; i < PREFETCH_SLOTS; i++) {
+			if (!prefetched[i].list.contents) {
+				if (!p) p = &prefetched[i];
+			} else if (!victim || prefetched[i].lastused < victim->lastused) {
+				victim = &prefetched[i];
+			}
+		}
+		if (p && prefetchedbytes+bytes <= PREFETCH_MEMORY) break;
+		if (!victim) {
+			pthread_mutex_unlock(&prefetchlock);
+			freelistcontents(list);
+			return;
+		}
+		dropprefetched(victim);
+	}
+
+	strncpy(p->path, path, PATH_MAX);
+	p->dirstat = *dirstat;
+	p->flags = flags;
+	p->list = *list;
+	p->current = cursor;
+	p->topofscreen = top;
+	p->lastused = ++prefetchclock;
+	prefetchedbytes += bytes;
+	pthread_mutex_unlock(&prefetchlock);
+}
+
+int
+takeprefetched(char *path, struct stat *dirstat, Files *list, int *cursor, int *top) /* 0 -> the listing was in the cache and is now in list, with the cursor where it was left */
+{
+	Prefetched *p;
+
+	pthread_mutex_lock(&prefetchlock);
+	if ((p = findprefetched(path, dirstat, indexflags(sortbydirectories, hiddenfiles))) != NULL) {
+		*list = p->list;
+		if (p->current >= 1 && p->current <= list->end) {
+			*cursor = p->current;
+			*top = MAX(MIN(p->topofscreen, p->current), 1);
+		}
+		prefetchedbytes -= (size_t)p->list.n * sizeof(FileElem);
+		memset(&p->list, 0, sizeof(Files));
+	}
+	pthread_mutex_unlock(&prefetchlock);
+	return p ? 0 : -1;
+}
+
+void
+parklisting(void) /* a listing of cwd is put in the cache when it's left, so going back to it doesn't read it again */
+{
+	/* one the other tabs share goes back to them instead, it's only cached when no other tab is on it */
+	if (currenttab >= 0 && tabs[currenttab].listing) {
+		if (tabs[currenttab].listing->refs > 1) givebacklisting(&tabs[currenttab]);
+		else tabs[currenttab].listing->lent = 0;
+		droplisting(&tabs[currenttab].listing);
+		if (!fileslist.contents) return;
+	}
+
+	if (!listingkeepable()) {
+		freelistcontents(&fileslist);
+		return;
+	}
+
+	settlelisting(&fileslist);
+	storeprefetched(cwd, &listingstat, listingflags, &fileslist, current, topofscreen);
+	memset(&fileslist, 0, sizeof(Files));
+	listingflags = -1;
+}
+
+void
+settlelisting(Files *list) /* a listing that's put away: what was known of its entries can be out of date when it's shown again */
+{
+	int i;
+
+	for (i = 1; i <= list->end; i++) {
+		if (list->contents[i].countstate == CountAsked) list->contents[i].countstate = CountNone; /* it would never come */
+		list->contents[i].gitmark = 0;
+		list->contents[i].statmask &= STATX_TYPE;
+	}
+}
+
+void
+loadfrecency(void) /* the database with the visits every session logged since merged into it, written back so the log starts over */
+{
+	char logpath[PATH_MAX];
+	int logfd;
+
+	freefrecency();
+	snprintf(logpath, PATH_MAX, "%s.log", frecencypath);
+	if ((logfd = open(logpath, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600)) < 0) {
+		readfrecency();
+		return;
+	}
+
+	/* the log's lock keeps another session from logging a visit between reading the log and emptying it */
+	flock(logfd, LOCK_EX);
+	readfrecency();
+	replayvisits(logfd);
+	if (writefrecency() == 0 && ftruncate(logfd, 0) != 0) strncpy(status, "couldn't empty the log of visits", NAME_MAX);
+	flock(logfd, LOCK_UN);
+	close(logfd);
+}
+
+void
+savefrecency(void) /* what this session visited is already in the log, it's merged in again for the other sessions' sake */
+{
+	if (!frecent) return;
+	loadfrecency();
+	freefrecency();
+}
+
+void
+readfrecency(void)
+{
+	int fd, i;
+	size_t offset;
+	struct stat filestat;
+	unsigned int header[3];
+	FrecencyRecord record;
+	char *map;
+
+	if ((fd = open(frecencypath, O_RDONLY)) < 0) return;
+	if (fstat(fd, &filestat) != 0 || filestat.st_size < (off_t)sizeof(header)) {
+		close(fd);
+		return;
+	}
+	map = (char *)mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	memcpy(header, map, sizeof(header));
+	if (header[0] != FRECENCY_MAGIC || header[1] != FRECENCY_VERSION || (int)header[2] < 0) {
+		munmap(map, filestat.st_size);
+		return;
+	}
+
+	offset = sizeof(header);
+	for (i = 0; i < (int)header[2] && offset+sizeof(record) <= (size_t)filestat.st_size; i++) {
+		memcpy(&record, map+offset, sizeof(record));
+		offset += sizeof(record);
+		if (offset+record.len+1 > (size_t)filestat.st_size || map[offset+record.len] != 0) break;
+
+		if (nfrecent >= frecentsize) {
+			frecentsize += N;
+			if ((frecent = (Frecent *)realloc(frecent, frecentsize * sizeof(Frecent))) == NULL) {
+				perror("couldn't allocate memory for the frecency database");
+				exit(1);
+			}
+		}
+		frecent[nfrecent].path = strdup(map+offset);
+		frecent[nfrecent].rank = record.rank;
+		frecent[nfrecent].atime = (time_t)record.atime;
+		nfrecent++;
+		offset += record.len+1;
+	}
+
+	munmap(map, filestat.st_size);
+}
+
+int
+writefrecency(void) /* returns 0 if the database was replaced */
+{
+	char tmppath[PATH_MAX];
+	unsigned int header[3] = {FRECENCY_MAGIC, FRECENCY_VERSION, 0};
+	int i, failed = 0;
+	FILE *fp;
+	FrecencyRecord record = {0};
+
+	snprintf(tmppath, PATH_MAX, "%s.%d", frecencypath, (int)getpid());
+	if ((fp = fopen(tmppath, "w")) == NULL) return -1;
+
+	header[2] = nfrecent;
+	if (fwrite(header, sizeof(header), 1, fp) != 1) failed = 1;
+	for (i = 0; i < nfrecent && !failed; i++) {
+		record.rank = frecent[i].rank;
+		record.atime = (long long)frecent[i].atime;
+		record.len = strlen(frecent[i].path);
+		if (fwrite(&record, sizeof(record), 1, fp) != 1 || fwrite(frecent[i].path, record.len+1, 1, fp) != 1) failed = 1;
+	}
+
+	if (fclose(fp) != 0 || failed || rename(tmppath, frecencypath) != 0) {
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
+
+void
+replayvisits(int logfd) /* applies the logged visits, a record cut short by a session that died is where it stops */
+{
+	struct stat filestat;
+	FrecencyRecord record;
+	size_t offset = 0;
+	char *map;
+
+	if (fstat(logfd, &filestat) != 0 || filestat.st_size == 0) return;
+	map = (char *)mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, logfd, 0);
+	if (map == MAP_FAILED) return;
+
+	while (offset+sizeof(record) <= (size_t)filestat.st_size) {
+		memcpy(&record, map+offset, sizeof(record));
+		offset += sizeof(record);
+		if (offset+record.len+1 > (size_t)filestat.st_size || map[offset+record.len] != 0) break;
+		applyvisit(map+offset, (time_t)record.atime);
+		offset += record.len+1;
+	}
+
+	munmap(map, filestat.st_size);
+}
+
+void
+freefrecency(void)
+{
+	int i;
+
+	for (i = 0; i < nfrecent; i++) {
+		free(frecent[i].path);
+	}
+	free(frecent);
+	frecent = NULL;
+	nfrecent = frecentsize = 0;
+}
+
+void
+visitdirectory(char *path) /* counted here and logged right away, so a session that's killed doesn't lose it and two don't overwrite each other */
+{
+	char buf[sizeof(FrecencyRecord)+PATH_MAX], logpath[PATH_MAX];
+	FrecencyRecord record = {0};
+	time_t now = time(NULL);
+	int fd;
+
+	applyvisit(path, now);
+
+	record.rank = 1;
+	record.atime = (long long)now;
+	record.len = strlen(path);
+	memcpy(buf, &record, sizeof(record));
+	memcpy(buf+sizeof(record), path, record.len+1);
+	snprintf(logpath, PATH_MAX, "%s.log", frecencypath);
+	if ((fd = open(logpath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600)) < 0) return;
+	flock(fd, LOCK_EX);
+	if (write(fd, buf, sizeof(record)+record.len+1) != (ssize_t)(sizeof(record)+record.len+1)) \
+		strncpy(status, "couldn't log the visit for jump", NAME_MAX);
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+void
+applyvisit(char *path, time_t when)
+{
+	int i, k, lowest = -1;
+	double total = 0;
+
+	for (i = 0; i < nfrecent; i++) {
+		if (strcmp(frecent[i].path, path) == 0) break;
+	}
+
+	if (i == nfrecent) {
+		if (nfrecent >= FRECENCY_MAX) {
+			/* forget the least frecent directory to make room */
+			for (k = 0; k < nfrecent; k++) {
+				if (lowest < 0 || frecencyscore(&frecent[k], when) < frecencyscore(&frecent[lowest], when)) lowest = k;
+			}
+			free(frecent[lowest].path);
+			frecent[lowest] = frecent[--nfrecent];
+			i = nfrecent;
+		}
+		if (nfrecent >= frecentsize) {
+			frecentsize += N;
+			if ((frecent = (Frecent *)realloc(frecent, frecentsize * sizeof(Frecent))) == NULL) {
+				perror("couldn't allocate memory for the frecency database");
+				exit(1);
+			}
+		}
+		frecent[i].path = strdup(path);
+		frecent[i].rank = 0;
+		frecent[i].atime = 0;
+		nfrecent++;
+	}
+	frecent[i].rank += 1;
+	frecent[i].atime = MAX(frecent[i].atime, when);
+
+	/* age everything once the ranks add up to too much, dropping what becomes irrelevant */
+	for (k = 0; k < nfrecent; k++) {
+		total += frecent[k].rank;
+	}
+	if (total > FRECENCY_AGING) {
+		for (k = 0; k < nfrecent; k++) {
+			frecent[k].rank *= 0.9;
+			if (frecent[k].rank < 1) {
+				free(frecent[k].path);
+				frecent[k--] = frecent[--nfrecent];
+			}
+		}
+	}
+}
+
+double
+frecencyscore(Frecent *f, time_t now)
+{
+	time_t age = now - f->atime;
+
+	if (age < 3600) return f->rank * 4;
+	if (age < 86400) return f->rank * 2;
+	if (age < 604800) return f->rank / 2;
+	return f->rank / 4;
+}
+
+int
+frecencymatches(char *path, char *query) /* every word of the query has to appear in the path, in order */
+{
+	char word[NAME_MAX], *p = path, *q = query;
+	int len;
+
+	for (;;) {
+		while (*q == ' ') q++;
+		if (*q == 0) return 1;
+
+		for (len = 0; q[len] && q[len] != ' ' && len < NAME_MAX-1; len++) {
+			word[len] = q[len];
+		}
+		word[len] = 0;
+		q += len;
+
+		if ((p = strcasestr(p, word)) == NULL) return 0;
+		p += len;
+	}
+}
+
+int
+frecencycompare(const void *a, const void *b)
+{
+	double sa = frecencyscore(&frecent[*(const int *)a], frecencynow);
+	double sb = frecencyscore(&frecent[*(const int *)b], frecencynow);
+
+	return (sa < sb) - (sa > sb);
+}
+
+void
+rmvselection(char *path, char *name)
+{
+	if (!selected.contents) return;
+
+	int i, found = 0;
+	for (i = 1; i <= selected.end; i++) {
+		if (strcmp(selected.contents[i].path, path) == 0 && strcmp(selected.contents[i].name, name) == 0) {
+			found = 1;
+		}
+
+		if (found) { /* this to remove the element instead of 2 for loops */
+			strncpy(selected.contents[i].path, selected.contents[i+1].path, PATH_MAX);
+			strncpy(selected.contents[i].name, selected.contents[i+1].name, NAME_MAX);
+		}
+	}
+
+	if (found) selected.end--;
+}
+
+void
+batchstatx(int dirfd, MetaRequest *reqs, int n, unsigned int mask)
+{
+	MetaBatch batch = {.dirfd = dirfd, .n = n, .next = 0, .mask = mask, .reqs = reqs};
+
+	if (n <= 0) return;
+
+	/* io_uring keeps many of them in flight from a single thread, otherwise they are spread over threads */
+	if (uringstatx(dirfd, reqs, n, mask) == 0) return;
+
+	if (n < 4) statxworker(&batch);
+	else runworkers(MIN(STATX_THREADS, n/2), statxworker, &batch);
+}
+
+int
+uringsetup(void) /* returns 0 if io_uring can be used for statx */
+{
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	size_t sqsize, cqsize;
+	char *sq, *cq;
+	int fd;
+
+	if (uringavailable >= 0) return uringavailable ? 0 : -1;
+	uringavailable = 0;
+
+	memset(&params, 0, sizeof(params));
+	if ((fd = syscall(__NR_io_uring_setup, STATX_QUEUE_DEPTH, &params)) < 0) return -1;
+
+	/* kernels older than 5.6 have io_uring but not statx through it */
+	probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op));
+	if (!probe || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 || \
+			probe->last_op < IORING_OP_STATX || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+		free(probe);
+		close(fd);
+		return -1;
+	}
+	free(probe);
+
+	sqsize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+	cqsize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) sqsize = cqsize = MAX(sqsize, cqsize);
+
+	sq = (char *)mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else if ((cq = (char *)mmap(NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	uring.sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	uring.fd = fd;
+	uring.entries = params.sq_entries;
+	uring.sqhead = (unsigned int *)(sq+params.sq_off.head);
+	uring.sqtail = (unsigned int *)(sq+params.sq_off.tail);
+	uring.sqmask = (unsigned int *)(sq+params.sq_off.ring_mask);
+	uring.sqarray = (unsigned int *)(sq+params.sq_off.array);
+	uring.cqhead = (unsigned int *)(cq+params.cq_off.head);
+	uring.cqtail = (unsigned int *)(cq+params.cq_off.tail);
+	uring.cqmask = (unsigned int *)(cq+params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq+params.cq_off.cqes);
+	uringavailable = 1;
+	return 0;
+}
+
+int
+uringstatx(int dirfd, MetaRequest *reqs, int n, unsigned int mask)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, head;
+	int i, next = 0, done = 0, inflight = 0, tosubmit, ret;
+
+	/* threads that can be left waiting (reading ahead, on a slow filesystem) use threads of their own */
+	if (!uringowned || !pthread_equal(pthread_self(), uringthread) || uringsetup() != 0) return -1;
+	for (i = 0; i < n; i++) {
+		reqs[i].err = EIO; /* until it completes */
+	}
+
+	while (done < n) {
+		/* fill the submission queue */
+		tail = *uring.sqtail;
+		for (tosubmit = 0; next < n && inflight < (int)uring.entries; tosubmit++, inflight++, next++, tail++) {
+			sqe = &uring.sqes[tail & *uring.sqmask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)reqs[next].name;
+			sqe->len = mask;
+			sqe->off = (unsigned long)&reqs[next].stx;
+			sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+			sqe->user_data = next;
+			uring.sqarray[tail & *uring.sqmask] = tail & *uring.sqmask;
+		}
+		__atomic_store_n(uring.sqtail, tail, __ATOMIC_RELEASE);
+
+		do {
+			ret = syscall(__NR_io_uring_enter, uring.fd, tosubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) break;
+		uringreap(reqs, &done, &inflight);
+	}
+	if (done == n) return 0;
+
+	/* the ring went bad: what the kernel didn't take is taken back and done synchronously, and
+	 * what it did take is waited for, as it writes into reqs
+	 */
+	uringavailable = 0;
+	head = __atomic_load_n(uring.sqhead, __ATOMIC_ACQUIRE);
+	inflight -= tail-head;
+	next -= tail-head;
+	__atomic_store_n(uring.sqtail, head, __ATOMIC_RELEASE);
+	while (inflight > 0) {
+		ret = syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+		uringreap(reqs, &done, &inflight);
+	}
+
+	for (; next < n; next++) {
+		reqs[next].err = statx(dirfd, reqs[next].name, AT_STATX_SYNC_AS_STAT, mask, &reqs[next].stx) ? errno : 0;
+	}
+	return 0;
+}
+
+void
+uringreap(MetaRequest *reqs, int *done, int *inflight)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *uring.cqhead;
+	while (head != __atomic_load_n(uring.cqtail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring.cqes[head & *uring.cqmask];
+		reqs[cqe->user_data].err = cqe->res < 0 ? -cqe->res : 0;
+		head++;
+		(*done)++;
+		(*inflight)--;
+	}
+	__atomic_store_n(uring.cqhead, head, __ATOMIC_RELEASE);
+}
+
+void *
+statxworker(void *arg)
+{
+	MetaBatch *batch = (MetaBatch *)arg;
+	MetaRequest *req;
+	int i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->n) {
+		req = &batch->reqs[i];
+		req->err = statx(batch->dirfd, req->name, AT_STATX_SYNC_AS_STAT, batch->mask, &req->stx) ? errno : 0;
+	}
+	return NULL;
+}
+
+void
+runworkers(int nthreads, void *(*func)(void *), void *arg) /* runs func(arg) on nthreads threads, the calling one included, and waits for all of them */
+{
+	pthread_t *threads;
+	int i, started = 0;
+
+	if (nthreads > 1 && (threads = (pthread_t *)malloc((nthreads-1) * sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < nthreads-1; i++) {
+			if (pthread_create(&threads[started], NULL, func, arg) == 0) started++;
+		}
+		func(arg);
+		for (i = 0; i < started; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		free(threads);
+	} else {
+		func(arg);
+	}
+}
+
+void
+applystatx(FileElem *elem, struct statx *stx)
+{
+	if (stx->stx_mask & STATX_TYPE) elem->mode = (elem->mode & ~S_IFMT) | (stx->stx_mode & S_IFMT);
+	if (stx->stx_mask & STATX_MODE) elem->mode = (elem->mode & S_IFMT) | (stx->stx_mode & ~S_IFMT);
+	if (stx->stx_mask & STATX_NLINK) elem->nlink = stx->stx_nlink;
+	if (stx->stx_mask & STATX_UID) elem->uid = stx->stx_uid;
+	if (stx->stx_mask & STATX_GID) elem->gid = stx->stx_gid;
+	if (stx->stx_mask & STATX_SIZE) elem->size = stx->stx_size;
+	if (stx->stx_mask & STATX_MTIME) elem->mtime = stx->stx_mtime.tv_sec;
+	if (stx->stx_mask & STATX_CTIME) elem->ctime = stx->stx_ctime.tv_sec;
+	elem->statmask |= stx->stx_mask;
+}
+
+void
+statvisible(void) /* fetches in one batch what the info line needs for every file on the screen that doesn't have it */
+{
+	MetaRequest *reqs;
+	StatCall *call;
+	FileElem *elem;
+	Mount *m;
+	char (*paths)[PATH_MAX];
+	mode_t mode;
+	int i, n = 0, virtual = listinglabel[0] && !archivepath[0];
+
+	if (!fileslist.contents || isdegraded()) return;
+	reqs = (MetaRequest *)malloc(MAX(maxy, 1) * sizeof(MetaRequest));
+	paths = malloc(MAX(maxy, 1) * PATH_MAX);
+	if (!reqs || !paths) {
+		free(reqs);
+		free(paths);
+		return;
+	}
+
+	/* the current file's is fetched again every time, it's what the info line shows */
+	if (current >= 1 && current <= fileslist.end && !archivepath[0]) fileslist.contents[current].statmask &= ~(INFO_STATX_MASK & ~STATX_TYPE);
+
+	/* entries of virtual listings are anywhere, the ones on network filesystems are left alone */
+	for (i = topofscreen; i <= fileslist.end && i < topofscreen+maxy-4; i++) {
+		elem = &fileslist.contents[i];
+		if ((elem->statmask & INFO_STATX_MASK) == INFO_STATX_MASK) continue;
+		if (virtual) {
+			elempath(elem, paths[n]);
+			if ((m = mountof(paths[n])) != NULL && (m->slow || fsremote(m))) continue;
+			reqs[n].name = paths[n];
+		} else if (strcmp(elem->path, cwd) == 0) {
+			reqs[n].name = elem->name;
+		} else {
+			continue;
+		}
+		reqs[n++].index = i;
+	}
+
+	/* on a network filesystem the names are copied, the call can outlive the listing if it's given up on */
+	if (n && !virtual && cwdmount && cwdmount->class == FsRemote) {
+		if ((call = (StatCall *)malloc(sizeof(StatCall))) == NULL || (call->names = malloc(n * NAME_MAX)) == NULL) {
+			free(call);
+			free(reqs);
+			free(paths);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			strncpy(call->names[i], reqs[i].name, NAME_MAX);
+			reqs[i].name = call->names[i];
+		}
+		call->reqs = reqs;
+		call->n = n;
+		if (boundedcall(statcall, call, freestatcall) != 0) {
+			slowmount(cwdmount);
+			free(paths);
+			return;
+		}
+		free(call->names);
+		free(call);
+	} else {
+		batchstatx(AT_FDCWD, reqs, n, INFO_STATX_MASK);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (reqs[i].err) continue;
+		elem = &fileslist.contents[reqs[i].index];
+		mode = elem->mode;
+		applystatx(elem, &reqs[i].stx);
+		if (elem->mode != mode) elem->pair = 0; /* coloured by the type alone until now */
+	}
+	free(reqs);
+	free(paths);
+}
+
+void
+addelem(Files *list, char *path, char *name)
+{
+	if (list->contents == NULL) {
+		list->contents = (FileElem *)malloc(N * sizeof(FileElem));
+		list->n = N;
+		list->end = 0;
+	} else if (list->end+1 >= list->n) {
+		list->contents = (FileElem *)realloc(list->contents, (list->n + N) * sizeof(FileElem));
+		list->n += N;
+	}
+
+	if (list->contents == NULL) {
+		perror("couldn't allocate memory for the file contents");
+		exit(1);
+	}
+	
+	list->end++; /* this means that lists are 1 indexed, because list->end is initially 0 */
+	memset(&list->contents[list->end], 0, sizeof(FileElem));
+	strncpy(list->contents[list->end].path, path, PATH_MAX);
+	strncpy(list->contents[list->end].name, name, NAME_MAX);
+	list->contents[list->end].width = namewidth(list->contents[list->end].name);
+}
+
+void
+freelistcontents(Files *list)
+{
+	if (list->contents == NULL) return;
+	free(list->contents);
+	list->contents = NULL;
+	list->n = 0;
+	list->end = 0;
+	list->offset = list->total = 0;
+}
+
+
+int
+isselected(char *path, char *name)
+{
+	if (!selected.contents) return 0;
+
+	int i = 1;
+
+	for (i = 1; i <= selected.end; i++) {
+		if (strcmp(selected.contents[i].path, path) == 0 && strcmp(selected.contents[i].name, name) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+resizedetected(void)
+{
+	endwin();
+	initialization();
+	strncpy(status, "window resized", NAME_MAX);
+}
+
+void
+rdrwf(void)
+{
+	FileElem *elem;
+	struct passwd *pwd;
+	struct group *gr;
+	int i, digitsfiles, digitspos, t1, width, slowwidth, left;
+	char slowlabel[PATH_MAX], tablabel[NAME_MAX], fileinfo[NAME_MAX], perms[11], user[NAME_MAX], group[NAME_MAX], readablefilesize[NAME_MAX], date[NAME_MAX];
+
+	if (!iscurrentonscreen()) {
+		if (current >= topofscreen+maxy-4) {
+			topofscreen = current-maxy+5;
+		} else {
+			topofscreen = current;
+		}
+
+		if (topofscreen < 1) topofscreen = current;
+		if (topofscreen > fileslist.end) topofscreen = current;
+		if (!iscurrentonscreen()) topofscreen = current;
 	}
 
 	/* get and display the file information */
 	clear();
-	move(0, 0);
-	if (stat(fileslist.contents[current].name, &pathstat) == 0) {
-		if (S_ISDIR(pathstat.st_mode)) perms[0] = 'd'; else perms[0] = '-';
-		if (pathstat.st_mode & S_IRUSR) perms[1] = 'r'; else perms[1] = '-';
-		if (pathstat.st_mode & S_IWUSR) perms[2] = 'w'; else perms[2] = '-';
-		if (pathstat.st_mode & S_IXUSR) perms[3] = 'x'; else perms[3] = '-';
-		if (pathstat.st_mode & S_IRGRP) perms[4] = 'r'; else perms[4] = '-';
-		if (pathstat.st_mode & S_IWGRP) perms[5] = 'w'; else perms[5] = '-';
-		if (pathstat.st_mode & S_IXGRP) perms[6] = 'x'; else perms[6] = '-';
-		if (pathstat.st_mode & S_IROTH) perms[7] = 'r'; else perms[7] = '-';
-		if (pathstat.st_mode & S_IWOTH) perms[8] = 'w'; else perms[8] = '-';
-		if (pathstat.st_mode & S_IXOTH) perms[9] = 'x'; else perms[9] = '-';
-		perms[10] = 0;
+	move(0, 0);
+	statvisible();
+	if (fileslist.contents && (fileslist.contents[current].statmask & INFO_STATX_MASK) == INFO_STATX_MASK) {
+		elem = &fileslist.contents[current];
+		if (S_ISDIR(elem->mode)) perms[0] = 'd'; else perms[0] = '-';
+		if (elem->mode & S_IRUSR) perms[1] = 'r'; else perms[1] = '-';
+		if (elem->mode & S_IWUSR) perms[2] = 'w'; else perms[2] = '-';
+		if (elem->mode & S_IXUSR) perms[3] = 'x'; else perms[3] = '-';
+		if (elem->mode & S_IRGRP) perms[4] = 'r'; else perms[4] = '-';
+		if (elem->mode & S_IWGRP) perms[5] = 'w'; else perms[5] = '-';
+		if (elem->mode & S_IXGRP) perms[6] = 'x'; else perms[6] = '-';
+		if (elem->mode & S_IROTH) perms[7] = 'r'; else perms[7] = '-';
+		if (elem->mode & S_IWOTH) perms[8] = 'w'; else perms[8] = '-';
+		if (elem->mode & S_IXOTH) perms[9] = 'x'; else perms[9] = '-';
+		perms[10] = 0;
+
+		if ((pwd = getpwuid(elem->uid)) != NULL) strncpy(user, pwd->pw_name, NAME_MAX);
+		else snprintf(user, NAME_MAX, "%d", elem->uid);
+	
+		if ((gr = getgrgid(elem->gid)) != NULL) strncpy(group, gr->gr_name, NAME_MAX);
+		else snprintf(group, NAME_MAX, "%d", elem->gid);
+	
+		getreadablefs((double)elem->size, readablefilesize);
+	    strftime(date, NAME_MAX, "%Y-%B-%d %H:%M", gmtime(&elem->ctime));
+	
+		snprintf(fileinfo, maxx-1, "%s %d %s %s %s %s", perms, (int)elem->nlink, user, group, readablefilesize, date);
+		drawtext(1, 0, 0, maxx, 0, 0, fileinfo);
+	}
+	if (listinglabel[0]) {
+		width = widestring(listinglabel, NULL, PATH_MAX);
+		if (maxx-width > 0) drawtext(7, 0, maxx-width, width, 0, 0, listinglabel);
+	} else {
+		width = widestring(cwd, NULL, PATH_MAX);
+		if (maxx-width > 0) drawtext(1, 0, maxx-width, width, 0, 0, cwd);
+	}
+	if (isdegraded()) {
+		/* which mount it is, left of the path */
+		snprintf(slowlabel, PATH_MAX, "SLOW %s ", cwdmount->dir);
+		slowwidth = widestring(slowlabel, NULL, PATH_MAX);
+		if (maxx-width-slowwidth > 0) drawtext(5, 0, maxx-width-slowwidth, slowwidth, 0, 0, slowlabel);
+		width += slowwidth;
+	}
+
+	/* the numbers of the tabs, the current one highlighted */
+	if (ntabs > 1) {
+		left = maxx-width-2*ntabs-1;
+		for (i = 0; i < ntabs && left > 0; i++, left += 2) {
+			snprintf(tablabel, NAME_MAX, "%d", i+1);
+			drawtext(i == currenttab ? 7 : 1, 0, left, 1, 0, 0, tablabel);
+		}
+	}
+
+	move(1, 0);
+	for (i = 0; i < maxx; i++) {
+		addch('-');
+	}
+
+	move(2, 0);
+
+	/* column drawing */
+	rdrwfhelper();
+
+	/* print a line to separate files from the status */
+	move(maxy-2, 0);
+	for (i = 0; i < maxx; i++) {
+		addch('-');
+	}
+
+	/* print the status */
+	escapestring(status, NAME_MAX);
+	drawtext(1, maxy-1, 0, maxx-1, 0, 0, status);
+
+
+	/* print the number of files and what number is the current file */
+	NUMOFDIGITS(digitsfiles, fileslist.total ? fileslist.total : fileslist.end, t1);
+	NUMOFDIGITS(digitspos, fileslist.offset+current, t1);
+
+	if (maxx-digitspos-3-digitsfiles > 0) mvprintw(maxy-1, maxx-digitspos-3-digitsfiles, " %d/%d", fileslist.offset+current, fileslist.total ? fileslist.total : fileslist.end);
+}
+
+void
+rdrwfhelper(void)
+{
+	int i, fd, nextfd, level, size = maxx, currentcolumn = 0, currentposition = 1, ratiossum = 0, overwritesize = 0;
+	char nextpath[PATH_MAX] = "", tmpstr[PATH_MAX], highlightedname[NAME_MAX], *name;
+	Mount *m;
+
+	for (i = 0; drawratios[cratio][i]; i++) {
+		ratiossum += drawratios[cratio][i];
+	}
+	currentposition = drawratios[cratio][i+1];
+	
+	if (currentposition >= i || ratiossum == 0) {
+		rdrwfmaincolumn(0, maxx);
+		strncpy(status, "ratios not properly defined", NAME_MAX);
+		return;
+	} else {
+		size = maxx/ratiossum;
+	}
+
+	/* the previewed directory stays open while the cursor is on it, nothing is opened on a slow filesystem */
+	if (fileslist.contents && !isdegraded()) {
+		elempath(&fileslist.contents[current], nextpath);
+		if (strcmp(nextpath, previewpath) != 0) {
+			if (previewfd >= 0) close(previewfd);
+			previewfd = -1;
+			previewgit = NULL;
+			previewgitasked = 1;
+			strncpy(previewpath, nextpath, PATH_MAX);
+			if ((m = mountof(nextpath)) == NULL || !m->slow) {
+				if (listinglabel[0] || ndirfds == 0) previewfd = open(nextpath, O_RDONLY|O_DIRECTORY);
+				else previewfd = openat(dirfds[0], fileslist.contents[current].name, O_RDONLY|O_DIRECTORY);
+				previewgitasked = listinglabel[0] != 0; /* worked out when it's drawn, for what's drawn */
+			}
+		}
+	}
+	fd = previewfd;
+
+	for (i = 0; drawratios[cratio][i]; i++) {
+		overwritesize = 0;
+
+		if (drawratios[cratio][i+1] == 0) {
+			overwritesize = maxx - currentcolumn;
+		}
+
+		if (i < currentposition) {
+			/* the directories above cwd, each with the name of the next column's one highlighted */
+			level = currentposition-i;
+			if (level < ndirfds) {
+				name = strrchr(dirpaths[level-1], '/');
+				rdrwfsecondarycolumn(dirfds[level], dirpaths[level], name ? name+1 : "", currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size), 0, NULL, NULL);
+			}
+		} else if (i == currentposition) {
+			rdrwfmaincolumn(currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size));
+		} else {
+			if (!fileslist.contents || fd < 0 || isdegraded()) break;
+
+			highlightedname[0] = 0;
+			rdrwfsecondarycolumn(fd, nextpath, "", currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size), 1, highlightedname, fd == previewfd ? &previewgit : NULL);
+
+			/* further columns follow the first entry of the previous one, if it's a directory */
+			nextfd = highlightedname[0] && drawratios[cratio][i+1] ? openat(fd, highlightedname, O_RDONLY|O_DIRECTORY) : -1;
+			if (fd != previewfd) close(fd);
+			if ((fd = nextfd) < 0) break;
+			snprintf(tmpstr, PATH_MAX, "%s/%s", nextpath, highlightedname);
+			strncpy(nextpath, tmpstr, PATH_MAX);
+		}
+
+		currentcolumn += drawratios[cratio][i]*size;
+	}
+	if (fd >= 0 && fd != previewfd) close(fd);
+}
+
+void
+rdrwfmaincolumn(int column, int size) /* (r)e(dr)a(w) (f)unction */
+{
+	int i, d, len, overwrite = 0, width, pair, issel, extra, gitshown;
+	char name[PATH_MAX], after[NAME_MAX];
+	wchar_t wname[PATH_MAX];
+	FileElem *elem;
+
+	i = 2;
+	while (topofscreen+i-2 <= fileslist.end && i < maxy-2) {
+		overwrite = 0;
+
+		if (topofscreen+i-2 == current) {
+			overwrite = 7;
+		}
+
+		elem = &fileslist.contents[topofscreen+i-2];
+
+		/* only the rows on the screen are decoded, keeping wide names in every entry would make listings much bigger
+		 * names are only decoded as far as they can fit, their width is known from when they were added
+		 */
+		if (!listinglabel[0] || archivepath[0]) {
+			width = elem->width;
+			widestring(elem->name, wname, width < size ? PATH_MAX : size+1);
+		} else {
+			width = widestring(displayname(elem, name), wname, PATH_MAX);
+		}
+
+		/* decision on wheter the element is a directory and if it is selected */
+		issel = isselected(elem->path, elem->name);
+		if (overwrite) pair = overwrite;
+		else if (issel) pair = S_ISDIR(elem->mode) ? 4 : 2;
+		else if (elem->mark) pair = elem->mark == MarkNew ? PairNew : elem->mark == MarkMissing ? PairMissing : PairChanged; /* compare results are coloured by what differs */
+		else pair = elempair(elem);
+
+		/* after the name, how many entries a directory has (once it's been counted) and the git status */
+		after[0] = 0;
+		if (SHOWCOUNTS && S_ISDIR(elem->mode) && !archivepath[0] && !isdegraded()) {
+			if (elem->countstate == CountNone) requestcount(elem, topofscreen+i-2);
+			if (elem->countstate == CountDone && elem->children >= COUNT_LIMIT) {
+				if (COUNT_LIMIT % 1000 == 0) snprintf(after, NAME_MAX, " %dk+", COUNT_LIMIT/1000);
+				else snprintf(after, NAME_MAX, " %d+", COUNT_LIMIT);
+			} else if (elem->countstate == CountDone) {
+				snprintf(after, NAME_MAX, " %d", elem->children);
+			}
+		}
+
+		/* then what the plugins add, each after a space */
+		for (d = 0; d < ndecorators; d++) {
+			len = strlen(after);
+			if (len >= NAME_MAX-2) break;
+			if (decorators[d].decorator(topofscreen+i-2, after+len+1, NAME_MAX-len-1, decorators[d].data) > 0) after[len] = ' ';
+			else after[len] = 0;
+			after[NAME_MAX-1] = 0;
+		}
+
+		gitshown = cwdgit && !listinglabel[0];
+		extra = strlen(after) + (gitshown ? 2 : 0);
+		if (size-1-extra < 4) after[0] = 0;
+		extra = strlen(after) + (gitshown ? 2 : 0);
+
+		drawcell(pair, i, column, size-1-extra, issel, S_ISDIR(elem->mode), wname, width);
+		if (after[0]) {
+			attron(COLOR_PAIR(pair));
+			mvaddstr(i, column+size-1-extra, after);
+			attroff(COLOR_PAIR(pair));
+		}
+		if (gitshown) {
+			if (!elem->gitmark) elem->gitmark = gitmark(cwdgit, elem->name);
+			drawmarker(pair, i, column+size-3, elem->gitmark);
+		}
+
+
+		i++;
+	}
+
+	if (i == 2 || !fileslist.contents) {
+		drawtext(5, i, column, size-1, 0, 0, listinglabel[0] ? "NOTHING FOUND" : "NO FILES IN CURRENT DIRECTORY");
+	}
+}
+
+void
+rdrwfsecondarycolumn(int dirfd, char *dirpath, char *comingfrom, int column, int size, int direction, char *highlightedname, GitDirStatus **git) /* direction 0 -> backward; direction 1 -> forwards */
+{
+	int i, j, fd, k, kept = -1, total, overwrite = 0, issel, pair, remote;
+	char *name, more[NAME_MAX];
+	struct stat dirstat;
+	size_t mapsize;
+	void *map;
+	PreviewElem *heap;
+	PreviewRead *pr;
+	Mount *m;
+
+	/* nothing is read from a slow filesystem */
+	m = mountof(dirpath);
+	if (m && m->slow) {
+		drawtext(5, 2, column, size-1, 0, 0, "SLOW FILESYSTEM");
+		return;
+	}
+	remote = fsremote(m);
+
+	/* a description of its own, reading it doesn't move the offset of the one that's kept open */
+	if ((fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY)) < 0) return;
+
+	/* only the entries that fit on the screen are kept, so this doesn't depend on the size of the directory */
+	k = MAX(maxy-4, 1);
+	if ((heap = (PreviewElem *)malloc(k * sizeof(PreviewElem))) == NULL) {
+		close(fd);
+		return;
+	}
+
+	if (USEDAEMON && !replaying && !remote && dirpath[0] && fstat(fd, &dirstat) == 0 && \
+			(map = daemonlisting(dirpath, indexflags(sortbydirectories, hiddenfiles) | DaemonCachedOnly, &mapsize)) != NULL) {
+		kept = previewfromindex(map, mapsize, &dirstat, heap, k, &total);
+		munmap(map, mapsize);
+	}
+	if (kept >= 0) {
+		close(fd);
+	} else if (remote) {
+		/* the read owns fd and heap, they're freed by it if it's given up on */
+		if ((pr = (PreviewRead *)malloc(sizeof(PreviewRead))) == NULL) {
+			free(heap);
+			close(fd);
+			return;
+		}
+		pr->fd = fd;
+		pr->heap = heap;
+		pr->k = k;
+		if (boundedcall(previewreader, pr, freepreviewread) != 0) {
+			slowmount(m);
+			drawtext(5, 2, column, size-1, 0, 0, "SLOW FILESYSTEM");
+			return;
+		}
+		kept = pr->kept;
+		total = pr->total;
+		free(pr);
+	} else {
+		kept = previewdirectory(fd, heap, k, &total);
+	}
+
+	/* the last row tells how many didn't fit */
+	if (total > kept) kept--;
+
+	/* the git markers of the previewed directory are only worked out for what's shown of it */
+	if (git && !previewgitasked) {
+		previewgitasked = 1;
+		*git = remote ? NULL : gitstatus(dirpath, dirfd, heap, kept);
+	}
+
+	for (j = 0, i = 2; j < kept; j++, i++) {
+		name = heap[j].name;
+
+		overwrite = 0;
+		if ((direction && i == 2) || (!direction && strcmp(name, comingfrom) == 0)) {
+			overwrite = 7;
+			if (highlightedname) strncpy(highlightedname, name, NAME_MAX);
+		}
+
+		issel = isselected(dirpath, name);
+		if (overwrite) pair = overwrite;
+		else if (issel) pair = heap[j].isdir ? 4 : 2;
+		else pair = filepair(name, heap[j].isdir ? S_IFDIR : heap[j].type, heap[j].islink);
+		if (git && *git) {
+			drawtext(pair, i, column, size-3, issel, heap[j].isdir, name);
+			drawmarker(pair, i, column+size-3, gitmark(*git, name));
+		} else {
+			drawtext(pair, i, column, size-1, issel, heap[j].isdir, name);
+		}
+	}
+
+	if (total > kept) {
+		snprintf(more, NAME_MAX, "+%d more", total-kept);
+		drawtext(1, i, column, size-1, 0, 0, more);
+	}
+
+	free(heap);
+
+	if (total == 0) {
+		drawtext(5, 2, column, size-1, 0, 0, "NO FILES");
+	}
+
+}
+
+int
+previewdirectory(int fd, PreviewElem *heap, int k, int *total) /* returns how many of the first entries in sort order were kept */
+{
+	DIR *dir;
+	struct dirent *ent;
+	PreviewElem *chunk;
+	MetaRequest *reqs;
+	int i, nchunk, nreqs, n = 0, eof = 0;
+
+	*total = 0;
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	chunk = (PreviewElem *)malloc(METADATA_BATCH * sizeof(PreviewElem));
+	reqs = (MetaRequest *)malloc(METADATA_BATCH * sizeof(MetaRequest));
+	if (!chunk || !reqs) {
+		free(chunk);
+		free(reqs);
+		closedir(dir);
+		return 0;
+	}
+
+	/* entries are read in chunks so the ones without a usable d_type are statx'd in batches */
+	while (!eof) {
+		for (nchunk = nreqs = 0; nchunk < METADATA_BATCH;) {
+			if ((ent = readdir(dir)) == NULL) {
+				eof = 1;
+				break;
+			}
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+			if (!hiddenfiles && ent->d_name[0] == '.') continue;
+
+			strncpy(chunk[nchunk].name, ent->d_name, NAME_MAX);
+			chunk[nchunk].needsstat = ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK;
+			chunk[nchunk].isdir = ent->d_type == DT_DIR;
+			chunk[nchunk].type = DTTOIF(ent->d_type);
+			chunk[nchunk].islink = ent->d_type == DT_LNK;
+			if (chunk[nchunk].needsstat) {
+				reqs[nreqs].name = chunk[nchunk].name;
+				reqs[nreqs++].index = nchunk;
+			}
+			nchunk++;
+		}
+
+		batchstatx(fd, reqs, nreqs, STATX_TYPE);
+		for (i = 0; i < nreqs; i++) {
+			chunk[reqs[i].index].isdir = !reqs[i].err && S_ISDIR(reqs[i].stx.stx_mode);
+			chunk[reqs[i].index].type = reqs[i].err ? 0 : reqs[i].stx.stx_mode & S_IFMT;
+		}
+
+		for (i = 0; i < nchunk; i++) {
+			previewpush(heap, &n, k, &chunk[i]);
+		}
+		*total += nchunk;
+	}
+
+	free(chunk);
+	free(reqs);
+	closedir(dir);
+
+	qsort(heap, n, sizeof(PreviewElem), previewcompare);
+	return n;
+}
+
+int
+previewfromindex(void *map, size_t size, struct stat *dirstat, PreviewElem *heap, int k, int *total) /* -1 if the listing isn't current */
+{
+	IndexHeader *header;
+	IndexEntry *entries;
+	char *name;
+	int n;
+
+	/* the listing is already sorted, only its first k entries are read */
+	if ((header = checkindex(map, size, dirstat)) == NULL) return -1;
+	if (header->mtime.tv_sec != dirstat->st_mtim.tv_sec || header->mtime.tv_nsec != dirstat->st_mtim.tv_nsec) return -1;
+	entries = (IndexEntry *)(header+1);
+
+	for (n = 0; n < k && n < header->n && (name = indexname(header, &entries[n])) != NULL; n++) {
+		strncpy(heap[n].name, name, NAME_MAX-1);
+		heap[n].name[NAME_MAX-1] = 0;
+		heap[n].isdir = S_ISDIR(entries[n].mode);
+		heap[n].type = entries[n].mode & S_IFMT;
+		heap[n].islink = entries[n].islink;
+	}
+	*total = header->n;
+	return n;
+}
+
+void
+previewpush(PreviewElem *heap, int *n, int k, PreviewElem *elem)
+{
+	int i;
+
+	/* a max-heap of the k smallest entries seen so far, the largest of them being on top */
+	if (*n < k) {
+		heap[(*n)++] = *elem;
+		if (*n == k) {
+			for (i = k/2-1; i >= 0; i--) previewsiftdown(heap, k, i);
+		}
+	} else if (previewcompare(elem, &heap[0]) < 0) {
+		heap[0] = *elem;
+		previewsiftdown(heap, k, 0);
+	}
+}
+
+int
+previewcompare(const void *a, const void *b)
+{
+	const PreviewElem *pa = (const PreviewElem *)a, *pb = (const PreviewElem *)b;
+
+	if (sortbydirectories && pa->isdir != pb->isdir) return pb->isdir - pa->isdir;
+	return strcoll(pa->name, pb->name);
+}
+
+void
+previewsiftdown(PreviewElem *heap, int n, int i)
+{
+	PreviewElem tmp;
+	int largest, l, r;
+
+	for (;;) {
+		largest = i;
+		l = 2*i+1;
+		r = 2*i+2;
+		if (l < n && previewcompare(&heap[l], &heap[largest]) > 0) largest = l;
+		if (r < n && previewcompare(&heap[r], &heap[largest]) > 0) largest = r;
+		if (largest == i) return;
+
+		tmp = heap[i];
+		heap[i] = heap[largest];
+		heap[largest] = tmp;
+		i = largest;
+	}
+}
+
+void
+rdrwjump(char *query, int *matches, int nmatches, int sel)
+{
+	char prompt[PATH_MAX];
+	int i;
+
+	clear();
+	snprintf(prompt, PATH_MAX, "jump: %s", query);
+	drawtext(1, 0, 0, maxx-1, 0, 0, prompt);
+
+	move(1, 0);
+	for (i = 0; i < maxx; i++) {
+		addch('-');
+	}
+
+	for (i = 0; i < nmatches && i < maxy-4; i++) {
+		drawtext(i == sel ? 7 : 3, i+2, 0, maxx-1, 0, 0, frecent[matches[i]].path);
+	}
+	if (nmatches == 0) {
+		drawtext(5, 2, 0, maxx-1, 0, 0, "NO MATCHING DIRECTORIES");
+	}
+
+	move(0, MIN(maxx-1, 6+strlen(query)));
+	refresh();
+}
+
+int
+iscurrentonscreen(void)
+{
+	return topofscreen <= current && current < topofscreen+maxy-4;
+}
+
+char*
+getreadablefs(double size, char *ret)
+{
+	int i = 0;
+	char orders[4] = "BKMG";
+
+	ret[0] = 0;
+
+	while (size > 1024 && i < 3) {
+		size /= 1024;
+		i++;
+	}
+
+	snprintf(ret, NAME_MAX, "%.2f%c", size, orders[i]);
+	return ret;
+}
+
+char*
+escapestring(char *str, size_t n) /* in place, what doesn't fit in n anymore is cut */
+{
+	static const char escapes[256] = {
+		['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+		['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\?'] = '?'
+	};
+	size_t len, out, i;
+	char c;
+
+	if (!str || n == 0) return str;
+	len = strnlen(str, n-1);
+	for (i = 0, out = len; i < len; i++) {
+		if (escapes[(unsigned char)str[i]]) out++;
+	}
+	str[MIN(out, n-1)] = 0;
+
+	/* from the end, so every character lands after where it was read from */
+	for (i = len; i-- > 0;) {
+		c = escapes[(unsigned char)str[i]];
+		if (c) {
+			out -= 2;
+			if (out+1 < n-1) str[out+1] = c;
+			if (out < n-1) str[out] = '\\';
+		} else {
+			out--;
+			if (out < n-1) str[out] = str[i];
+		}
+	}
+	return str;
+}
+
+int
+joinsprevious(wchar_t *prev, wchar_t wc) /* if wc is part of the same grapheme as what came before: combining characters, what follows a zero width joiner and the second half of a flag */
+{
+	int joins;
+
+	if (wc >= 0x1f1e6 && wc <= 0x1f1ff && *prev >= 0x1f1e6 && *prev <= 0x1f1ff) {
+		*prev = 0;
+		return 1;
+	}
+	joins = *prev == 0x200d || wcwidth(wc) == 0;
+	*prev = wc;
+	return joins;
+}
+
+int
+widestring(const char *str, wchar_t *wstr, int n) /* decodes at most n-1 characters of str (into wstr, if it isn't NULL), returns their width */
+{
+	mbstate_t state;
+	wchar_t wc;
+	size_t r;
+	int i, width = 0;
+
+	memset(&state, 0, sizeof(state));
+	for (i = 0; *str && i < n-1; i++, str += r) {
+		r = mbrtowc(&wc, str, MB_CUR_MAX, &state);
+		if (r == (size_t)-1 || r == (size_t)-2 || r == 0) {
+			/* invalid bytes are shown one at a time */
+			memset(&state, 0, sizeof(state));
+			wc = '?';
+			r = 1;
+		}
+		if (wcwidth(wc) < 0) wc = '?';
+
+		width += MAX(wcwidth(wc), 0); /* the same as curses counts */
+		if (wstr) wstr[i] = wc;
+	}
+	if (wstr) wstr[i] = 0;
+	return width;
+}
+
+int
+namewidth(const char *name) /* widestring without decoding, printable ascii is one column a byte */
+{
+	const char *p;
+
+	for (p = name; *p >= 0x20 && *p < 0x7f; p++);
+	return *p ? widestring(name, NULL, PATH_MAX) : p-name;
+}
+
+void
+drawcell(int pair, int line, int column, int size, int issel, int isdir, const wchar_t *wstr, int width) /* exactly size columns, in one write */
+{
+	wchar_t cell[PATH_MAX*2+2], prev = 0;
+	int i = 0, k, used, cw, joined, start, startused;
+
+	if (size <= 0) return;
+	size = MIN(size, PATH_MAX);
+	if (issel) cell[i++] = '>';
+	used = i;
+
+	if (used + width + !!isdir <= size) {
+		k = MIN(wcslen(wstr), PATH_MAX);
+		wmemcpy(cell+i, wstr, k);
+		i += k;
+		used += width;
+	} else {
+		/* cut at the start of the first grapheme that doesn't fit whole */
+		for (k = 0, start = i, startused = used; wstr[k] && k < PATH_MAX; k++) {
+			if (!(joined = joinsprevious(&prev, wstr[k]))) {
+				start = i;
+				startused = used;
+			}
+			cw = MAX(wcwidth(wstr[k]), 0);
+			if (used + cw + !!isdir > size) {
+				if (joined) {
+					i = start;
+					used = startused;
+				}
+				break;
+			}
+			cell[i++] = wstr[k];
+			used += cw;
+		}
+	}
+	if (isdir && used < size) {
+		cell[i++] = '/';
+		used++;
+	}
+	for (; used < size; used++) cell[i++] = ' ';
+
+	attron(COLOR_PAIR(pair));
+	mvaddnwstr(line, column, cell, i);
+	attroff(COLOR_PAIR(pair));
+}
+
+void
+drawtext(int pair, int line, int column, int size, int issel, int isdir, const char *str)
+{
+	wchar_t wstr[PATH_MAX];
+	int width;
+
+	width = widestring(str, wstr, PATH_MAX);
+	drawcell(pair, line, column, size, issel, isdir, wstr, width);
+}
+
+void
+buildkeytable(void)
+{
+	int i;
+
+	/* keyfirst[c] is the first binding of c and keynext links the others, in the order of keys[] */
+	for (i = 0; i < KEYTABLE_SIZE; i++) {
+		keyfirst[i] = -1;
+	}
+	for (i = LENGTH(keys)-1; i >= 0; i--) {
+		if (keys[i].chr < 0 || keys[i].chr >= KEYTABLE_SIZE) continue;
+		keynext[i] = keyfirst[keys[i].chr];
+		keyfirst[keys[i].chr] = i;
+	}
+}
+
+int
+keyreadsinput(int c) /* bindings marked ReadsInput in config.h can't have keys read ahead of them */
+{
+	int i;
+
+	if (c < 0 || c >= KEYTABLE_SIZE) return 0;
+	for (i = keyfirst[c]; i >= 0; i = keynext[i]) {
+		if (keys[i].readsinput) return 1;
+	}
+	return 0;
+}
+
+int
+motiondelta(int c) /* how many lines c moves the cursor by, if that's all it does */
+{
+	int i;
+
+	if (c < 0 || c >= KEYTABLE_SIZE || (i = keyfirst[c]) < 0 || keynext[i] >= 0 || pluginbound(c)) return 0;
+	if (keys[i].func != movev || (keys[i].arg.i != 1 && keys[i].arg.i != -1)) return 0;
+	return keys[i].arg.i;
+}
+
+int
+readinput(int c, int *input) /* drains whatever else is already pending after c */
+{
+	int n = 0;
+
+	input[n++] = c;
+	if (keyreadsinput(c)) return n;
+
+	nodelay(stdscr, TRUE);
+	while (n < INPUT_BATCH && (c = getch()) != ERR) {
+		if (keyreadsinput(c)) {
+			ungetch(c);
+			break;
+		}
+		input[n++] = c;
+	}
+	nodelay(stdscr, FALSE);
+
+	return n;
+}
+
+int
+dispatchinput(int *input, int n) /* returns 1 when quitting */
+{
+	int i, k, lines;
+
+	for (i = 0; i < n; i++) {
+		if (input[i] == QUIT_CHAR) return 1;
+
+		if (input[i] == KEY_RESIZE) {
+			resizedetected();
+			continue;
+		}
+		status[0] = 0;
+		runhooks(StuifmBeforeKey, input[i]);
+
+		/* a run of motions the same way, like a held j, is a single cursor move; clamping at an end only gives the
+		 * same place as moving one by one while the direction doesn't change
+		 */
+		if (motiondelta(input[i])) {
+			for (lines = 0; i < n && motiondelta(input[i]) && (lines == 0 || (lines > 0) == (motiondelta(input[i]) > 0)); i++) {
+				lines += motiondelta(input[i]);
+			}
+			i--;
+			movecursor(lines);
+			runhooks(StuifmAfterKey, input[i]);
+			continue;
+		}
+
+		if (input[i] >= 0 && input[i] < KEYTABLE_SIZE) {
+			for (k = keyfirst[input[i]]; k >= 0; k = keynext[k]) {
+				keys[k].func(&keys[k].arg);
+			}
+		}
+		for (k = 0; k < npluginkeys; k++) {
+			if (pluginkeys[k].key == input[i]) pluginkeys[k].handler(input[i], pluginkeys[k].data);
+		}
+		runhooks(StuifmAfterKey, input[i]);
+	}
+
+	return 0;
+}
+
+long long
+msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void
+loop(void)
+{
+	int c, n, dirty = 1, input[INPUT_BATCH];
+	long long now, lastdraw = 0;
+
+	for (;;) {
+		/* redraw once per batch of input, but not more often than the refresh rate */
+		now = msnow();
+		if (dirty && now-lastdraw >= 1000/MAX_REFRESH_RATE) {
+			rdrwf();
+			lastdraw = now;
+			dirty = 0;
+		}
+
+		if (dirty) timeout(MAX(1, 1000/MAX_REFRESH_RATE - (now-lastdraw)));
+		else if (prefetchwanted) timeout(PREFETCH_IDLE_MS);
+		else timeout(backgroundpending || grepjob || countpending ? BACKGROUND_POLL_MS : -1); /* only wake up periodically while something is being done in the background */
+
+		if ((c = getch()) == ERR) {
+			if (checkbackground()) dirty = 1;
+			if (!dirty && prefetchwanted) startprefetch(); /* nothing came for PREFETCH_IDLE_MS */
+			continue;
+		}
+
+		/* reading ahead stops with the directory it's on when a key comes */
+		__atomic_store_n(&prefetchstop, 1, __ATOMIC_SEQ_CST);
+		n = readinput(c, input);
+		if (dispatchinput(input, n)) break;
+		checkbackground();
+		dirty = 1;
+		prefetchwanted = PREFETCH_IDLE_MS > 0 && !isdegraded();
+	}
+}
+
+int
+unescapekeys(char *src, char *dst) /* \n, \e, \t, \\ and ^x for ctrl+x, returns the length */
+{
+	int n = 0;
+
+	for (; *src && *src != '\n'; src++) {
+		if (*src == '\\' && src[1]) {
+			src++;
+			dst[n++] = *src == 'n' ? '\n' : *src == 'e' ? 27 : *src == 't' ? '\t' : *src;
+		} else if (*src == '^' && src[1]) {
+			src++;
+			dst[n++] = *src & CtrlMask;
+		} else {
+			dst[n++] = *src;
+		}
+	}
+	return n;
+}
+
+int
+replayhome(char *home) /* a fresh home for a replay, so the user's index, frecency, caches and daemon don't change what's measured; returns 0 if it's made */
+{
+	char *tmp;
+
+	if ((tmp = getenv("TMPDIR")) == NULL || tmp[0] != '/') tmp = "/tmp";
+	snprintf(home, PATH_MAX, "%s/stuifm-replay-XXXXXX", tmp);
+	if (mkdtemp(home) == NULL) return -1;
+
+	setenv("HOME", home, 1);
+	unsetenv("XDG_CACHE_HOME");
+	unsetenv("XDG_CONFIG_HOME");
+	unsetenv("XDG_DATA_HOME");
+	unsetenv("XDG_RUNTIME_DIR");
+	snprintf(indexdir, PATH_MAX, "%s/index", home);
+	snprintf(frecencypath, PATH_MAX, "%s/frecency", home);
+	return 0;
+}
+
+int
+removeentry(const char *path, const struct stat *st, int type, struct FTW *ftw) /* for nftw, everything under replay's home */
+{
+	remove(path);
+	return 0;
+}
+
+int
+replay(char *script, char *dir) /* feeds the keys of a script through the same input path as loop(), returns 1 if an expect failed */
+{
+	FILE *fp, *in, *out;
+	SCREEN *screen;
+	char line[COMMAND_MAX], keys[COMMAND_MAX], home[PATH_MAX], *frame, *term;
+	wchar_t *wframe;
+	int fds[2], input[INPUT_BATCH], c, n, y, len, lineno = 0, step = 0, quit = 0, failed = 0;
+	long long start, elapsed, total = 0, worst = 0;
+	struct timespec ts;
+
+	if ((fp = fopen(script, "r")) == NULL) {
+		perror("couldn't open the script");
+		return 1;
+	}
+	if (dir && chdir(dir) != 0) {
+		perror("couldn't change to the directory");
+		fclose(fp);
+		return 1;
+	}
+	if (replayhome(home) != 0) {
+		perror("couldn't make a home for the replay");
+		fclose(fp);
+		return 1;
+	}
+
+	/* the keys go through a pipe, so commands that read more input (prompts, jump) get it like from a terminal */
+	setenv("LINES", REPLAY_LINES, 1);
+	setenv("COLUMNS", REPLAY_COLUMNS, 1);
+	if ((term = getenv("TERM")) == NULL || strcmp(term, "dumb") == 0) term = "xterm";
+	if (pipe(fds) != 0 || (in = fdopen(fds[0], "r")) == NULL || (out = fopen("/dev/null", "w")) == NULL || \
+			(screen = newterm(term, out, in)) == NULL) {
+		fprintf(stderr, "couldn't make a screen for %s\n", term);
+		rmdir(home);
+		fclose(fp);
+		return 1;
+	}
+	replaying = 1;
+
+	/* plugins aren't loaded, they'd be measured too */
+	initialization();
+	buildkeytable();
+	loadfrecency();
+	getcurrentfiles();
+	rdrwf();
+	refresh();
+
+	/* rows are read back as wide characters, so wide names take the columns they do on a terminal */
+	wframe = (wchar_t *)malloc((maxx+1) * sizeof(wchar_t));
+	if ((frame = (char *)malloc(maxx*MB_CUR_MAX+1)) == NULL || wframe == NULL) {
+		perror("couldn't allocate memory for the frame");
+		exit(1);
+	}
+
+	while (!quit && fgets(line, COMMAND_MAX, fp) != NULL) {
+		lineno++;
+		if (strncmp(line, "key ", 4) == 0) {
+			len = unescapekeys(line+4, keys);
+			step++;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			start = (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+
+			if (write(fds[1], keys, len) != len) break;
+			for (;;) {
+				nodelay(stdscr, TRUE);
+				if ((c = getch()) == ERR) break;
+				n = readinput(c, input);
+				if (dispatchinput(input, n)) {
+					quit = 1;
+					break;
+				}
+				checkbackground();
+			}
+			rdrwf();
+			refresh();
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			elapsed = (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000 - start;
+			total += elapsed;
+			worst = MAX(worst, elapsed);
+			line[strcspn(line, "\n")] = 0;
+			printf("step %d %lld %s\n", step, elapsed, line+4);
+
+			/* what's done in the background isn't timed, but the frame is checked after it */
+			for (start = msnow(); (backgroundpending || grepjob || countpending) && msnow()-start < REPLAY_SETTLE_MS;) {
+				usleep(1000);
+				if (checkbackground()) {
+					rdrwf();
+					refresh();
+				}
+			}
+		} else if (strncmp(line, "expect ", 7) == 0 || strcmp(line, "frame\n") == 0) {
+			line[strcspn(line, "\n")] = 0;
+			for (y = 0, c = 0; y < maxy && !c; y++) {
+				mvinnwstr(y, 0, wframe, maxx);
+				wcstombs(frame, wframe, maxx*MB_CUR_MAX+1);
+				if (line[0] == 'e' && strstr(frame, line+7)) c = 1;
+			}
+			if (line[0] == 'e' && c) continue;
+
+			/* print the frame when asked, or to show why an expect failed */
+			if (line[0] == 'e') {
+				printf("FAIL %s:%d: expected \"%s\"\n", script, lineno, line+7);
+				failed = 1;
+			}
+			for (y = 0; y < maxy; y++) {
+				mvinnwstr(y, 0, wframe, maxx);
+				wcstombs(frame, wframe, maxx*MB_CUR_MAX+1);
+				printf("| %s\n", frame);
+			}
+		}
+	}
+
+	printf("total %lld\nworst %lld\n", total, worst);
+	free(frame);
+	free(wframe);
+	fclose(fp);
+	stopcoprocess();
+	endwin();
+	delscreen(screen);
+	nftw(home, removeentry, 16, FTW_DEPTH|FTW_PHYS);
+	return failed;
+}
+
+void
+cleanup(void)
+{
+	freelistcontents(&fileslist);
+	freelistcontents(&selected);
+	savefrecency();
+	stopcoprocess();
+	clear();
+	endwin();
+	FILE *fp = NULL;
+	if ((fp = fopen(VCD_PATH, "w+")) == NULL)
+		return;
+
+	if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		printf("%s\n", cwd);
+		fprintf(fp, "%s\n", cwd);
+	}
+	
+	fclose(fp);
+}
+
+
+void
+startvirtuallisting(int kind, char *label)
+{
+	parklisting();
+	closelarge();
+	current = topofscreen = 1;
+	revalidationgeneration++;
+	listingkind = kind;
+	strncpy(listinglabel, label, PATH_MAX-1);
+	archivepath[0] = 0;
+}
+
+char *
+elempath(FileElem *elem, char *buf)
+{
+	if (strcmp(elem->path, "/") == 0) snprintf(buf, PATH_MAX, "/%s", elem->name);
+	else snprintf(buf, PATH_MAX, "%s/%s", elem->path, elem->name);
+	return buf;
+}
+
+char *
+displayname(FileElem *elem, char *buf) /* virtual listings show where entries are, relative to cwd when they're under it */
+{
+	char path[PATH_MAX], *p;
+	size_t len = strlen(cwd);
+
+	if (!listinglabel[0] || archivepath[0]) {
+		strncpy(buf, elem->name, PATH_MAX);
+		return buf;
+	}
+
+	elempath(elem, path);
+	p = path;
+	if (strncmp(path, cwd, len) == 0 && path[len] == '/') p = path+len+1;
+	else if (strcmp(cwd, "/") == 0) p = path+1;
+
+	if (elem->group) snprintf(buf, PATH_MAX, "[%d] %s", elem->group, p);
+	else if (elem->matches) snprintf(buf, PATH_MAX, "%s:%d", p, elem->matches);
+	else if (elem->mark) snprintf(buf, PATH_MAX, "%c %s", elem->mark == MarkNew ? '+' : elem->mark == MarkMissing ? '-' : '~', p);
+	else strncpy(buf, p, PATH_MAX);
+	return buf;
+}
+
+void
+drawstatus(char *msg) /* for long operations, shows msg right away */
+{
+	strncpy(status, msg, NAME_MAX-1);
+	move(maxy-1, 0);
+	clrtoeol();
+	drawtext(1, maxy-1, 0, maxx-1, 0, 0, status);
+	refresh();
+}
+
+int
+prompt(char *question, char *buf, size_t size) /* reads a line on the status line, -1 if it was cancelled with escape */
+{
+	size_t len = strlen(buf);
+	char line[PATH_MAX];
+	int c;
+
+	timeout(-1);
+	for (;;) {
+		snprintf(line, PATH_MAX, "%s%s", question, buf);
+		move(maxy-1, 0);
+		clrtoeol();
+		drawtext(1, maxy-1, 0, maxx-1, 0, 0, line);
+		move(maxy-1, MIN(maxx-1, widestring(line, NULL, PATH_MAX))); /* in columns, not bytes */
+		refresh();
+
+		c = getch();
+		if (c == 27) {
+			return -1;
+		} else if (c == '\n' || c == KEY_ENTER) {
+			return 0;
+		} else if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+			/* a whole character, not just its last byte */
+			while (len > 0 && (buf[--len] & 0xc0) == 0x80);
+			buf[len] = 0;
+		} else if (c == KEY_RESIZE) {
+			resizedetected();
+		} else if (c >= ' ' && c < 256 && len+1 < size) {
+			buf[len++] = c;
+			buf[len] = 0;
+		}
+	}
+}
+
+void
+queuepush(WorkQueue *q, char *item)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->n >= q->size) {
+		q->size += N;
+		if ((q->items = (char **)realloc(q->items, q->size * sizeof(char *))) == NULL) {
+			perror("couldn't allocate memory for the work queue");
+			exit(1);
+		}
+	}
+	q->items[q->n++] = strdup(item);
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void *
+queueworker(void *arg)
+{
+	WorkQueue *q = (WorkQueue *)arg;
+	char *item;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->n == 0 && q->active > 0) {
+			pthread_cond_wait(&q->cond, &q->lock);
+		}
+		if (q->n == 0) break;
+
+		item = q->items[--q->n];
+		q->active++;
+		pthread_mutex_unlock(&q->lock);
+
+		q->process(q, item);
+		free(item);
+
+		pthread_mutex_lock(&q->lock);
+		q->active--;
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+void
+runqueue(WorkQueue *q, char **first, int n) /* starts with the n items of first, returns when every item is processed */
+{
+	int i;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->items = NULL;
+	q->n = q->size = q->active = 0;
+	for (i = 0; i < n; i++) {
+		queuepush(q, first[i]);
+	}
+
+	runworkers(WORKER_THREADS, queueworker, q);
+
+	free(q->items);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+}
+
+void
+movecursor(int delta)
+{
+	if (!fileslist.contents) return;
+	if (fileslist.total) {
+		seekwindow(fileslist.offset+current+delta);
+		return;
+	}
+
+	current += delta;
+	if (current > fileslist.end) current = fileslist.end;
+	if (current < 1) current = 1;
+}
+
+void
+movev(const Arg *arg)
+{
+	if (!arg) return;
+	if (!fileslist.contents) return;
+
+	int i = arg->i;
+
+	if (i == 1 || i == -1) {
+		movecursor(i);
+	} else if (i == 2) {
+		movecursor(maxy/2);
+	} else  if (i == -2) {
+		movecursor(-maxy/2);
+	}
+}
+
+void
+moveh(const Arg *arg)
+{
+	struct stat pathstat;
+	char oldpattern[PATH_MAX], path[PATH_MAX], *p;
+	Arg searcharg = {.i = 0};
+	int tosearch = 0;
+
+	memset(oldpattern, 0, sizeof(oldpattern));
+
+	if (!arg) return;
+
+	/* inside an archive h and l move between its directories, h at its root leaves it */
+	if (archivepath[0] && (arg->i == +1 || archivedir[0])) {
+		if (arg->i == -1) {
+			p = strrchr(archivedir, '/');
+			strncpy(path, p ? p+1 : archivedir, NAME_MAX);
+			if (p) *p = 0;
+			else archivedir[0] = 0;
+			listarchive(path);
+		} else if (fileslist.contents && S_ISDIR(fileslist.contents[current].mode)) {
+			snprintf(path, PATH_MAX, "%s%s%s", archivedir, archivedir[0] ? "/" : "", fileslist.contents[current].name);
+			strncpy(archivedir, path, PATH_MAX);
+			listarchive(NULL);
+		}
+		return;
+	}
+
+	/* h leaves a virtual listing for the directory it was made in */
+	if (listinglabel[0] && arg->i == -1) {
+		getcurrentfiles();
+		strncpy(status, "back to the directory", NAME_MAX);
+		return;
+	}
+	if (strcmp(cwd, "/") == 0 && arg->i == -1) return;
+	
+	if (arg->i == -1) {
+		/* for a single level undo */
+		p = strrchr(cwd, '/');
+
+		if (p && p[1] != 0) {
+			tosearch = 1;
+			strncpy(oldpattern, pattern, PATH_MAX);
+			strncpy(pattern, p+1, PATH_MAX);
+		}
+
+		chdir("..");
+	} else {
+		if (!fileslist.contents) return;
+		elempath(&fileslist.contents[current], path);
+		if (stat(path, &pathstat) != 0) return;
+		if (S_ISDIR(pathstat.st_mode)) {
+			chdir(path);
+		} else {
+			if (S_ISREG(pathstat.st_mode) && archivetype(path) >= 0) openarchive(path);
+			return;
+		}
+	}
+
+	getcurrentfiles();
+	visitdirectory(cwd);
+	if (tosearch) {
+		search(&searcharg);
+		strncpy(pattern, oldpattern, PATH_MAX);
+	}
+	strncpy(status, "changed directory", NAME_MAX);
+}
+
+void
+first(const Arg *arg)
+{
+	if (fileslist.total) seekwindow(1);
+	current = 1;
+}
+
+void
+last(const Arg *arg)
+{
+	if (fileslist.contents == NULL) return;
+	if (fileslist.total) seekwindow(fileslist.total);
+	current = fileslist.end;
+}
+
+void
+topofscreenscroll(const Arg *arg)
+{
+	if (!arg || arg->i == 0) return;
+
+	int i = arg->i;
+
+	if (i == 1) {
+		if (topofscreen + 1 <= fileslist.end && topofscreen+1 <= current) topofscreen++;
+	} else if (i == -1) {
+		if (current <= topofscreen+maxy-3) topofscreen--;
+	}
+}
+
+void
+drawratiosscroll(const Arg *arg)
+{
+	if (!arg || arg->i == 0) {
+		strncpy(status, "define the arguments for drawrationscroll", NAME_MAX);
+		return;
+	}
+
+	cratio = ((cratio+arg->i) % LENGTH(drawratios));
+
+	if (cratio < 0) {
+		cratio = (LENGTH(drawratios)+cratio);
+	}
+
+	strncpy(status, "changed the draw ratio", NAME_MAX);
+}
+
+void
+toggleselect(const Arg *arg)
+{
+	if (!fileslist.contents) {
+		strncpy(status, "no current file/no files in directory", NAME_MAX);
+		return;
+	}
+
+	if (isselected(fileslist.contents[current].path, fileslist.contents[current].name)) {
+		rmvselection(fileslist.contents[current].path, fileslist.contents[current].name);
+	} else {
+		addelem(&selected, fileslist.contents[current].path, fileslist.contents[current].name);
+	}
+	strncpy(status, "changed selected", NAME_MAX);
+}
+
+void
+clearselection(const Arg *arg)
+{
+	freelistcontents(&selected);
+	strncpy(status, "cleared selected", NAME_MAX);
+}
+
+void
+selectall(const Arg *arg)
+{
+	int i = 1;
+	for (i = 1; i <= fileslist.end; i++) {
+		if (!isselected(fileslist.contents[i].path, fileslist.contents[i].name)) {
+			addelem(&selected, fileslist.contents[i].path, fileslist.contents[i].name);
+		}
+	}
+}
+
+void
+directoriesfirst(const Arg *arg)
+{
+	sortbydirectories = !sortbydirectories;
+	if (sortbydirectories == 1) {
+		strncpy(status, "sorting with directories being first", NAME_MAX);
+	} else {
+		strncpy(status, "sorting with normaly", NAME_MAX);
+	}
+	getcurrentfiles();
+}
+
+void
+hiddenfilesswitch(const Arg *arg)
+{
+	hiddenfiles = !hiddenfiles;
+	if (hiddenfiles == 1) {
+		strncpy(status, "showing hidden files", NAME_MAX);
+	} else {
+		strncpy(status, "hiding hidden files", NAME_MAX);
+	}
+	getcurrentfiles();
+}
+
+void
+search(const Arg *arg)
+{
+	if (!fileslist.contents) {
+		strncpy(status, "no files in current directory", NAME_MAX);
+		return;
+	}
+
+	regex_t regex;
+	int reti, oktofree = 0, i = current;
+
+	/* a large listing is searched on disk, then the window goes to what was found */
+	if (fileslist.total) {
+		largesearch(arg->i);
+		return;
+	}
+
+	/* everything in the listing of a content search matched, n and N go from one file to the next */
+	if (listinglabel[0] && fileslist.contents[1].matches) {
+		if (arg->i == 0) return;
+		current += arg->i;
+		if (current > fileslist.end) current = 1;
+		if (current < 1) current = fileslist.end;
+		snprintf(status, NAME_MAX, "%d of %d, %d lines match", current, fileslist.end, fileslist.contents[current].matches);
+		return;
+	}
+
+    switch (arg->i) {
+    case 0: /* FALLTHROUGH */
+    case 1: if (!oktofree && pattern[0] != 0) {
+                reti = regcomp(&regex, pattern, 0);
+                 if (reti) return;
+                 oktofree = 1;
+            } else if (!oktofree) {
+               strncpy(status, "please input a pattern", NAME_MAX);
+               return;
+            }
+            
+            if (arg->i == 1) i++;  /* so it doesn't detect the same element if we want the next one
+             		                * but in case we search with a new pattern, we want it to match the current
+             		                * position if it matches
+             		                */
+            
+            for (; i <= fileslist.end; i++) {
+               reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
+               if (!reti) break;
+            }
+            
+            if (i > fileslist.end) {
+                i = 1;
+                strncpy(status, "search reached BOTTOM, starting from the topofscreen", NAME_MAX);
+                
+				for (; i <= fileslist.end; i++) {
+                   reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
+                   if (!reti) break;
+                }
+            }
+            break;
+    
+    case -1: if (pattern[0] != 0) {
+    	         reti = regcomp(&regex, pattern, 0);
+    	         if (reti) return;
+    	         oktofree = 1;
+             } else {
+    	         strncpy(status, "please input a pattern", NAME_MAX);
+    	         return;
+             }
+    
+             i--;
+
+             for (; i >= 1; i--) {
+                reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
+                if (!reti) break;
+             }
+             
+             if (i == 0) {
+			 	 i = fileslist.end;
+                 strncpy(status, "search reached topofscreen, starting from the BOTTOM", NAME_MAX);
+                 
+             	 for (; i >= 1; i--) {
+             	    reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
+             	    if (!reti) break;
+             	 }
+             }
+             break;
+    }
+
+	if (oktofree) {
+		regfree(&regex);
+	}
+
+	if (i <= 0 || i > fileslist.end) {
+		strncpy(status, "no item with that pattern was found", NAME_MAX);
+		i = current;
+	}
+
+	current = i;
+
+	/* put the result in the middle */
+	if (!iscurrentonscreen()) {
+		topofscreen = current-maxy/2;
+		if (topofscreen < 1) topofscreen = 1;
+		if (topofscreen > fileslist.end) topofscreen = fileslist.end;
+	}
+}
+
+void
+jump(const Arg *arg)
+{
+	char query[NAME_MAX] = "";
+	int *matches, nmatches = 0, sel = 0, len = 0, i, c;
+
+	if (nfrecent == 0) {
+		strncpy(status, "no visited directories to jump to", NAME_MAX);
+		return;
+	}
+	if ((matches = (int *)malloc(nfrecent * sizeof(int))) == NULL) return;
+
+	timeout(-1);
+	keypad(stdscr, TRUE);
+	set_escdelay(25);
+	for (;;) {
+		/* rank the candidates again on every keypress */
+		frecencynow = time(NULL);
+		for (nmatches = 0, i = 0; i < nfrecent; i++) {
+			if (strcmp(frecent[i].path, cwd) != 0 && frecencymatches(frecent[i].path, query)) matches[nmatches++] = i;
+		}
+		qsort(matches, nmatches, sizeof(int), frecencycompare);
+		if (sel >= nmatches) sel = MAX(nmatches-1, 0);
+
+		rdrwjump(query, matches, nmatches, sel);
+
+		c = getch();
+		if (c == 27) {
+			strncpy(status, "jump cancelled", NAME_MAX);
+			break;
+		} else if (c == '\n' || c == KEY_ENTER) {
+			if (nmatches == 0) continue;
+			if (chdir(frecent[matches[sel]].path) != 0) {
+				snprintf(status, NAME_MAX, "couldn't jump to %s", frecent[matches[sel]].path);
+				/* it's gone, so forget about it */
+				free(frecent[matches[sel]].path);
+				frecent[matches[sel]] = frecent[--nfrecent];
+				break;
+			}
+			getcurrentfiles();
+			visitdirectory(cwd);
+			strncpy(status, "jumped to directory", NAME_MAX);
+			break;
+		} else if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+			if (len > 0) query[--len] = 0;
+			sel = 0;
+		} else if (c == KEY_DOWN || c == ('n' & CtrlMask)) {
+			if (sel+1 < MIN(nmatches, maxy-4)) sel++;
+		} else if (c == KEY_UP || c == ('p' & CtrlMask)) {
+			if (sel > 0) sel--;
+		} else if (c == KEY_RESIZE) {
+			resizedetected();
+		} else if (c >= ' ' && c < 127 && len < NAME_MAX-1) {
+			query[len++] = c;
+			query[len] = 0;
+			sel = 0;
+		}
+	}
+
+	keypad(stdscr, FALSE);
+	free(matches);
+}
+
+void
+findduplicates(const Arg *arg)
+{
+	DupCandidate *cands = NULL, **work;
+	DupJob job;
+	char path[PATH_MAX], label[PATH_MAX];
+	int i, j, k, n = 0, size = 0, nwork, groups = 0;
+	off_t wasted = 0;
+	char readable[NAME_MAX];
+
+	drawstatus("looking for duplicates: listing files");
+	if (selected.contents) {
+		for (i = 1; i <= selected.end; i++) {
+			dupwalk(elempath(&selected.contents[i], path), &cands, &n, &size);
+		}
+	} else {
+		dupwalk(cwd, &cands, &n, &size);
+	}
+	if ((work = (DupCandidate **)malloc(MAX(n, 1) * sizeof(DupCandidate *))) == NULL) {
+		perror("couldn't allocate memory for the duplicates");
+		exit(1);
+	}
+
+	/* hard links are the same file, not duplicates of it */
+	qsort(cands, n, sizeof(DupCandidate), dupinodecompare);
+	for (j = 0, i = 0; i < n; i++) {
+		if (j > 0 && cands[i].st.st_dev == cands[j-1].st.st_dev && cands[i].st.st_ino == cands[j-1].st.st_ino) free(cands[i].path);
+		else cands[j++] = cands[i];
+	}
+	n = j;
+
+	/* files of a size nobody else has can't have duplicates */
+	qsort(cands, n, sizeof(DupCandidate), dupcompare);
+	for (nwork = 0, i = 0; i < n; i = j) {
+		for (j = i+1; j < n && cands[j].st.st_size == cands[i].st.st_size; j++);
+		for (k = i; j-i > 1 && k < j; k++) work[nwork++] = &cands[k];
+	}
+
+	drawstatus("looking for duplicates: hashing the first and last blocks");
+	job = (DupJob){.cands = work, .n = nwork, .next = 0, .full = 0};
+	runworkers(WORKER_THREADS, duphashworker, &job);
+	qsort(cands, n, sizeof(DupCandidate), dupcompare);
+
+	/* then the ones whose size and ends agree are hashed completely */
+	for (nwork = 0, i = 0; i < n; i = j) {
+		for (j = i+1; j < n && !cands[j].err && !cands[i].err && cands[j].st.st_size == cands[i].st.st_size && cands[j].partial == cands[i].partial; j++);
+		for (k = i; j-i > 1 && k < j; k++) {
+			if (cands[k].st.st_size > 2*DUPLICATE_BLOCK) work[nwork++] = &cands[k];
+			else cands[k].full = cands[k].partial; /* the ends were the whole file */
+		}
+	}
+
+	drawstatus("looking for duplicates: hashing whole files");
+	job = (DupJob){.cands = work, .n = nwork, .next = 0, .full = 1};
+	runworkers(WORKER_THREADS, duphashworker, &job);
+	qsort(cands, n, sizeof(DupCandidate), dupcompare);
+
+	/* what's listed can be deleted for good, so a hash that agrees isn't enough: the files are compared with the first of their set */
+	for (nwork = 0, i = 0; i < n; i = j) {
+		for (j = i+1; j < n && !cands[j].err && !cands[i].err && cands[j].st.st_size == cands[i].st.st_size && \
+				cands[j].partial == cands[i].partial && cands[j].full == cands[i].full && cands[i].full; j++);
+		for (k = i+1; j-i > 1 && k < j; k++) {
+			cands[k].first = &cands[i];
+			work[nwork++] = &cands[k];
+		}
+	}
+
+	drawstatus("looking for duplicates: comparing the files");
+	job = (DupJob){.cands = work, .n = nwork, .next = 0, .compare = 1};
+	runworkers(WORKER_THREADS, duphashworker, &job);
+
+	snprintf(label, PATH_MAX, "duplicates in %s", selected.contents ? "the selection" : cwd);
+	startvirtuallisting(ListingDuplicates, label);
+	for (i = 0; i < n; i = j) {
+		for (j = i+1, nwork = 1; j < n && cands[j].first == &cands[i]; j++) {
+			if (!cands[j].differs) nwork++;
+		}
+		if (nwork < 2) continue;
+
+		groups++;
+		wasted += (nwork-1) * cands[i].st.st_size;
+		for (k = i; k < j; k++) {
+			if (cands[k].differs) continue;
+			strncpy(path, cands[k].path, PATH_MAX);
+			*strrchr(path, '/') = 0;
+			addelem(&fileslist, path[0] ? path : "/", strrchr(cands[k].path, '/')+1);
+			fileslist.contents[fileslist.end].group = groups;
+			fileslist.contents[fileslist.end].mode = cands[k].st.st_mode;
+			fileslist.contents[fileslist.end].nlink = cands[k].st.st_nlink;
+			fileslist.contents[fileslist.end].uid = cands[k].st.st_uid;
+			fileslist.contents[fileslist.end].gid = cands[k].st.st_gid;
+			fileslist.contents[fileslist.end].size = cands[k].st.st_size;
+			fileslist.contents[fileslist.end].mtime = cands[k].st.st_mtime;
+			fileslist.contents[fileslist.end].ctime = cands[k].st.st_ctime;
+			fileslist.contents[fileslist.end].statmask = INFO_STATX_MASK|STATX_MTIME;
+		}
+	}
+
+	snprintf(status, NAME_MAX, "%d sets of duplicates, %s could be freed", groups, getreadablefs((double)wasted, readable));
+	for (i = 0; i < n; i++) {
+		free(cands[i].path);
+	}
+	free(cands);
+	free(work);
+}
+
+void
+dupwalk(char *path, DupCandidate **cands, int *n, int *size)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	char child[PATH_MAX];
+	int fd;
+
+	if (lstat(path, &st) != 0) return;
+
+	/* only regular files with something in them, symlinks would only find what they point to */
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) return;
+		if (*n >= *size) {
+			*size += N;
+			if ((*cands = (DupCandidate *)realloc(*cands, *size * sizeof(DupCandidate))) == NULL) {
+				perror("couldn't allocate memory for the duplicates");
+				exit(1);
+			}
+		}
+		(*cands)[*n].path = strdup(path);
+		(*cands)[*n].st = st;
+		(*cands)[*n].partial = (*cands)[*n].full = 0;
+		(*cands)[*n].err = (*cands)[*n].differs = 0;
+		(*cands)[*n].first = NULL;
+		(*n)++;
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) return;
+
+	if ((fd = open(path, O_RDONLY|O_DIRECTORY)) < 0) return;
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+		if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_DIR && ent->d_type != DT_REG) continue;
+		if (strcmp(path, "/") == 0) snprintf(child, PATH_MAX, "/%s", ent->d_name);
+		else snprintf(child, PATH_MAX, "%s/%s", path, ent->d_name);
+		dupwalk(child, cands, n, size);
+	}
+	closedir(dir);
+}
+
+void *
+duphashworker(void *arg)
+{
+	DupJob *job = (DupJob *)arg;
+	DupCandidate *c;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+		c = job->cands[i];
+		if (job->compare) c->differs = samecontent(c->first->path, c->path) != 1;
+		else if (hashfile(c->path, c->st.st_size, !job->full, job->full ? &c->full : &c->partial) != 0) c->err = 1;
+	}
+	return NULL;
+}
+
+int
+dupcompare(const void *a, const void *b)
+{
+	const DupCandidate *ca = (const DupCandidate *)a, *cb = (const DupCandidate *)b;
+
+	/* the biggest files first, so the sets that waste the most come first */
+	if (ca->err != cb->err) return ca->err - cb->err;
+	if (ca->st.st_size != cb->st.st_size) return ca->st.st_size < cb->st.st_size ? 1 : -1;
+	if (ca->partial != cb->partial) return ca->partial < cb->partial ? -1 : 1;
+	if (ca->full != cb->full) return ca->full < cb->full ? -1 : 1;
+	return strcmp(ca->path, cb->path);
+}
+
+int
+dupinodecompare(const void *a, const void *b)
+{
+	const DupCandidate *ca = (const DupCandidate *)a, *cb = (const DupCandidate *)b;
+
+	if (ca->st.st_dev != cb->st.st_dev) return ca->st.st_dev < cb->st.st_dev ? -1 : 1;
+	if (ca->st.st_ino != cb->st.st_ino) return ca->st.st_ino < cb->st.st_ino ? -1 : 1;
+	return strcmp(ca->path, cb->path);
+}
+
+int
+hashfile(char *path, off_t size, int partial, unsigned long long *out) /* partial only hashes the first and last blocks */
+{
+	HashState h;
+	unsigned char *buf;
+	ssize_t n;
+	int fd;
+
+	/* read, not mmap'd: a file truncated while it's hashed would raise SIGBUS */
+	if ((fd = open(path, O_RDONLY|O_NOCTTY)) < 0) return -1;
+	hashinit(&h);
+	if (!partial) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if ((buf = (unsigned char *)malloc(partial ? 2*DUPLICATE_BLOCK : HASH_BUFSIZE)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if (partial) {
+		n = pread(fd, buf, MIN(size, DUPLICATE_BLOCK), 0);
+		if (n > 0) hashupdate(&h, buf, n);
+		if (size > DUPLICATE_BLOCK && (n = pread(fd, buf, DUPLICATE_BLOCK, MAX(size-DUPLICATE_BLOCK, DUPLICATE_BLOCK))) > 0) hashupdate(&h, buf, n);
+	} else {
+		while ((n = read(fd, buf, HASH_BUFSIZE)) > 0) {
+			hashupdate(&h, buf, n);
+		}
+	}
+	free(buf);
+	close(fd);
+
+	if (n < 0) return -1;
+	*out = hashfinal(&h);
+	return 0;
+}
+
+int
+samecontent(char *a, char *b) /* 1 if the files have the same bytes, 0 if they don't, -1 if one couldn't be read */
+{
+	unsigned char *bufa, *bufb;
+	ssize_t na, nb;
+	int fda, fdb, same = -1;
+
+	if ((fda = open(a, O_RDONLY|O_NOCTTY)) < 0) return -1;
+	if ((fdb = open(b, O_RDONLY|O_NOCTTY)) < 0) {
+		close(fda);
+		return -1;
+	}
+	posix_fadvise(fda, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fdb, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	bufa = (unsigned char *)malloc(HASH_BUFSIZE);
+	bufb = (unsigned char *)malloc(HASH_BUFSIZE);
+	while (bufa && bufb) {
+		/* regular files only read short at their end, where the other one has to end too */
+		na = read(fda, bufa, HASH_BUFSIZE);
+		nb = read(fdb, bufb, HASH_BUFSIZE);
+		if (na < 0 || nb < 0) break;
+		if (na != nb || memcmp(bufa, bufb, na) != 0) {
+			same = 0;
+			break;
+		}
+		if (na == 0) {
+			same = 1;
+			break;
+		}
+	}
+	free(bufa);
+	free(bufb);
+	close(fda);
+	close(fdb);
+	return same;
+}
+
+#define HASHPRIME1 11400714785074694791ULL
+#define HASHPRIME2 14029467366897019727ULL
+#define HASHPRIME3 1609587929392839161ULL
+#define HASHPRIME4 9650029242287828579ULL
+#define HASHPRIME5 2870177450012600261ULL
+#define ROTL64(X, R) (((X) << (R)) | ((X) >> (64-(R))))
+
+static inline unsigned long long
+hashround(unsigned long long acc, unsigned long long input)
+{
+	acc += input * HASHPRIME2;
+	acc = ROTL64(acc, 31);
+	return acc * HASHPRIME1;
+}
+
+static inline unsigned long long
+hashread64(const unsigned char *p)
+{
+	unsigned long long v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+void
+hashinit(HashState *h)
+{
+	memset(h, 0, sizeof(HashState));
+	h->v[0] = HASHPRIME1 + HASHPRIME2;
+	h->v[1] = HASHPRIME2;
+	h->v[2] = 0;
+	h->v[3] = -HASHPRIME1;
+}
+
+void
+hashupdate(HashState *h, const unsigned char *data, size_t n)
+{
+	unsigned long long v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+	size_t i = 0;
+
+	h->total += n;
+	if (h->buflen) {
+		for (; i < n && h->buflen < 32; i++) h->buf[h->buflen++] = data[i];
+		if (h->buflen < 32) return;
+		v0 = hashround(v0, hashread64(h->buf));
+		v1 = hashround(v1, hashread64(h->buf+8));
+		v2 = hashround(v2, hashread64(h->buf+16));
+		v3 = hashround(v3, hashread64(h->buf+24));
+		h->buflen = 0;
+	}
+
+	/* the four lanes don't depend on each other, so they go through the multipliers side by side */
+	for (; i+32 <= n; i += 32) {
+		v0 = hashround(v0, hashread64(data+i));
+		v1 = hashround(v1, hashread64(data+i+8));
+		v2 = hashround(v2, hashread64(data+i+16));
+		v3 = hashround(v3, hashread64(data+i+24));
+	}
+	for (; i < n; i++) h->buf[h->buflen++] = data[i];
+
+	h->v[0] = v0;
+	h->v[1] = v1;
+	h->v[2] = v2;
+	h->v[3] = v3;
+}
+
+unsigned long long
+hashfinal(HashState *h)
+{
+	unsigned long long acc;
+	unsigned int k;
+	int i = 0, l;
+
+	if (h->total >= 32) {
+		acc = ROTL64(h->v[0], 1) + ROTL64(h->v[1], 7) + ROTL64(h->v[2], 12) + ROTL64(h->v[3], 18);
+		for (l = 0; l < 4; l++) {
+			acc ^= hashround(0, h->v[l]);
+			acc = acc * HASHPRIME1 + HASHPRIME4;
+		}
+	} else {
+		acc = HASHPRIME5;
+	}
+	acc += h->total;
+
+	for (; i+8 <= h->buflen; i += 8) {
+		acc ^= hashround(0, hashread64(h->buf+i));
+		acc = ROTL64(acc, 27) * HASHPRIME1 + HASHPRIME4;
+	}
+	for (; i+4 <= h->buflen; i += 4) {
+		memcpy(&k, h->buf+i, sizeof(k));
+		acc ^= (unsigned long long)k * HASHPRIME1;
+		acc = ROTL64(acc, 23) * HASHPRIME2 + HASHPRIME3;
+	}
+	for (; i < h->buflen; i++) {
+		acc ^= h->buf[i] * HASHPRIME5;
+		acc = ROTL64(acc, 11) * HASHPRIME1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= HASHPRIME2;
+	acc ^= acc >> 29;
+	acc *= HASHPRIME3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+void
+contentsearch(const Arg *arg) /* lists the files that contain a pattern, as they're found */
+{
+	GrepJob *job;
+	pthread_t thread;
+	char answer[PATH_MAX] = "", label[PATH_MAX];
+	int i;
 
-		if ((pwd = getpwuid(pathstat.st_uid)) != NULL) strncpy(user, pwd->pw_name, NAME_MAX);
-		else snprintf(user, NAME_MAX, "%d", pathstat.st_uid);
-	
-		if ((gr = getgrgid(pathstat.st_gid)) != NULL) strncpy(group, gr->gr_name, NAME_MAX);
-		else snprintf(group, NAME_MAX, "%d", pathstat.st_gid);
-	
-		getreadablefs((double)pathstat.st_size, readablefilesize);
-	    strftime(date, NAME_MAX, "%Y-%B-%d %H:%M", gmtime(&(pathstat.st_ctim).tv_sec));
-	
-		snprintf(fileinfo, maxx-1, "%s %d %s %s %s %s", perms, (int)pathstat.st_nlink, user, group, readablefilesize, date);
-		PRINTW(1, 0, 0, maxx, 0, 0, fileinfo);
+	if (archivepath[0]) {
+		strncpy(status, "can't search the contents of an archive", NAME_MAX);
+		return;
+	}
+	if (grepjob) {
+		grepjob->stop = 1;
+		strncpy(status, "the last content search is still stopping", NAME_MAX);
+		return;
 	}
-	if (maxx-strlen(cwd) > 0) {PRINTW(1, 0, maxx-strlen(cwd), strlen(cwd), 0, 0, cwd);}
+	if (prompt("search the contents for: ", answer, PATH_MAX) != 0 || !answer[0]) return;
 
-	move(1, 0);
-	for (i = 0; i < maxx; i++) {
-		addch('-');
+	if ((job = (GrepJob *)calloc(1, sizeof(GrepJob))) == NULL) {
+		perror("couldn't allocate memory for the search");
+		exit(1);
+	}
+	strncpy(job->pattern, answer, PATH_MAX);
+	job->patternlen = strlen(job->pattern);
+	job->literal = strpbrk(job->pattern, ".[]()*+?{}|^$\\") == NULL; /* plain strings go through memmem instead of the regex engine */
+	if (!job->literal && regcomp(&job->regex, job->pattern, REG_EXTENDED|REG_NEWLINE) != 0) {
+		free(job);
+		strncpy(status, "not a valid regular expression", NAME_MAX);
+		return;
 	}
+	job->hidden = hiddenfiles;
+	pthread_mutex_init(&job->lock, NULL);
 
-	move(2, 0);
+	/* the selection (directories are searched recursively), or everything under cwd */
+	job->nroots = selected.contents ? selected.end : 1;
+	if ((job->roots = (char **)malloc(job->nroots * sizeof(char *))) == NULL) {
+		perror("couldn't allocate memory for the search");
+		exit(1);
+	}
+	for (i = 0; i < job->nroots; i++) {
+		job->roots[i] = (char *)malloc(PATH_MAX);
+		if (selected.contents) elempath(&selected.contents[i+1], job->roots[i]);
+		else strncpy(job->roots[i], cwd, PATH_MAX);
+	}
 
-	/* column drawing */
-	rdrwfhelper();
+	snprintf(label, PATH_MAX, "files containing %s in %s", job->pattern, selected.contents ? "the selection" : cwd);
+	startvirtuallisting(ListingSearch, label);
+	job->generation = revalidationgeneration;
 
-	/* print a line to separate files from the status */
-	move(maxy-2, 0);
-	for (i = 0; i < maxx; i++) {
-		addch('-');
+	grepjob = job;
+	if (pthread_create(&thread, NULL, greprunner, job) != 0) {
+		grepjob = NULL;
+		freegrepjob(job);
+		strncpy(status, "couldn't start the search", NAME_MAX);
+		return;
 	}
+	pthread_detach(thread);
+	strncpy(status, "searching the contents...", NAME_MAX);
+}
 
-	/* print the status */
-	escapestring(status, NAME_MAX);
-	PRINTW(1, maxy-1, 0, maxx-1, 0, 0, status);
+void *
+greprunner(void *arg)
+{
+	GrepJob *job = (GrepJob *)arg;
+	WorkQueue q = {.process = grepprocess, .ctx = job};
+	int i;
+
+	for (i = 0; i < job->nroots && !job->stop; i++) runqueue(&q, &job->roots[i], 1);
+
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+void
+grepprocess(WorkQueue *q, char *path)
+{
+	GrepJob *job = (GrepJob *)q->ctx;
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	char child[PATH_MAX], *text, *slash, *eol;
+	int fd, count = 0, first = 1;
+	ssize_t got;
+	size_t len = 0, size, used;
+
+	if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) return;
+	/* symlinks aren't followed and fifos don't block */
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK)) < 0) return;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if ((dir = fdopendir(fd)) == NULL) {
+			close(fd);
+			return;
+		}
+		while ((ent = readdir(dir)) != NULL) {
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+			if (!job->hidden && ent->d_name[0] == '.') continue;
+			if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_DIR && ent->d_type != DT_REG) continue;
+			if (strcmp(path, "/") == 0) snprintf(child, PATH_MAX, "/%s", ent->d_name);
+			else snprintf(child, PATH_MAX, "%s/%s", path, ent->d_name);
+			queuepush(q, child);
+		}
+		closedir(dir);
+		return;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	/* read in pieces of whole lines, not mmap'd: a log truncated while it's searched would raise SIGBUS */
+	size = MIN((size_t)st.st_size+1, GREP_BUFSIZE);
+	if ((text = (char *)malloc(size)) == NULL) {
+		close(fd);
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		if ((got = read(fd, text+len, size-len)) < 0 && errno == EINTR) continue;
+		if (got <= 0) {
+			if (len) count += grepbuffer(job, text, len); /* the last line, without a newline */
+			break;
+		}
+		len += got;
+
+		/* like grep, a nul byte near the start means it's binary */
+		if (first && memchr(text, 0, MIN(len, GREP_BINARY_CHECK)) != NULL) {
+			count = 0;
+			break;
+		}
+		first = 0;
+
+		if ((eol = memrchr(text, '\n', len)) == NULL) {
+			/* a line longer than the buffer */
+			if (len == size && (text = (char *)realloc(text, size *= 2)) == NULL) {
+				perror("couldn't allocate memory for the search");
+				exit(1);
+			}
+			continue;
+		}
+		used = eol+1-text;
+		count += grepbuffer(job, text, used);
+		memmove(text, text+used, len-used);
+		len -= used;
+		if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) break;
+	}
+	close(fd);
+	free(text);
+	if (count == 0) return;
+
+	strncpy(child, path, PATH_MAX);
+	slash = strrchr(child, '/');
+	*slash = 0;
+	pthread_mutex_lock(&job->lock);
+	addelem(&job->found, child[0] ? child : "/", slash+1);
+	job->found.contents[job->found.end].mode = st.st_mode;
+	job->found.contents[job->found.end].nlink = st.st_nlink;
+	job->found.contents[job->found.end].uid = st.st_uid;
+	job->found.contents[job->found.end].gid = st.st_gid;
+	job->found.contents[job->found.end].size = st.st_size;
+	job->found.contents[job->found.end].mtime = st.st_mtime;
+	job->found.contents[job->found.end].ctime = st.st_ctime;
+	job->found.contents[job->found.end].statmask = INFO_STATX_MASK|STATX_MTIME;
+	job->found.contents[job->found.end].matches = count;
+	job->lines += count;
+	pthread_mutex_unlock(&job->lock);
+}
+
+int
+grepbuffer(GrepJob *job, char *text, size_t len) /* how many lines match */
+{
+	char *p = text, *end = text+len, *m, *eol;
+	regmatch_t match;
+	int count = 0;
+
+	while (p < end) {
+		if (job->literal) {
+			if ((m = memmem(p, end-p, job->pattern, job->patternlen)) == NULL) break;
+		} else {
+			/* REG_STARTEND, the text isn't nul terminated and p is always at the start of a line */
+			match.rm_so = 0;
+			match.rm_eo = end-p;
+			if (regexec(&job->regex, p, 1, &match, REG_STARTEND) != 0) break;
+			m = p+match.rm_so;
+		}
+
+		/* a line counts once, however many times it matches */
+		count++;
+		if ((eol = memchr(m, '\n', end-m)) == NULL) break;
+		p = eol+1;
+	}
+	return count;
+}
+
+int
+checkgrep(void) /* moves what the content search found into the listing, returns 1 if there's something new to draw */
+{
+	int i, done, redraw = 0;
+
+	pthread_mutex_lock(&grepjob->lock);
+	done = grepjob->done;
+	if (grepjob->generation == revalidationgeneration) {
+		for (i = 1; i <= grepjob->found.end; i++) {
+			addelem(&fileslist, grepjob->found.contents[i].path, grepjob->found.contents[i].name);
+			fileslist.contents[fileslist.end] = grepjob->found.contents[i];
+			redraw = 1;
+		}
+		if (redraw || done) {
+			snprintf(status, NAME_MAX, "%s%d files, %lld lines match", done ? "" : "searching... ", fileslist.end, grepjob->lines);
+			redraw = 1;
+		}
+	} else {
+		/* the listing was left, nobody wants the rest */
+		grepjob->stop = 1;
+	}
+	freelistcontents(&grepjob->found);
+	pthread_mutex_unlock(&grepjob->lock);
+
+	if (done) {
+		freegrepjob(grepjob);
+		grepjob = NULL;
+	}
+	return redraw;
+}
+
+void
+freegrepjob(GrepJob *job)
+{
+	int i;
+
+	if (!job->literal) regfree(&job->regex);
+	for (i = 0; i < job->nroots; i++) free(job->roots[i]);
+	free(job->roots);
+	freelistcontents(&job->found);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+}
+
+void
+comparedirectories(const Arg *arg)
+{
+	char other[PATH_MAX] = "", resolved[PATH_MAX], path[PATH_MAX];
+	int i;
+
+	/* a selected directory is the obvious thing to compare against */
+	for (i = 1; selected.contents && i <= selected.end; i++) {
+		if (S_ISDIR(selected.contents[i].mode) || selected.end == 1) {
+			elempath(&selected.contents[i], other);
+			break;
+		}
+	}
+	if (prompt("compare with: ", other, PATH_MAX) != 0 || !other[0]) {
+		strncpy(status, "compare cancelled", NAME_MAX);
+		return;
+	}
+	if (realpath(other, resolved) == NULL) {
+		snprintf(status, NAME_MAX, "couldn't find %s", other);
+		return;
+	}
+
+	strncpy(path, cwd, PATH_MAX);
+	runcompare(path, resolved);
+}
+
+void
+runcompare(char *a, char *b)
+{
+	CompareJob job = {.a = a, .b = b};
+	WorkQueue q = {.process = compareprocess, .ctx = &job};
+	char label[PATH_MAX], dir[PATH_MAX], *p, *root = "";
+	int i, counts[4] = {0};
+
+	strncpy(comparea, a, PATH_MAX);
+	strncpy(compareb, b, PATH_MAX);
+
+	drawstatus("comparing...");
+	pthread_mutex_init(&job.lock, NULL);
+	runqueue(&q, &root, 1);
+	pthread_mutex_destroy(&job.lock);
+
+	qsort(job.results, job.n, sizeof(CompareResult), compareresultcompare);
+
+	/* what's missing only exists on the other side, so that's where it's listed from */
+	snprintf(label, PATH_MAX, "compared with %s", b);
+	startvirtuallisting(ListingCompare, label);
+	for (i = 0; i < job.n; i++) {
+		snprintf(dir, PATH_MAX, "%s/%s", job.results[i].mark == MarkMissing ? b : a, job.results[i].rel);
+		p = strrchr(dir, '/');
+		*p = 0;
+		addelem(&fileslist, dir, p+1);
+		fileslist.contents[fileslist.end].mark = job.results[i].mark;
+		fileslist.contents[fileslist.end].mode = job.results[i].mode;
+		fileslist.contents[fileslist.end].size = job.results[i].size;
+		fileslist.contents[fileslist.end].statmask = STATX_TYPE|STATX_MODE|STATX_SIZE;
+		counts[job.results[i].mark]++;
+		free(job.results[i].rel);
+	}
+	free(job.results);
+
+	snprintf(status, NAME_MAX, "%lld compared: %d new, %d missing, %d changed", job.compared, counts[MarkNew], counts[MarkMissing], counts[MarkChanged]);
+}
+
+void
+syncdirectories(const Arg *arg)
+{
+	CompareJob job;
+	WorkQueue q = {.process = syncprocess, .ctx = &job};
+	char answer[NAME_MAX] = "", question[PATH_MAX], path[PATH_MAX], a[PATH_MAX], b[PATH_MAX], **rel;
+	int i, n = 0, nrel = 0;
+	size_t len = strlen(comparea);
+
+	if (listingkind != ListingCompare) {
+		strncpy(status, "sync only works on the result of a compare", NAME_MAX);
+		return;
+	}
+	for (i = 1; i <= fileslist.end; i++) {
+		if (fileslist.contents[i].mark == MarkNew || fileslist.contents[i].mark == MarkChanged) n++;
+	}
+	if (n == 0) {
+		strncpy(status, "nothing to sync", NAME_MAX);
+		return;
+	}
+
+	snprintf(question, PATH_MAX, "copy %d new and changed entries to %s [y/N]: ", n, compareb);
+	if (prompt(question, answer, NAME_MAX) != 0 || (answer[0] != 'y' && answer[0] != 'Y')) {
+		strncpy(status, "didn't sync", NAME_MAX);
+		return;
+	}
+
+	memset(&job, 0, sizeof(job));
+	strncpy(a, comparea, PATH_MAX);
+	strncpy(b, compareb, PATH_MAX);
+	job.a = a;
+	job.b = b;
+
+	/* only one way, what's missing here isn't removed there */
+	if ((rel = (char **)malloc(n * sizeof(char *))) == NULL) {
+		perror("couldn't allocate memory for the sync");
+		exit(1);
+	}
+	for (i = 1; i <= fileslist.end; i++) {
+		if (fileslist.contents[i].mark != MarkNew && fileslist.contents[i].mark != MarkChanged) continue;
+		elempath(&fileslist.contents[i], path);
+		if (strncmp(path, a, len) == 0 && path[len] == '/' && (rel[nrel] = strdup(path+len+1)) != NULL) nrel++;
+	}
+	drawstatus("syncing...");
+	runqueue(&q, rel, nrel);
+	for (i = 0; i < nrel; i++) {
+		free(rel[i]);
+	}
+	free(rel);
+
+	runcompare(a, b);
+	snprintf(question, PATH_MAX, "copied %lld entries, %lld failed; %s", job.copied, job.failed, status);
+	strncpy(status, question, NAME_MAX-1);
+}
+
+int
+readcompareentries(char *dir, CompareEntry **entries) /* returns how many, sorted by name */
+{
+	DIR *d;
+	struct dirent *ent;
+	struct stat st;
+	int fd, n = 0, size = 0;
+
+	*entries = NULL;
+	if ((fd = open(dir, O_RDONLY|O_DIRECTORY)) < 0) return 0;
+	if ((d = fdopendir(fd)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+		if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+		if (n >= size) {
+			size += N;
+			if ((*entries = (CompareEntry *)realloc(*entries, size * sizeof(CompareEntry))) == NULL) {
+				perror("couldn't allocate memory for the compare");
+				exit(1);
+			}
+		}
+		(*entries)[n].name = strdup(ent->d_name);
+		(*entries)[n].mode = st.st_mode;
+		(*entries)[n].size = st.st_size;
+		(*entries)[n++].mtime = st.st_mtim;
+	}
+	closedir(d);
+
+	qsort(*entries, n, sizeof(CompareEntry), compareentrycompare);
+	return n;
+}
+
+int
+compareentrycompare(const void *a, const void *b)
+{
+	return strcmp(((const CompareEntry *)a)->name, ((const CompareEntry *)b)->name);
+}
+
+int
+compareresultcompare(const void *a, const void *b)
+{
+	return strcmp(((const CompareResult *)a)->rel, ((const CompareResult *)b)->rel);
+}
+
+void
+addcompareresult(CompareJob *job, char *rel, char *name, int mark, CompareEntry *e)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name);
+
+	pthread_mutex_lock(&job->lock);
+	if (job->n >= job->size) {
+		job->size += N;
+		if ((job->results = (CompareResult *)realloc(job->results, job->size * sizeof(CompareResult))) == NULL) {
+			perror("couldn't allocate memory for the compare");
+			exit(1);
+		}
+	}
+	job->results[job->n].rel = strdup(path);
+	job->results[job->n].mark = mark;
+	job->results[job->n].mode = e->mode;
+	job->results[job->n++].size = e->size;
+	pthread_mutex_unlock(&job->lock);
+}
+
+void
+compareprocess(WorkQueue *q, char *rel) /* compares one directory on both sides, queueing the subdirectories they share */
+{
+	CompareJob *job = (CompareJob *)q->ctx;
+	CompareEntry *ea, *eb;
+	char dira[PATH_MAX], dirb[PATH_MAX], pa[PATH_MAX], pb[PATH_MAX], la[PATH_MAX], lb[PATH_MAX];
+	int na, nb, i = 0, j = 0, c, changed;
+	ssize_t lena, lenb;
+
+	snprintf(dira, PATH_MAX, "%s/%s", job->a, rel);
+	snprintf(dirb, PATH_MAX, "%s/%s", job->b, rel);
+	na = readcompareentries(dira, &ea);
+	nb = readcompareentries(dirb, &eb);
+
+	/* both sides are sorted, so they are merged like in a merge sort */
+	while (i < na || j < nb) {
+		c = i >= na ? 1 : j >= nb ? -1 : strcmp(ea[i].name, eb[j].name);
+		if (c < 0) {
+			addcompareresult(job, rel, ea[i].name, MarkNew, &ea[i]);
+			i++;
+			continue;
+		} else if (c > 0) {
+			addcompareresult(job, rel, eb[j].name, MarkMissing, &eb[j]);
+			j++;
+			continue;
+		}
+
+		snprintf(pa, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", ea[i].name);
+		if (S_ISDIR(ea[i].mode) && S_ISDIR(eb[j].mode)) {
+			queuepush(q, pa);
+		} else {
+			changed = (ea[i].mode & S_IFMT) != (eb[j].mode & S_IFMT) || ea[i].size != eb[j].size;
+			if (!changed && S_ISLNK(ea[i].mode)) {
+				snprintf(pa, PATH_MAX, "%s/%s", dira, ea[i].name);
+				snprintf(pb, PATH_MAX, "%s/%s", dirb, eb[j].name);
+				lena = readlink(pa, la, PATH_MAX);
+				lenb = readlink(pb, lb, PATH_MAX);
+				changed = lena != lenb || lena < 0 || memcmp(la, lb, lena) != 0;
+			} else if (!changed && (ea[i].mtime.tv_sec != eb[j].mtime.tv_sec || ea[i].mtime.tv_nsec != eb[j].mtime.tv_nsec)) {
+				/* same size but touched at different times, only the content can tell */
+				changed = 1;
+				if (COMPARECONTENT && S_ISREG(ea[i].mode)) {
+					snprintf(pa, PATH_MAX, "%s/%s", dira, ea[i].name);
+					snprintf(pb, PATH_MAX, "%s/%s", dirb, eb[j].name);
+					changed = ea[i].size != 0 && samecontent(pa, pb) != 1;
+				}
+			}
+			if (changed) addcompareresult(job, rel, ea[i].name, MarkChanged, &ea[i]);
+		}
+		i++;
+		j++;
+	}
+
+	__atomic_fetch_add(&job->compared, na+nb, __ATOMIC_RELAXED);
+	for (i = 0; i < na; i++) free(ea[i].name);
+	for (j = 0; j < nb; j++) free(eb[j].name);
+	free(ea);
+	free(eb);
+}
+
+void
+syncprocess(WorkQueue *q, char *rel) /* copies one entry from a to b, queueing the contents of directories */
+{
+	CompareJob *job = (CompareJob *)q->ctx;
+	char src[PATH_MAX], dst[PATH_MAX], child[PATH_MAX], target[PATH_MAX];
+	struct stat st, dstst;
+	struct dirent *ent;
+	ssize_t len;
+	DIR *d;
+	int ok = 0;
+
+	snprintf(src, PATH_MAX, "%s/%s", job->a, rel);
+	snprintf(dst, PATH_MAX, "%s/%s", job->b, rel);
+	if (lstat(src, &st) != 0) {
+		__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* something of another kind in the way is replaced, unless it's a directory */
+	if (lstat(dst, &dstst) == 0 && (dstst.st_mode & S_IFMT) != (st.st_mode & S_IFMT)) {
+		if (S_ISDIR(dstst.st_mode) || unlink(dst) != 0) {
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if ((mkdir(dst, st.st_mode & 07777) == 0 || errno == EEXIST) && (d = opendir(src)) != NULL) {
+			while ((ent = readdir(d)) != NULL) {
+				if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+				snprintf(child, PATH_MAX, "%s/%s", rel, ent->d_name);
+				queuepush(q, child);
+			}
+			closedir(d);
+			ok = 1;
+		}
+	} else if (S_ISLNK(st.st_mode)) {
+		if ((len = readlink(src, target, PATH_MAX-1)) >= 0) {
+			target[len] = 0;
+			unlink(dst);
+			ok = symlink(target, dst) == 0;
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		ok = copyfile(src, dst, &st) == 0;
+	}
+
+	__atomic_fetch_add(ok ? &job->copied : &job->failed, 1, __ATOMIC_RELAXED);
+}
+
+int
+copyfile(char *src, char *dst, struct stat *st)
+{
+	struct timespec times[2] = {st->st_atim, st->st_mtim};
+	char *buf = NULL;
+	ssize_t n, w, off;
+	int in, out, ret = 0;
+
+	if ((in = open(src, O_RDONLY)) < 0) return -1;
+	if ((out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, st->st_mode & 07777)) < 0) {
+		close(in);
+		return -1;
+	}
+
+	/* copy_file_range lets the filesystem copy (or reflink) without going through userspace */
+	while ((n = copy_file_range(in, NULL, out, NULL, COPY_BUFSIZE, 0)) > 0);
+	if (n < 0) {
+		if ((errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) && lseek(in, 0, SEEK_SET) == 0 && \
+				ftruncate(out, 0) == 0 && lseek(out, 0, SEEK_SET) == 0 && (buf = (char *)malloc(COPY_BUFSIZE)) != NULL) {
+			while ((n = read(in, buf, COPY_BUFSIZE)) > 0) {
+				for (off = 0; off < n; off += w) {
+					if ((w = write(out, buf+off, n-off)) < 0) break;
+				}
+				if (off < n) break;
+			}
+			free(buf);
+		}
+		if (n != 0) ret = -1;
+	}
+
+	/* the same mtime is what makes it compare equal afterwards */
+	if (futimens(out, times) != 0) ret = -1;
+	if (close(out) != 0) ret = -1;
+	close(in);
+	return ret;
+}
+
+int
+archivetype(char *path) /* -1 if it's neither a zip nor a (compressed) tar */
+{
+	unsigned char block[ARCHIVE_BLOCK];
+	gzFile gz;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	n = read(fd, block, 4);
+	if (n == 4 && memcmp(block, "PK", 2) == 0 && ((block[2] == 3 && block[3] == 4) || (block[2] == 5 && block[3] == 6))) {
+		close(fd);
+		return ArchiveZip;
+	}
+
+	/* gzread reads uncompressed files as they are, so both kinds of tar are checked the same way */
+	lseek(fd, 0, SEEK_SET);
+	if ((gz = gzdopen(fd, "rb")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	n = gzread(gz, block, ARCHIVE_BLOCK);
+	gzclose(gz);
+	if (n == ARCHIVE_BLOCK && memcmp(block+257, "ustar", 5) == 0) return ArchiveTar;
+	return -1;
+}
+
+ArchiveMember *
+addmember(ArchiveIndex *index, char *name)
+{
+	ArchiveMember *m;
+	size_t len;
+
+	while (strncmp(name, "./", 2) == 0) name += 2;
+	while (name[0] == '/') name++;
+	if (!name[0] || strcmp(name, ".") == 0) return NULL;
+
+	if (index->n >= index->size) {
+		index->size += N;
+		if ((index->members = (ArchiveMember *)realloc(index->members, index->size * sizeof(ArchiveMember))) == NULL) {
+			perror("couldn't allocate memory for the archive index");
+			exit(1);
+		}
+	}
+	m = &index->members[index->n++];
+	memset(m, 0, sizeof(ArchiveMember));
+	if ((m->name = strdup(name)) == NULL) {
+		perror("couldn't allocate memory for the archive index");
+		exit(1);
+	}
+	len = strlen(m->name);
+	if (len > 1 && m->name[len-1] == '/') {
+		m->name[len-1] = 0;
+		m->mode = S_IFDIR|0755;
+	}
+	return m;
+}
+
+off_t
+tarnumber(unsigned char *field, int len) /* octal, or base-256 when the high bit is set (for big files) */
+{
+	off_t n = 0;
+	int i;
+
+	if (field[0] & 0x80) {
+		n = field[0] & 0x3f;
+		for (i = 1; i < len; i++) n = (n << 8) | field[i];
+		return n;
+	}
+	for (i = 0; i < len && (field[i] == ' ' || field[i] == '0'); i++);
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) n = n*8 + field[i]-'0';
+	return n;
+}
+
+int
+indextar(char *path, ArchiveIndex *index) /* streams through the headers, the data of the members is skipped */
+{
+	unsigned char block[ARCHIVE_BLOCK];
+	char name[PATH_MAX], longname[PATH_MAX] = "", *pax, *p, *end, *key;
+	off_t pos = 0, size, paxsize = -1, skip;
+	ArchiveMember *m;
+	gzFile gz;
+	long len;
+	int type;
+
+	if ((gz = gzopen(path, "rb")) == NULL) return -1;
+	gzbuffer(gz, ARCHIVE_BUFSIZE);
+
+	while (gzread(gz, block, ARCHIVE_BLOCK) == ARCHIVE_BLOCK) {
+		pos += ARCHIVE_BLOCK;
+		if (block[0] == 0) break; /* the end is marked by empty blocks */
+
+		type = block[156];
+		size = tarnumber(block+124, 12);
+		skip = (size + ARCHIVE_BLOCK-1) / ARCHIVE_BLOCK * ARCHIVE_BLOCK;
+
+		/* long names come in a member of their own, before the one they belong to */
+		if (type == 'L' || type == 'x') {
+			if (size >= PATH_MAX*4 || (pax = (char *)malloc(skip+1)) == NULL) break;
+			if (gzread(gz, pax, skip) != skip) {
+				free(pax);
+				break;
+			}
+			pos += skip;
+			pax[size] = 0;
+			if (type == 'L') {
+				strncpy(longname, pax, PATH_MAX-1);
+			} else {
+				/* records look like "<length> <key>=<value>\n" */
+				for (p = pax; p < pax+size; p += len) {
+					len = strtol(p, &key, 10);
+					if (len <= 0 || p+len > pax+size) break;
+					key++;
+					end = p+len-1;
+					*end = 0;
+					if (strncmp(key, "path=", 5) == 0) strncpy(longname, key+5, PATH_MAX-1);
+					else if (strncmp(key, "size=", 5) == 0) paxsize = strtoll(key+5, NULL, 10);
+				}
+			}
+			free(pax);
+			continue;
+		}
+
+		if (longname[0]) {
+			strncpy(name, longname, PATH_MAX);
+		} else if (memcmp(block+257, "ustar", 5) == 0 && block[345]) {
+			snprintf(name, PATH_MAX, "%.155s/%.100s", (char *)block+345, (char *)block);
+		} else {
+			snprintf(name, PATH_MAX, "%.100s", (char *)block);
+		}
+		if (paxsize >= 0) {
+			size = paxsize;
+			skip = (size + ARCHIVE_BLOCK-1) / ARCHIVE_BLOCK * ARCHIVE_BLOCK;
+		}
+		longname[0] = 0;
+		paxsize = -1;
+
+		if (type != 'g' && type != 'K' && (m = addmember(index, name)) != NULL) {
+			m->offset = pos;
+			m->size = size;
+			m->uid = tarnumber(block+108, 8);
+			m->gid = tarnumber(block+116, 8);
+			m->mtime = tarnumber(block+136, 12);
+			m->mode = (tarnumber(block+100, 8) & 07777) | \
+				(type == '5' ? S_IFDIR : type == '2' ? S_IFLNK : type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : type == '6' ? S_IFIFO : S_IFREG);
+			if (S_ISDIR(m->mode)) m->size = 0;
+		}
+
+		/* directories and links don't have data, whatever size they say */
+		if (type == '1' || type == '2' || type == '5') skip = 0;
+		if (skip && gzseek(gz, skip, SEEK_CUR) < 0) break;
+		pos += skip;
+	}
+
+	gzclose(gz);
+	return 0;
+}
+
+int
+indexzip(char *path, ArchiveIndex *index) /* reads the central directory at the end, the members themselves aren't touched */
+{
+	unsigned char tail[65536+22], header[46], *e, *x;
+	char name[PATH_MAX];
+	unsigned long long entries, cdoffset, i;
+	off_t filesize, start;
+	int fd, namelen, extralen, commentlen, n, j, k;
+	struct tm tm;
+	ArchiveMember *m;
+	FILE *fp;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	filesize = lseek(fd, 0, SEEK_END);
+	start = MAX(filesize - (off_t)sizeof(tail), 0);
+	n = pread(fd, tail, filesize-start, start);
+
+	/* the end of central directory record is followed by a comment of up to 64k */
+	for (e = NULL, j = n-22; j >= 0; j--) {
+		if (LE32(tail+j) == 0x06054b50) {
+			e = tail+j;
+			break;
+		}
+	}
+	if (e == NULL) {
+		close(fd);
+		return -1;
+	}
+	entries = LE16(e+10);
+	cdoffset = LE32(e+16);
+
+	/* zip64 has a locator right before it, pointing to a bigger record */
+	if (j >= 20 && LE32(e-20) == 0x07064b50 && pread(fd, tail, 56, LE64(e-20+8)) == 56 && LE32(tail) == 0x06064b50) {
+		entries = LE64(tail+32);
+		cdoffset = LE64(tail+48);
+	}
+
+	if ((fp = fdopen(fd, "rb")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	fseeko(fp, cdoffset, SEEK_SET);
+
+	for (i = 0; i < entries; i++) {
+		if (fread(header, 1, 46, fp) != 46 || LE32(header) != 0x02014b50) break;
+		namelen = LE16(header+28);
+		extralen = LE16(header+30);
+		commentlen = LE16(header+32);
+		if (namelen >= PATH_MAX) {
+			/* up to 64k, a member with a longer name than a path can be is skipped */
+			if (fseeko(fp, namelen+extralen+commentlen, SEEK_CUR) != 0) break;
+			continue;
+		}
+		if (fread(name, 1, namelen, fp) != (size_t)namelen || fread(tail, 1, extralen, fp) != (size_t)extralen) break;
+		name[namelen] = 0;
+		fseeko(fp, commentlen, SEEK_CUR);
+
+		if ((m = addmember(index, name)) == NULL) continue;
+		m->method = LE16(header+10) | (LE16(header+8) & 1) << 16; /* encrypted ones can't be extracted */
+		m->csize = LE32(header+20);
+		m->size = LE32(header+24);
+		m->offset = LE32(header+42); /* of the local header, the data is after it */
+
+		/* the fields that don't fit are in the zip64 extra field, in this order */
+		for (x = tail; x+4 <= tail+extralen; x += 4+LE16(x+2)) {
+			if (LE16(x) != 0x0001) continue;
+			k = 4;
+			if ((unsigned int)m->size == 0xffffffff) { m->size = LE64(x+k); k += 8; }
+			if ((unsigned int)m->csize == 0xffffffff) { m->csize = LE64(x+k); k += 8; }
+			if ((unsigned int)m->offset == 0xffffffff) m->offset = LE64(x+k);
+			break;
+		}
 
+		/* made on unix, the mode is in the upper half of the attributes */
+		if (!m->mode) m->mode = header[5] == 3 && (LE32(header+38) >> 16) ? LE32(header+38) >> 16 : S_IFREG|0644;
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_sec = (LE16(header+12) & 0x1f) * 2;
+		tm.tm_min = (LE16(header+12) >> 5) & 0x3f;
+		tm.tm_hour = LE16(header+12) >> 11;
+		tm.tm_mday = LE16(header+14) & 0x1f;
+		tm.tm_mon = ((LE16(header+14) >> 5) & 0xf) - 1;
+		tm.tm_year = (LE16(header+14) >> 9) + 80;
+		tm.tm_isdst = -1;
+		m->mtime = mktime(&tm);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+ArchiveIndex *
+loadarchive(char *path) /* the index of the archive, built the first time it's opened */
+{
+	ArchiveIndex *index, *oldest = &archives[0];
+	struct stat st;
+	int i;
+
+	if (stat(path, &st) != 0) return NULL;
+	for (i = 0; i < ARCHIVE_CACHE; i++) {
+		index = &archives[i];
+		if (index->members && index->dev == st.st_dev && index->ino == st.st_ino && \
+				index->mtime.tv_sec == st.st_mtim.tv_sec && index->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			index->lastused = msnow();
+			return index;
+		}
+		if (index->lastused < oldest->lastused) oldest = index;
+	}
+
+	/* the least recently used one makes room */
+	index = oldest;
+	for (i = 0; i < index->n; i++) free(index->members[i].name);
+	free(index->members);
+	memset(index, 0, sizeof(ArchiveIndex));
+
+	index->type = archivetype(path);
+	if ((index->type == ArchiveZip ? indexzip(path, index) : indextar(path, index)) != 0 || !index->members) {
+		free(index->members);
+		memset(index, 0, sizeof(ArchiveIndex));
+		return NULL;
+	}
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	index->mtime = st.st_mtim;
+	index->lastused = msnow();
+	return index;
+}
+
+int
+openarchive(char *path)
+{
+	char resolved[PATH_MAX];
 
-	/* print the number of files and what number is the current file */
-	NUMOFDIGITS(digitsfiles, fileslist.end, t1);
-	NUMOFDIGITS(digitspos, current, t1);
+	if (realpath(path, resolved) == NULL) return -1;
+	drawstatus("reading the archive...");
+	if (loadarchive(resolved) == NULL) {
+		strncpy(status, "couldn't read the archive", NAME_MAX);
+		return -1;
+	}
 
-	if (maxx-digitspos-3-digitsfiles > 0) mvprintw(maxy-1, maxx-digitspos-3-digitsfiles, " %d/%d", current, fileslist.end);
+	strncpy(archivepath, resolved, PATH_MAX);
+	archivedir[0] = 0;
+	listarchive(NULL);
+	return 0;
 }
 
 void
-rdrwfhelper(void)
+listarchive(char *select) /* lists archivedir, with the cursor on select if it's there */
 {
-	int i, size = maxx, currentcolumn = 0, currentposition = 1, ratiossum = 0, overwritesize = 0;
-	char prevpath[PATH_MAX] = "", nextpath[PATH_MAX] = "", resolvedpath[PATH_MAX], highlightedname[NAME_MAX], tmpstr[PATH_MAX], *p, *pnext;
-	struct stat pathstat;
-
-	for (i = 0; drawratios[cratio][i]; i++) {
-		ratiossum += drawratios[cratio][i];
-	}
-	currentposition = drawratios[cratio][i+1];
-	
-	if (currentposition >= i || ratiossum == 0) {
-		rdrwfmaincolumn(0, maxx);
-		strncpy(status, "ratios not properly defined", NAME_MAX);
+	ArchiveIndex *index;
+	ArchiveMember *m;
+	Files list = {0};
+	char label[PATH_MAX], path[PATH_MAX], archive[PATH_MAX], name[NAME_MAX], *rest, *slash;
+	size_t len = strlen(archivedir);
+	int i, j, pass, isdir;
+
+	strncpy(archive, archivepath, PATH_MAX);
+	if ((index = loadarchive(archive)) == NULL) {
+		getcurrentfiles();
+		strncpy(status, "the archive can't be read anymore", NAME_MAX);
 		return;
-	} else {
-		size = maxx/ratiossum;
 	}
 
-	for (i = 0; i < currentposition; i++) {
-		strncat(prevpath, "../", PATH_MAX-strlen(prevpath)-1);
+	/* members deeper down show up as the directory they're in, even if it has no member of its own */
+	for (i = 0; i < index->n; i++) {
+		m = &index->members[i];
+		if (len && (strncmp(m->name, archivedir, len) != 0 || m->name[len] != '/')) continue;
+		rest = m->name + (len ? len+1 : 0);
+		if ((slash = strchr(rest, '/')) != NULL) snprintf(name, NAME_MAX, "%.*s", (int)(slash-rest), rest);
+		else strncpy(name, rest, NAME_MAX-1);
+		if (!name[0] || (!hiddenfiles && name[0] == '.')) continue;
+
+		addelem(&list, "", name);
+		list.contents[list.end].mode = slash ? S_IFDIR|0755 : m->mode;
+		list.contents[list.end].group = slash ? -1 : i;
 	}
-	p = prevpath;
-
-	if (fileslist.contents) strncpy(nextpath, fileslist.contents[current].name, NAME_MAX);
+	if (list.contents) qsort(list.contents+1, list.end, sizeof(FileElem), archiveelemcompare);
 
-	for (i = 0; drawratios[cratio][i]; i++) {
-		overwritesize = 0;
+	snprintf(label, PATH_MAX, "%s%s%s", archive, archivedir[0] ? "/" : "", archivedir);
+	startvirtuallisting(ListingArchive, label);
+	strncpy(archivepath, archive, PATH_MAX);
 
-		if (drawratios[cratio][i+1] == 0) {
-			overwritesize = maxx - currentcolumn;
+	/* the same name is there once per member under it, the real member wins */
+	for (pass = 0; pass < (sortbydirectories ? 2 : 1); pass++) {
+		for (i = 1; i <= list.end; i = j) {
+			for (j = i+1; j <= list.end && strcmp(list.contents[j].name, list.contents[i].name) == 0; j++) {
+				if (list.contents[j].group >= 0) list.contents[i].group = list.contents[j].group;
+			}
+			isdir = S_ISDIR(list.contents[i].mode) || list.contents[i].group < 0;
+			if (sortbydirectories && (isdir ? 0 : 1) != pass) continue;
+
+			addelem(&fileslist, label, list.contents[i].name);
+			if (list.contents[i].group >= 0) {
+				m = &index->members[list.contents[i].group];
+				fileslist.contents[fileslist.end].mode = isdir ? S_IFDIR|(m->mode & 07777) : m->mode;
+				fileslist.contents[fileslist.end].size = m->size;
+				fileslist.contents[fileslist.end].uid = m->uid;
+				fileslist.contents[fileslist.end].gid = m->gid;
+				fileslist.contents[fileslist.end].mtime = fileslist.contents[fileslist.end].ctime = m->mtime;
+			} else {
+				fileslist.contents[fileslist.end].mode = S_IFDIR|0755;
+			}
+			fileslist.contents[fileslist.end].nlink = 1;
+			fileslist.contents[fileslist.end].statmask = INFO_STATX_MASK;
+			if (select && strcmp(select, list.contents[i].name) == 0) current = fileslist.end;
 		}
+	}
+	freelistcontents(&list);
 
-		if (i < currentposition) {
-			/* for highlighting the name of the next column's folder name */
-			if (strcmp(cwd, "/") != 0) {
-				pnext = strchr(p, '/');
-				if (pnext != NULL && strcmp(pnext, "/") != 0) {
-					pnext++;
+	if (current > MAX(maxy-4, 1)) topofscreen = current - (maxy-4)/2;
+	snprintf(path, PATH_MAX, "%d members, x extracts", index->n);
+	strncpy(status, path, NAME_MAX);
+}
 
-					if (realpath(pnext, resolvedpath) == NULL) resolvedpath[0] = 0;
-				} else {
-					strncpy(resolvedpath, cwd, PATH_MAX);
-				}
+int
+archiveelemcompare(const void *a, const void *b)
+{
+	return strcmp(((const FileElem *)a)->name, ((const FileElem *)b)->name);
+}
 
-				if (p == NULL || p[0] == 0 || strcmp(p, "/") == 0) {
-					rdrwfsecondarycolumn(resolvedpath, "..", currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size), 0, NULL);
-				} else {
-					rdrwfsecondarycolumn(resolvedpath, p, currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size), 0, NULL);
-				}
+int
+extracttar(ArchiveMember *m, int out)
+{
+	char *buf;
+	off_t left = m->size;
+	int n, ret = 0;
+	gzFile gz;
+
+	if ((gz = gzopen(archivepath, "rb")) == NULL) return -1;
+	if ((buf = (char *)malloc(ARCHIVE_BUFSIZE)) == NULL) {
+		gzclose(gz);
+		return -1;
+	}
 
-				p = pnext;
-			}
-		} else if (i == currentposition) {
-			rdrwfmaincolumn(currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size));
-		} else {
-			if (!fileslist.contents) break;
+	/* plain tars seek there directly, compressed ones are decompressed up to it */
+	gzbuffer(gz, ARCHIVE_BUFSIZE);
+	if (gzseek(gz, m->offset, SEEK_SET) != m->offset) ret = -1;
+	while (ret == 0 && left > 0) {
+		if ((n = gzread(gz, buf, MIN(left, ARCHIVE_BUFSIZE))) <= 0 || write(out, buf, n) != n) ret = -1;
+		left -= n;
+	}
 
-			rdrwfsecondarycolumn("", nextpath, currentcolumn, MAX(overwritesize, drawratios[cratio][i]*size), 1, highlightedname);
-			snprintf(tmpstr, PATH_MAX, "%s/%s", nextpath, highlightedname);
+	free(buf);
+	gzclose(gz);
+	return ret;
+}
 
-			if (stat(tmpstr, &pathstat) != 0 ) break;
-			if (!S_ISDIR(pathstat.st_mode)) break;
+int
+extractzip(ArchiveMember *m, int out)
+{
+	unsigned char header[30], *in, *buf;
+	off_t pos, left = m->csize;
+	z_stream z;
+	int fd, n, zret = Z_OK, ret = 0;
+
+	if (m->method != 0 && m->method != 8) return -1; /* only stored and deflated */
+	if ((fd = open(archivepath, O_RDONLY)) < 0) return -1;
+	if (pread(fd, header, 30, m->offset) != 30 || LE32(header) != 0x04034b50) {
+		close(fd);
+		return -1;
+	}
+	pos = m->offset + 30 + LE16(header+26) + LE16(header+28);
+
+	in = (unsigned char *)malloc(ARCHIVE_BUFSIZE);
+	buf = (unsigned char *)malloc(ARCHIVE_BUFSIZE);
+	memset(&z, 0, sizeof(z));
+	if (!in || !buf || (m->method == 8 && inflateInit2(&z, -MAX_WBITS) != Z_OK)) {
+		free(in);
+		free(buf);
+		close(fd);
+		return -1;
+	}
 
-			strncpy(nextpath, tmpstr, PATH_MAX);
+	while (ret == 0 && left > 0 && zret != Z_STREAM_END) {
+		if ((n = pread(fd, in, MIN(left, ARCHIVE_BUFSIZE), pos)) <= 0) {
+			ret = -1;
+			break;
 		}
+		pos += n;
+		left -= n;
 
-		currentcolumn += drawratios[cratio][i]*size;
+		if (m->method == 0) {
+			if (write(out, in, n) != n) ret = -1;
+			continue;
+		}
+		z.next_in = in;
+		z.avail_in = n;
+		do {
+			z.next_out = buf;
+			z.avail_out = ARCHIVE_BUFSIZE;
+			zret = inflate(&z, Z_NO_FLUSH);
+			if ((zret != Z_OK && zret != Z_STREAM_END) || write(out, buf, ARCHIVE_BUFSIZE - z.avail_out) != (ssize_t)(ARCHIVE_BUFSIZE - z.avail_out)) {
+				ret = -1;
+				break;
+			}
+		} while (z.avail_in > 0 && zret != Z_STREAM_END);
 	}
+
+	if (m->method == 8) inflateEnd(&z);
+	free(in);
+	free(buf);
+	close(fd);
+	return ret;
 }
 
 void
-rdrwfmaincolumn(int column, int size) /* (r)e(dr)a(w) (f)unction */
+extractmember(const Arg *arg) /* copies the current member of an archive to cwd */
 {
-	struct stat pathstat;
-	int i, overwrite = 0;
+	ArchiveIndex *index;
+	ArchiveMember *m = NULL;
+	struct timespec times[2];
+	char name[PATH_MAX];
+	int i, out, ret;
+
+	if (!archivepath[0] || !fileslist.contents) {
+		strncpy(status, "not in an archive", NAME_MAX);
+		return;
+	}
+	if ((index = loadarchive(archivepath)) == NULL) return;
 
-	i = 2;
-	while (topofscreen+i-2 <= fileslist.end && i < maxy-2) {
-		overwrite = 0;
+	snprintf(name, PATH_MAX, "%s%s%s", archivedir, archivedir[0] ? "/" : "", fileslist.contents[current].name);
+	for (i = 0; i < index->n; i++) {
+		if (strcmp(index->members[i].name, name) == 0) m = &index->members[i];
+	}
+	if (m == NULL || !S_ISREG(m->mode)) {
+		strncpy(status, "only files can be extracted", NAME_MAX);
+		return;
+	}
 
-		if (topofscreen+i-2 == current) {
-			overwrite = 7;
-		}
+	if ((out = open(fileslist.contents[current].name, O_WRONLY|O_CREAT|O_EXCL, m->mode & 0777)) < 0) {
+		snprintf(status, NAME_MAX, "couldn't create %s: %s", fileslist.contents[current].name, strerror(errno));
+		return;
+	}
+	drawstatus("extracting...");
+	ret = index->type == ArchiveZip ? extractzip(m, out) : extracttar(m, out);
 
-		/* decision on wheter the element is a directory and if it is selected */
-		if (stat(fileslist.contents[topofscreen+i-2].name, &pathstat) == 0 && S_ISDIR(pathstat.st_mode)) {
-			if (isselected(cwd, fileslist.contents[topofscreen+i-2].name)) {
-				PRINTW(MAX(overwrite, 4), i, column, size-1, 1, 1, fileslist.contents[topofscreen+i-2].name);
-			} else {
-				PRINTW(MAX(overwrite, 3), i, column, size-1, 0, 1, fileslist.contents[topofscreen+i-2].name);
-			}
-		} else {
-			if (isselected(cwd, fileslist.contents[topofscreen+i-2].name)) {
-				PRINTW(MAX(overwrite, 2), i, column, size-1, 1, 0, fileslist.contents[topofscreen+i-2].name);
-			} else {
-				PRINTW(MAX(overwrite, 1), i, column, size-1, 0, 0, fileslist.contents[topofscreen+i-2].name);
+	times[0].tv_sec = times[1].tv_sec = m->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	futimens(out, times);
+	close(out);
+
+	if (ret != 0) {
+		unlink(fileslist.contents[current].name);
+		strncpy(status, "couldn't extract it", NAME_MAX);
+	} else {
+		snprintf(status, NAME_MAX, "extracted %s to %s", fileslist.contents[current].name, cwd);
+	}
+}
+
+void
+stealpush(StealPool *pool, int worker, void *item)
+{
+	StealDeque *d = &pool->deques[worker];
+
+	__atomic_add_fetch(&pool->outstanding, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&d->lock);
+	if (d->tail >= d->size) {
+		/* what was stolen from the front is reclaimed before growing */
+		memmove(d->items, d->items+d->head, (d->tail-d->head) * sizeof(void *));
+		d->tail -= d->head;
+		d->head = 0;
+		if (d->tail >= d->size) {
+			d->size += N;
+			if ((d->items = (void **)realloc(d->items, d->size * sizeof(void *))) == NULL) {
+				perror("couldn't allocate memory for the work queue");
+				exit(1);
 			}
 		}
+	}
+	d->items[d->tail++] = item;
+	pthread_mutex_unlock(&d->lock);
+}
 
+void *
+stealpop(StealPool *pool, int worker) /* the newest item of its own deque, or else the oldest of another one's */
+{
+	StealDeque *d;
+	void *item = NULL;
+	int i;
 
-		i++;
+	for (i = 0; i < pool->nworkers && !item; i++) {
+		d = &pool->deques[(worker+i) % pool->nworkers];
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail) item = i == 0 ? d->items[--d->tail] : d->items[d->head++];
+		if (d->head == d->tail) d->head = d->tail = 0;
+		pthread_mutex_unlock(&d->lock);
 	}
+	return item;
+}
 
-	if (i == 2 || !fileslist.contents) {
-		PRINTW(5, i, column, size-1, 0, 0, "NO FILES IN CURRENT DIRECTORY");
+void *
+stealworker(void *arg)
+{
+	StealPool *pool = (StealPool *)arg;
+	struct timespec pause = {0, 100000};
+	int worker = __atomic_fetch_add(&pool->started, 1, __ATOMIC_SEQ_CST) % pool->nworkers;
+	void *item;
+
+	/* done when nothing is queued and nobody is working on anything that could queue more */
+	while (__atomic_load_n(&pool->outstanding, __ATOMIC_SEQ_CST) > 0) {
+		if ((item = stealpop(pool, worker)) == NULL) {
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		pool->process(pool, worker, item);
+		__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_SEQ_CST);
 	}
+	return NULL;
 }
 
 void
-rdrwfsecondarycolumn(char *comingfrom, char *pathtodraw, int column, int size, int direction, char *highlightedname) /* direction 0 -> backward; direction 1 -> forwards */
+runstealpool(StealPool *pool, void **items, int n)
 {
-	int i, j, lendir, overwrite = 0;
-	char resolvedpath[PATH_MAX], *p, statpath[PATH_MAX], name[NAME_MAX];
-	struct dirent **namelist;
-	struct stat pathstat;
+	int i;
 
-	if (stat(pathtodraw, &pathstat) != 0) return;
-	if (!S_ISDIR(pathstat.st_mode)) return;
+	pool->nworkers = WORKER_THREADS;
+	pool->started = 0;
+	pool->outstanding = 0;
+	if ((pool->deques = (StealDeque *)calloc(pool->nworkers, sizeof(StealDeque))) == NULL) {
+		perror("couldn't allocate memory for the work queue");
+		exit(1);
+	}
+	for (i = 0; i < pool->nworkers; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
 
-	lendir = scandir(pathtodraw, &namelist, 0, alphasort);
-	if (lendir == 0) {PRINTW(5, 2, column, size-1, 0, 0, "NO FILES HERE");} /* it doesn't enter here when the folder is empty */
-	if (lendir <= 0) return;
+	/* the first items are dealt out, the rest is balanced by stealing */
+	for (i = 0; i < n; i++) stealpush(pool, i % pool->nworkers, items[i]);
+	runworkers(pool->nworkers, stealworker, pool);
 
-	if (realpath(pathtodraw, resolvedpath) == NULL) resolvedpath[0] = 0;
+	for (i = 0; i < pool->nworkers; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].items);
+	}
+	free(pool->deques);
+}
 
-	i = 2;
-	if (sortbydirectories) {
-		/* draw first the directories */
-		for (j = 0; j < lendir && i < maxy-2; j++) {
-			strncpy(name, namelist[j]->d_name, NAME_MAX); /* otherwise it gives a segmentation fault and i have no idea why */
-			snprintf(statpath, PATH_MAX, "%s/%s", resolvedpath, name);
-			if (stat(statpath, &pathstat) == 0 && S_ISDIR(pathstat.st_mode) && \
-					strcmp(name, ".") != 0 && \
-					strcmp(name, "..") != 0 && \
-					(hiddenfiles == 0 ? name[0] != '.' : 1)) {
-				
-				p = strrchr(comingfrom, '/');
-				if (p == NULL) p = comingfrom+strlen(comingfrom);
-				else p += 1;
-
-				if ((direction && i == 2) || (!direction && strcmp(name, p) == 0)) {
-					PRINTW(7, i, column, size-1, isselected(resolvedpath, name), 1, name);
-					if (highlightedname) strncpy(highlightedname, name, NAME_MAX);
-				} else if (isselected(resolvedpath, name)) {
-					PRINTW(4, i, column, size-1, 1, 1, name);
-				} else {
-					PRINTW(3, i, column, size-1, 0, 1, name);
-				}
-				i++;
-			}
-		}
-		/* then put all other files */
-		for (j = 0; j < lendir && i < maxy-2; j++) {
-			strncpy(name, namelist[j]->d_name, NAME_MAX); /* otherwise it gives a segmentation fault and i have no idea why */
-			snprintf(statpath, PATH_MAX, "%s/%s", resolvedpath, name);
-			if (stat(statpath, &pathstat) == 0 && !S_ISDIR(pathstat.st_mode) && \
-					strcmp(name, ".") != 0 && \
-					strcmp(name, "..") != 0 && \
-					(hiddenfiles == 0 ? name[0] != '.' : 1)) {
-
-				if (direction && i == 2) {
-					PRINTW(7, i, column, size-1, isselected(resolvedpath, name), 0, name);
-					if (highlightedname) strncpy(highlightedname, name, NAME_MAX);
-				} else if (isselected(resolvedpath, name)) {
-					PRINTW(2, i, column, size-1, 1, 0, name);
-				} else {
-					PRINTW(1, i, column, size-1, 0, 0, name);
-				}
-				i++;
-			}
-		}
-		/* then free each element in namelist */
-		for (j = 0; j < lendir; j++) {
-			free(namelist[j]);
-		}
+void
+deleteprocess(StealPool *pool, int worker, void *item) /* empties one directory, its subdirectories are queued and it's removed after the last of them */
+{
+	DeleteJob *job = (DeleteJob *)pool->ctx;
+	DeleteNode *node = (DeleteNode *)item, *child, *parent;
+	char buf[LARGE_BUFSIZE];
+	struct dirent64 *ent;
+	struct stat st;
+	long n, pos;
+	int fd, isdir;
+
+	/* everything is relative to the directory it's in, a directory renamed into a symlink can't lead outside of what's deleted */
+	if ((fd = node->fd = openat(node->parentfd, node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		__atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
 	} else {
-		for (j = 0; j < lendir && i < maxy-2; j++) {
-			strncpy(name, namelist[j]->d_name, NAME_MAX); /* otherwise it gives a segmentation fault and i have no idea why */
-			snprintf(statpath, PATH_MAX, "%s/%s", resolvedpath, name);
-			if (strcmp(name, ".") != 0 && \
-					strcmp(name, "..") && \
-					(hiddenfiles == 0 ? name[0] != '.' : 1)) {
-
-				p = strrchr(comingfrom, '/');
-				if (p == NULL) p = comingfrom+strlen(comingfrom);
-				else p += 1;
-
-				overwrite = 0;
-				if ((direction && i == 2) || (!direction && strcmp(name, p) == 0)) {
-					overwrite = 7;
-					if (highlightedname) strncpy(highlightedname, name, NAME_MAX);
-				}
-
-				if (stat(statpath, &pathstat) == 0 && S_ISDIR(pathstat.st_mode)) {
-					if (isselected(resolvedpath, name)) {
-						PRINTW(MAX(overwrite, 4), i, column, size-1, 1, 1, name);
-					} else {
-						PRINTW(MAX(overwrite, 3), i, column, size-1, 0, 1, name);
+		while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+			for (pos = 0; pos < n; pos += ent->d_reclen) {
+				ent = (struct dirent64 *)(buf+pos);
+				if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+				isdir = ent->d_type == DT_DIR;
+				if (ent->d_type == DT_UNKNOWN) isdir = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+
+				if (isdir) {
+					if ((child = (DeleteNode *)malloc(sizeof(DeleteNode))) == NULL) {
+						perror("couldn't allocate memory for deleting");
+						exit(1);
 					}
+					strncpy(child->name, ent->d_name, NAME_MAX-1);
+					child->name[NAME_MAX-1] = 0;
+					child->parent = node;
+					child->parentfd = fd;
+					child->fd = -1;
+					child->pending = 1;
+					__atomic_add_fetch(&node->pending, 1, __ATOMIC_SEQ_CST);
+					stealpush(pool, worker, child);
+				} else if (job->counting) {
+					__atomic_add_fetch(&job->entries, 1, __ATOMIC_RELAXED);
+				} else if (unlinkat(fd, ent->d_name, 0) == 0) {
+					__atomic_add_fetch(&job->deleted, 1, __ATOMIC_RELAXED);
 				} else {
-					if (isselected(resolvedpath, name)) {
-						PRINTW(MAX(overwrite, 2), i, column, size-1, 1, 0, name);
-					} else {
-						PRINTW(MAX(overwrite, 1), i, column, size-1, 0, 0, name);
-					}
+					__atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
 				}
-
-				i++;
 			}
-			free(namelist[j]);
 		}
 	}
-	free(namelist);
 
-	if (i == 2) {
-		PRINTW(5, 2, column, size-1, 0, 0, "NO FILES");
+	/* whoever finishes a directory last removes it, and maybe its parent after it; one that couldn't be opened was already counted */
+	for (; node && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_SEQ_CST) == 0; node = parent) {
+		if (node->fd >= 0) {
+			close(node->fd);
+			if (job->counting) __atomic_add_fetch(&job->entries, 1, __ATOMIC_RELAXED);
+			else if (unlinkat(node->parentfd, node->name, AT_REMOVEDIR) == 0) __atomic_add_fetch(&job->deleted, 1, __ATOMIC_RELAXED);
+			else __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+		}
+		if (!node->parent) close(node->parentfd);
+		parent = node->parent;
+		free(node);
 	}
-
 }
 
-int
-iscurrentonscreen(void)
+long long
+walkdelete(char **paths, int n, int counting, long long *failed) /* counts or deletes the entries under paths (and them), returns how many */
 {
-	return topofscreen <= current && current < topofscreen+maxy-4;
+	DeleteJob job = {.counting = counting};
+	StealPool pool = {.process = deleteprocess, .ctx = &job};
+	DeleteNode **roots;
+	struct stat st;
+	char dir[PATH_MAX], *slash;
+	int i, nroots = 0;
+
+	if ((roots = (DeleteNode **)malloc(MAX(n, 1) * sizeof(DeleteNode *))) == NULL) {
+		perror("couldn't allocate memory for deleting");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (lstat(paths[i], &st) != 0) {
+			job.failed++;
+		} else if (S_ISDIR(st.st_mode)) {
+			/* a root is opened in the directory it's in, like the rest */
+			strncpy(dir, paths[i], PATH_MAX-1);
+			dir[PATH_MAX-1] = 0;
+			if ((slash = strrchr(dir, '/')) == NULL || !slash[1] || strlen(slash+1) >= NAME_MAX) {
+				job.failed++;
+				continue;
+			}
+			if ((roots[nroots] = (DeleteNode *)malloc(sizeof(DeleteNode))) == NULL) {
+				perror("couldn't allocate memory for deleting");
+				exit(1);
+			}
+			strcpy(roots[nroots]->name, slash+1);
+			*slash = 0;
+			if ((roots[nroots]->parentfd = open(dir[0] ? dir : "/", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+				free(roots[nroots]);
+				job.failed++;
+				continue;
+			}
+			roots[nroots]->parent = NULL;
+			roots[nroots]->fd = -1;
+			roots[nroots++]->pending = 1;
+		} else if (counting) {
+			job.entries++;
+		} else if (unlink(paths[i]) == 0) {
+			job.deleted++;
+		} else {
+			job.failed++;
+		}
+	}
+
+	runstealpool(&pool, (void **)roots, nroots);
+	free(roots);
+
+	if (failed) *failed = job.failed;
+	return counting ? job.entries : job.deleted;
 }
 
-char*
-getreadablefs(double size, char *ret)
+void
+deleteselection(const Arg *arg) /* the selection, or the current file, with everything under it */
 {
-	int i = 0;
-	char orders[4] = "BKMG";
+	char **paths, question[PATH_MAX], answer[NAME_MAX] = "";
+	long long count, failed;
+	int i, n = 0;
 
-	ret[0] = 0;
+	if (archivepath[0]) {
+		strncpy(status, "can't delete inside an archive", NAME_MAX);
+		return;
+	}
+	if (!fileslist.contents && !selected.contents) return;
 
-	while (size > 1024 && i < 3) {
-		size /= 1024;
-		i++;
+	if ((paths = (char **)malloc(MAX(selected.end, 1) * sizeof(char *))) == NULL) {
+		perror("couldn't allocate memory for deleting");
+		exit(1);
+	}
+	for (i = 1; selected.contents && i <= selected.end; i++) {
+		paths[n] = (char *)malloc(PATH_MAX);
+		elempath(&selected.contents[i], paths[n++]);
+	}
+	if (n == 0) {
+		paths[n] = (char *)malloc(PATH_MAX);
+		elempath(&fileslist.contents[current], paths[n++]);
 	}
 
-	snprintf(ret, NAME_MAX, "%.2f%c", size, orders[i]);
-	return ret;
-}
+	drawstatus("counting...");
+	count = walkdelete(paths, n, 1, NULL);
+	if (n == 1) snprintf(question, PATH_MAX, "delete %s and everything in it, %lld entries? [y/N]: ", paths[0], count);
+	else snprintf(question, PATH_MAX, "delete %d selected and everything in them, %lld entries? [y/N]: ", n, count);
 
-char*
-escapestring(char *str, size_t n)
-{
-	char escapechars[256] = {0};
-	int i, k = 0;
-	char *buf = (char *)malloc(n);
-
-	escapechars['\a'] = 1;
-	escapechars['\b'] = 1;
-	escapechars['\f'] = 1;
-	escapechars['\n'] = 1;
-	escapechars['\r'] = 1;
-	escapechars['\t'] = 1;
-	escapechars['\v'] = 1;
-	escapechars['\\'] = 1;
-	escapechars['\?'] = 1;
-
-	for (i = 0; str && i < n && k < n; i++) {
-		if (escapechars[str[i]]) {
-			buf[k++] = '\\';
-			
-			switch (str[i]) {
-				case '\a': buf[k++] = 'a'; break;
-				case '\b': buf[k++] = 'b'; break;
-				case '\f': buf[k++] = 'f'; break;
-				case '\n': buf[k++] = 'n'; break;
-				case '\r': buf[k++] = 'r'; break;
-				case '\t': buf[k++] = 't'; break;
-				case '\v': buf[k++] = 'v'; break;
-				case '\\': buf[k++] = '\\'; break;
-				case '\?': buf[k++] = '?'; break;
+	if (prompt(question, answer, NAME_MAX) == 0 && (answer[0] == 'y' || answer[0] == 'Y')) {
+		drawstatus("deleting...");
+		count = walkdelete(paths, n, 0, &failed);
+		freelistcontents(&selected);
+		i = current;
+		if (listinglabel[0]) {
+			/* a virtual listing can't be read again, what's gone is dropped from it */
+			for (i = 1; i <= fileslist.end; i++) {
+				elempath(&fileslist.contents[i], question);
+				if (access(question, F_OK) != 0 && errno == ENOENT) {
+					memmove(&fileslist.contents[i], &fileslist.contents[i+1], (fileslist.end-i) * sizeof(FileElem));
+					fileslist.end--;
+					i--;
+				}
 			}
+			current = MAX(1, MIN(current, fileslist.end));
 		} else {
-			buf[k++] = str[i];
+			getcurrentfiles();
+			current = MAX(1, MIN(i, fileslist.end));
 		}
+		if (failed) snprintf(status, NAME_MAX, "deleted %lld entries, %lld couldn't be deleted", count, failed);
+		else snprintf(status, NAME_MAX, "deleted %lld entries", count);
+	} else {
+		strncpy(status, "didn't delete anything", NAME_MAX);
 	}
-	buf[k] = 0;
 
-	strncpy(str, buf, n);
-	free(buf);
-	return str;
+	for (i = 0; i < n; i++) free(paths[i]);
+	free(paths);
 }
 
 void
-loop(void)
+newtab(const Arg *arg) /* opens a tab on cwd, after the current one */
 {
-	int c, i;
-	rdrwf();
-	while ((c = getch()) != QUIT_CHAR) {
-		if (c == KEY_RESIZE) {
-			resizedetected();
-		} else {
-			status[0] = 0;
-		}
+	Tab *t;
+	int i;
 
-		getcwd(cwd, PATH_MAX);
-		for (i = 0; i < LENGTH(keys); i++) {
-			if (keys[i].chr == c) {
-				keys[i].func(&keys[i].arg);
-			}
-		}
-		rdrwf();
+	if (ntabs >= TABS_MAX) {
+		strncpy(status, "no more tabs can be opened", NAME_MAX);
+		return;
 	}
+	for (i = ntabs; i > currenttab+1; i--) tabs[i] = tabs[i-1];
+	ntabs++;
+
+	/* it starts where this one is, with its own directories and cursor but the same listing */
+	t = &tabs[currenttab+1];
+	memset(t, 0, sizeof(Tab));
+	strncpy(t->cwd, cwd, PATH_MAX);
+	for (i = 0; i < ndirfds && (t->dirfds[i] = dup(dirfds[i])) >= 0; i++) {
+		strncpy(t->dirpaths[i], dirpaths[i], PATH_MAX);
+	}
+	t->ndirfds = i;
+	t->current = current;
+	t->topofscreen = topofscreen;
+	t->sortbydirectories = sortbydirectories;
+	t->hiddenfiles = hiddenfiles;
+
+	stashtab(&tabs[currenttab]);
+	if ((t->listing = tabs[currenttab].listing) != NULL) t->listing->refs++;
+	currenttab++;
+	restoretab(t);
+	snprintf(status, NAME_MAX, "tab %d of %d", currenttab+1, ntabs);
 }
 
 void
-cleanup(void)
+switchtab(const Arg *arg)
 {
-	freelistcontents(&fileslist);
-	freelistcontents(&selected);
-	clear();
-	endwin();
-	FILE *fp = NULL;
-	if ((fp = fopen(VCD_PATH, "w+")) == NULL)
-		return;
+	if (ntabs == 1) return;
+	showtab((currenttab + arg->i + ntabs) % ntabs);
+	snprintf(status, NAME_MAX, "tab %d of %d", currenttab+1, ntabs);
+}
 
-	if (getcwd(cwd, sizeof(cwd)) != NULL) {
-		printf("%s\n", cwd);
-		fprintf(fp, "%s\n", cwd);
+void
+closetab(const Arg *arg)
+{
+	int i, n;
+
+	if (ntabs == 1) {
+		strncpy(status, "it's the only tab", NAME_MAX);
+		return;
 	}
-	
-	fclose(fp);
+	stashtab(&tabs[currenttab]);
+	droptab(&tabs[currenttab]);
+	for (i = currenttab; i < ntabs-1; i++) tabs[i] = tabs[i+1];
+	ntabs--;
+
+	/* the one after it takes its place, or the one before if it was the last */
+	n = MIN(currenttab, ntabs-1);
+	currenttab = -1; /* there's nothing left of the closed one to keep */
+	showtab(n);
+	snprintf(status, NAME_MAX, "tab %d of %d", currenttab+1, ntabs);
 }
 
+void
+showtab(int n) /* the current tab is put away and n is shown as it was left */
+{
+	if (currenttab >= 0) stashtab(&tabs[currenttab]);
+	currenttab = n;
+	restoretab(&tabs[n]);
+}
 
 void
-movev(const Arg *arg)
+stashtab(Tab *t) /* what's shown goes into t, the directories still open and the listing kept if it's one of cwd */
 {
-	if (!arg) return;
-	if (!fileslist.contents) return;
+	int i;
 
-	int i = arg->i, j = 0;
+	strncpy(t->cwd, cwd, PATH_MAX);
+	for (i = 0; i < ndirfds; i++) {
+		t->dirfds[i] = dirfds[i];
+		strncpy(t->dirpaths[i], dirpaths[i], PATH_MAX);
+	}
+	t->ndirfds = ndirfds;
+	ndirfds = 0;
+	if (previewfd >= 0) close(previewfd);
+	previewfd = -1;
+	previewpath[0] = 0;
+	previewgit = NULL;
+
+	/* the listing it was lent goes back, or it's kept with the one another tab has of the same directory */
+	if (t->listing && !givebacklisting(t)) droplisting(&t->listing);
+	if (!t->listing && listingkeepable()) t->listing = sharelisting();
+	freelistcontents(&fileslist);
+	closelarge();
+	listingflags = -1;
+	revalidationgeneration++; /* a reread of it that's still going belongs to the tab now, it's dropped */
+
+	t->current = current;
+	t->topofscreen = topofscreen;
+	t->sortbydirectories = sortbydirectories;
+	t->hiddenfiles = hiddenfiles;
+}
 
-	if (i == 1) {
-		if (current+1 <= fileslist.end) current++;
-	} else if (i == -1) {
-		if (current-1 >= 1) current--;
-	} else if (i == 2) {
-		if (current + maxy/2 <= fileslist.end) current += maxy/2;
-		else current = fileslist.end;
-	} else  if (i == -2) {
-		if (current - maxy/2 >= 1) current -= maxy/2;
-		else current = 1;
+void
+restoretab(Tab *t) /* shows t as it was put away, only a changed directory or git index is looked at again */
+{
+	struct stat dirstat;
+	TabListing *l = t->listing;
+	int i;
+
+	for (i = 0; i < t->ndirfds; i++) {
+		dirfds[i] = t->dirfds[i];
+		strncpy(dirpaths[i], t->dirpaths[i], PATH_MAX);
+	}
+	ndirfds = t->ndirfds;
+	t->ndirfds = 0;
+	sortbydirectories = t->sortbydirectories;
+	hiddenfiles = t->hiddenfiles;
+
+	/* without a listing to show (or a directory to go back to), it's read like any other */
+	if (ndirfds == 0 || fchdir(dirfds[0]) != 0 || !l || !l->list.contents) {
+		if (ndirfds == 0 || fchdir(dirfds[0]) != 0) chdir(t->cwd);
+		droplisting(&t->listing);
+		getcurrentfiles();
+		if (t->current > 1 && t->current <= fileslist.end && !fileslist.total) {
+			current = t->current;
+			topofscreen = MAX(MIN(t->topofscreen, current), 1);
+		}
+		return;
 	}
+
+	/* the tab that's shown borrows the listing, the others on the same directory get it back when it's put away */
+	strncpy(cwd, t->cwd, PATH_MAX);
+	fileslist = l->list;
+	memset(&l->list, 0, sizeof(Files));
+	l->lent = 1;
+	listingstat = l->st;
+	listingflags = l->flags;
+	current = MAX(MIN(t->current, fileslist.end), 1);
+	topofscreen = MAX(MIN(t->topofscreen, current), 1);
+	listinglabel[0] = 0;
+	listingkind = ListingDirectory;
+	archivepath[0] = 0;
+
+	readmounts();
+	cwdmount = mountof(cwd);
+	cwdgit = NULL;
+	if (isdegraded()) return;
+
+	/* like a cached listing, one whose directory changed since is shown and reread in the background */
+	if (fstat(dirfds[0], &dirstat) == 0 && (dirstat.st_mtim.tv_sec != listingstat.st_mtim.tv_sec || \
+			dirstat.st_mtim.tv_nsec != listingstat.st_mtim.tv_nsec || listingflags != indexflags(sortbydirectories, hiddenfiles))) {
+		startrevalidation(&dirstat);
+	}
+	if (!fsremote(cwdmount)) cwdgit = gitstatus(cwd, dirfds[0], NULL, 0);
 }
 
 void
-moveh(const Arg *arg)
+droptab(Tab *t)
 {
-	struct stat pathstat;
-	char oldpattern[PATH_MAX], *p;
-	Arg searcharg = {.i = 0};
-	int tosearch = 0;
+	int i;
 
-	memset(oldpattern, 0, sizeof(oldpattern));
+	for (i = 0; i < t->ndirfds; i++) close(t->dirfds[i]);
+	t->ndirfds = 0;
+	droplisting(&t->listing);
+}
 
-	if (!arg) return;
-	if (strcmp(cwd, "/") == 0 && arg->i == -1) return;
-	
-	if (arg->i == -1) {
-		/* for a single level undo */
-		p = strrchr(cwd, '/');
+int
+listingkeepable(void) /* fileslist is a listing of cwd that can be kept, not a virtual or large one */
+{
+	return !listinglabel[0] && !archivepath[0] && !fileslist.total && listingflags >= 0 && fileslist.contents;
+}
 
-		if (p && p[1] != 0) {
-			tosearch = 1;
-			strncpy(oldpattern, pattern, PATH_MAX);
-			strncpy(pattern, p+1, PATH_MAX);
+TabListing *
+sharelisting(void) /* fileslist kept for a tab, replacing an older listing of the same directory another tab has; NULL if it can't be */
+{
+	TabListing *l = NULL;
+	int i;
+
+	for (i = 0; i < TABS_MAX && !l; i++) {
+		if (tablistings[i].refs && !tablistings[i].lent && tablistings[i].st.st_dev == listingstat.st_dev && \
+				tablistings[i].st.st_ino == listingstat.st_ino && tablistings[i].flags == listingflags) l = &tablistings[i];
+	}
+	for (i = 0; i < TABS_MAX && !l; i++) {
+		if (!tablistings[i].refs) l = &tablistings[i];
+	}
+	if (!l) return NULL;
+
+	freelistcontents(&l->list);
+	settlelisting(&fileslist);
+	l->list = fileslist;
+	l->st = listingstat;
+	l->flags = listingflags;
+	l->refs++;
+	memset(&fileslist, 0, sizeof(Files));
+	return l;
+}
+
+int
+givebacklisting(Tab *t) /* the listing t was lent goes back to the tabs sharing it, returns 1 if fileslist went with it */
+{
+	TabListing *l = t->listing;
+
+	if (!l || !l->lent) return 0;
+	l->lent = 0;
+	/* if it isn't a listing of the same directory anymore, it's read again by the next tab that shows it */
+	if (!listingkeepable() || listingstat.st_dev != l->st.st_dev || listingstat.st_ino != l->st.st_ino || listingflags != l->flags) return 0;
+
+	settlelisting(&fileslist);
+	l->list = fileslist;
+	l->st = listingstat;
+	memset(&fileslist, 0, sizeof(Files));
+	listingflags = -1;
+	return 1;
+}
+
+void
+droplisting(TabListing **l)
+{
+	if (*l && --(*l)->refs == 0) {
+		freelistcontents(&(*l)->list);
+		memset(*l, 0, sizeof(TabListing));
+	}
+	*l = NULL;
+}
+
+void
+loadplugins(void) /* the ones in plugins[], a plugin that fails to start is unloaded with what it registered */
+{
+	int (*init)(const StuifmApi *);
+	void *handle;
+	int i, nkeys, ndecs, nhooks;
+
+	for (i = 0; i < LENGTH(plugins); i++) {
+		if (!plugins[i]) continue;
+		if ((handle = dlopen(plugins[i], RTLD_NOW|RTLD_LOCAL)) == NULL) {
+			snprintf(status, NAME_MAX, "%s", dlerror());
+			continue;
 		}
 
-		chdir("..");
-	} else {
-		if (stat(fileslist.contents[current].name, &pathstat) == 0 && S_ISDIR(pathstat.st_mode)) {
-			chdir(fileslist.contents[current].name);
-		} else {
-			return;
+		nkeys = npluginkeys;
+		ndecs = ndecorators;
+		nhooks = npluginhooks;
+		*(void **)(&init) = dlsym(handle, "stuifm_plugin_init");
+		if (!init || init(&pluginapi) != 0) {
+			snprintf(status, NAME_MAX, "couldn't start the plugin %s", plugins[i]);
+			npluginkeys = nkeys;
+			ndecorators = ndecs;
+			npluginhooks = nhooks;
+			dlclose(handle);
 		}
 	}
+}
+
+void
+runhooks(int when, int key)
+{
+	int i;
+
+	for (i = 0; i < npluginhooks; i++) {
+		if (pluginhooks[i].when == when) pluginhooks[i].hook(key, pluginhooks[i].data);
+	}
+}
 
-	getcurrentfiles();
-	if (tosearch) {
-		search(&searcharg);
-		strncpy(pattern, oldpattern, PATH_MAX);
+int
+pluginbound(int key)
+{
+	int i;
+
+	for (i = 0; i < npluginkeys; i++) {
+		if (pluginkeys[i].key == key) return 1;
 	}
-	strncpy(status, "changed directory", NAME_MAX);
+	return 0;
 }
 
-void
-first(const Arg *arg)
+int
+apicount(void)
 {
-	current = 1;
+	return fileslist.contents ? fileslist.end : 0;
 }
 
-void
-last(const Arg *arg)
+int
+apicurrent(void)
 {
-	if (fileslist.contents == NULL) return;
-	current = fileslist.end;
+	return fileslist.contents ? current : 0;
 }
 
-void
-topofscreenscroll(const Arg *arg)
+const char *
+apiname(int index)
 {
-	if (!arg || arg->i == 0) return;
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].name : NULL;
+}
 
-	int i = arg->i;
+const char *
+apidirectory(int index)
+{
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].path : NULL;
+}
 
-	if (i == 1) {
-		if (topofscreen + 1 <= fileslist.end && topofscreen+1 <= current) topofscreen++;
-	} else if (i == -1) {
-		if (current <= topofscreen+maxy-3) topofscreen--;
-	}
+unsigned int
+apiknown(int index)
+{
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].statmask & (STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME) : 0;
 }
 
-void
-drawratiosscroll(const Arg *arg)
+unsigned int
+apimode(int index)
 {
-	if (!arg || arg->i == 0) {
-		strncpy(status, "define the arguments for drawrationscroll", NAME_MAX);
-		return;
-	}
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].mode : 0;
+}
 
-	cratio = ((cratio+arg->i) % LENGTH(drawratios));
+long long
+apifilesize(int index)
+{
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].size : 0;
+}
 
-	if (cratio < 0) {
-		cratio = (LENGTH(drawratios)+cratio);
-	}
+long long
+apimtime(int index)
+{
+	return index >= 1 && index <= apicount() ? fileslist.contents[index].mtime : 0;
+}
 
-	strncpy(status, "changed the draw ratio", NAME_MAX);
+const char *
+apicwd(void)
+{
+	return cwd;
 }
 
-void
-toggleselect(const Arg *arg)
+int
+apiselected(void)
 {
-	if (!fileslist.contents) {
-		strncpy(status, "no current file/no files in directory", NAME_MAX);
-		return;
-	}
+	return selected.contents ? selected.end : 0;
+}
 
-	if (isselected(fileslist.contents[current].path, fileslist.contents[current].name)) {
-		rmvselection(fileslist.contents[current].path, fileslist.contents[current].name);
-	} else {
-		addelem(&selected, fileslist.contents[current].path, fileslist.contents[current].name);
-	}
-	strncpy(status, "changed selected", NAME_MAX);
+const char *
+apiselectedname(int index)
+{
+	return index >= 1 && index <= apiselected() ? selected.contents[index].name : NULL;
 }
 
-void
-clearselection(const Arg *arg)
+const char *
+apiselecteddirectory(int index)
 {
-	freelistcontents(&selected);
-	strncpy(status, "cleared selected", NAME_MAX);
+	return index >= 1 && index <= apiselected() ? selected.contents[index].path : NULL;
 }
 
-void
-selectall(const Arg *arg)
+int
+apiisselected(int index)
 {
-	int i = 1;
-	for (i = 1; i <= fileslist.end; i++) {
-		if (!isselected(fileslist.contents[i].path, fileslist.contents[i].name)) {
-			addelem(&selected, fileslist.contents[i].path, fileslist.contents[i].name);
-		}
-	}
+	return index >= 1 && index <= apicount() && isselected(fileslist.contents[index].path, fileslist.contents[index].name);
 }
 
 void
-directoriesfirst(const Arg *arg)
+apisetstatus(const char *message)
 {
-	sortbydirectories = !sortbydirectories;
-	if (sortbydirectories == 1) {
-		strncpy(status, "sorting with directories being first", NAME_MAX);
-	} else {
-		strncpy(status, "sorting with normaly", NAME_MAX);
-	}
-	getcurrentfiles();
+	strncpy(status, message, NAME_MAX-1);
 }
 
 void
-hiddenfilesswitch(const Arg *arg)
+apisetcurrent(int index)
 {
-	hiddenfiles = !hiddenfiles;
-	if (hiddenfiles == 1) {
-		strncpy(status, "showing hidden files", NAME_MAX);
-	} else {
-		strncpy(status, "hiding hidden files", NAME_MAX);
-	}
-	getcurrentfiles();
+	if (index >= 1 && index <= apicount()) current = index;
 }
 
 void
-search(const Arg *arg)
+apireload(void)
 {
-	if (!fileslist.contents) {
-		strncpy(status, "no files in current directory", NAME_MAX);
-		return;
-	}
-
-	regex_t regex;
-	int reti, oktofree = 0, i = current;
-
-    switch (arg->i) {
-    case 0: /* FALLTHROUGH */
-    case 1: if (!oktofree && pattern[0] != 0) {
-                reti = regcomp(&regex, pattern, 0);
-                 if (reti) return;
-                 oktofree = 1;
-            } else if (!oktofree) {
-               strncpy(status, "please input a pattern", NAME_MAX);
-               return;
-            }
-            
-            if (arg->i == 1) i++;  /* so it doesn't detect the same element if we want the next one
-             		                * but in case we search with a new pattern, we want it to match the current
-             		                * position if it matches
-             		                */
-            
-            for (; i <= fileslist.end; i++) {
-               reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
-               if (!reti) break;
-            }
-            
-            if (i > fileslist.end) {
-                i = 1;
-                strncpy(status, "search reached BOTTOM, starting from the topofscreen", NAME_MAX);
-                
-				for (; i <= fileslist.end; i++) {
-                   reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
-                   if (!reti) break;
-                }
-            }
-            break;
-    
-    case -1: if (pattern[0] != 0) {
-    	         reti = regcomp(&regex, pattern, 0);
-    	         if (reti) return;
-    	         oktofree = 1;
-             } else {
-    	         strncpy(status, "please input a pattern", NAME_MAX);
-    	         return;
-             }
-    
-             i--;
+	getcurrentfiles();
+}
 
-             for (; i >= 1; i--) {
-                reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
-                if (!reti) break;
-             }
-             
-             if (i == 0) {
-			 	 i = fileslist.end;
-                 strncpy(status, "search reached topofscreen, starting from the BOTTOM", NAME_MAX);
-                 
-             	 for (; i >= 1; i--) {
-             	    reti = regexec(&regex, fileslist.contents[i].name, 0, NULL, 0);
-             	    if (!reti) break;
-             	 }
-             }
-             break;
-    }
+int
+apibindkey(int key, StuifmKeyHandler handler, void *data)
+{
+	PluginKey *grown;
 
-	if (oktofree) {
-		regfree(&regex);
-	}
+	if (!handler || (grown = (PluginKey *)realloc(pluginkeys, (npluginkeys+1) * sizeof(PluginKey))) == NULL) return -1;
+	pluginkeys = grown;
+	pluginkeys[npluginkeys].key = key;
+	pluginkeys[npluginkeys].handler = handler;
+	pluginkeys[npluginkeys++].data = data;
+	return 0;
+}
 
-	if (i <= 0 || i > fileslist.end) {
-		strncpy(status, "no item with that pattern was found", NAME_MAX);
-		i = current;
-	}
+int
+apidecorate(StuifmDecorator decorator, void *data)
+{
+	PluginDecorator *grown;
 
-	initialization();
-	current = i;
+	if (!decorator || (grown = (PluginDecorator *)realloc(decorators, (ndecorators+1) * sizeof(PluginDecorator))) == NULL) return -1;
+	decorators = grown;
+	decorators[ndecorators].decorator = decorator;
+	decorators[ndecorators++].data = data;
+	return 0;
+}
 
-	/* put the result in the middle */
-	if (!iscurrentonscreen()) {
-		topofscreen = current-maxy/2;
-		if (topofscreen < 1) topofscreen = 1;
-		if (topofscreen > fileslist.end) topofscreen = fileslist.end;
-	}
+int
+apihook(int when, StuifmHook hook, void *data)
+{
+	PluginHook *grown;
+
+	if (!hook || (when != StuifmBeforeKey && when != StuifmAfterKey)) return -1;
+	if ((grown = (PluginHook *)realloc(pluginhooks, (npluginhooks+1) * sizeof(PluginHook))) == NULL) return -1;
+	pluginhooks = grown;
+	pluginhooks[npluginhooks].when = when;
+	pluginhooks[npluginhooks].hook = hook;
+	pluginhooks[npluginhooks++].data = data;
+	return 0;
 }
 
 void
 executecommand(const Arg *arg)
 {
-	char input[NAME_MAX], inputcommand[PATH_MAX], command[COMMAND_MAX], toconcat[PATH_MAX], coutput[PATH_MAX] = {0}, buf[PATH_MAX], oldpattern[PATH_MAX], chr;
-	int i, k = 0, j = 1, cpid, pipefd[2] = {0}, readok = 0, cstatus = 0;
+	char input[NAME_MAX] = "", inputcommand[PATH_MAX], command[COMMAND_MAX] = "", toconcat[PATH_MAX], oldpattern[PATH_MAX];
+	int i, k = 0, j = 1, readok = 0, cstatus = 0, mask;
 	Arg searcharg = {.i = 0};
-	
-	if (!(arg->i & NoEndWinMaskBACKEND)) endwin();
+	LastLine lastline = {0};
+
+	mask = arg ? arg->i : 0;
+
+	/* commands that don't need the terminal leave curses alone */
+	if (!(mask & NoEndWinMaskBACKEND)) endwin();
 
 	if (!arg || !arg->v) {
 		printf("your command: ");
@@ -954,13 +7566,16 @@ executecommand(const Arg *arg)
 			if (inputcommand[i+1] == '%') {
 				command[k] = '%';
 				k++;
+				command[k] = 0;
 				i++;
 			} else if (inputcommand[i+1] == 'c') {
 				if (!fileslist.contents) {
 					strncpy(status, "directory is empty - no current file set", NAME_MAX);
 					goto skipexecutecommand;
 				}
-				strncat(command, fileslist.contents[current].name, COMMAND_MAX-strlen(fileslist.contents[current].name)-1);
+				if (listinglabel[0]) elempath(&fileslist.contents[current], toconcat);
+				else strncpy(toconcat, fileslist.contents[current].name, PATH_MAX);
+				strncat(command, toconcat, COMMAND_MAX-strlen(command)-1);
 				k = strlen(command);
 				i++;
 			} else if (inputcommand[i+1] == 's') {
@@ -986,99 +7601,304 @@ executecommand(const Arg *arg)
 		}
 	}
 
-	if (!(arg->i & NoConfirmationMask)) printf("are you sure you want to execute the command '%s' [yes/No]: ", command);
-	if (!(arg->i & NoConfirmationMask)) fgets(input, NAME_MAX, stdin);
-
-	if (arg->i & NoConfirmationMask || input[0] == 'y' || input[0] == 'Y') {
-		if (pipe(pipefd) != 0) {
-			snprintf(status, NAME_MAX, "pipe error when trying to execute '%s'", command);
-			goto skipexecutecommand;
+	if (!(mask & NoConfirmationMask)) printf("are you sure you want to execute the command '%s' [yes/No]: ", command);
+	if (!(mask & NoConfirmationMask)) fgets(input, NAME_MAX, stdin);
+
+	if (mask & NoConfirmationMask || input[0] == 'y' || input[0] == 'Y') {
+		/* the long-lived shell runs what doesn't need the terminal, anything else gets a fresh process */
+		if (SHELLCOPROCESS && mask & NoEndWinMaskBACKEND) cstatus = coprocesscommand(command, &lastline);
+		else cstatus = spawncommand(command, !(mask & NoEndWinMaskBACKEND), &lastline);
+		readok = lastline.ok;
+
+		if (cstatus < 0) {
+			if (cstatus == -1) snprintf(status, NAME_MAX, "error when trying to execute '%s'", command);
+			readok = 0;
+		} else if (cstatus != 0) {
+			snprintf(status, NAME_MAX, "the child process exited with non-zero status when executing '%s'", command);
+			readok = 0;
+		} else if (!(mask & NoEndWinMaskBACKEND)) {
+			snprintf(status, NAME_MAX, "executed the command '%s'", command);
 		}
+	} else if (!(mask & NoEndWinMaskBACKEND)) {
+		snprintf(status, NAME_MAX, "didn't execute the command '%s'", command);
+	}
 
-		if ((cpid = fork()) == 0) {
-			dup2(pipefd[1], STDOUT_FILENO);
-			close(pipefd[0]);
-			close(pipefd[1]);
+skipexecutecommand:
+	if (!(mask & NoEndWinMaskBACKEND) && !(mask & NoWaitUntilKeyPress)) printf("press any key to continue\n");
+	if (!(mask & NoEndWinMaskBACKEND) && !(mask & NoWaitUntilKeyPress)) fgetc(stdin);
 
-			execl("/bin/sh", "sh", "-c", command, (char *)NULL);
-			_exit(1);
-		} else if (cpid > 0) {
-			close(pipefd[1]);
+	if (!(mask & NoEndWinMaskBACKEND)) restorescreen();
+	if (!(mask & NoReloadMask)) getcurrentfiles();
 
-			k = 0;
-			while (read(pipefd[0], &chr, sizeof(char)) > 0) {
-				putchar(chr);
-				fflush(stdout);
+	if (readok && mask & SearchLastLineMask) {
+		strncpy(oldpattern, pattern, PATH_MAX);
+		strncpy(pattern, lastline.line, PATH_MAX);
 
-				if (k == PATH_MAX-1 || chr == '\n') {
-					buf[k] = 0;
-					strncpy(coutput, buf, PATH_MAX);
-					readok = 1;
-					k = 0;
-				} else {
-					buf[k++] = chr;
-				}
-			}
-			buf[k] = 0;
-			if (k != 0) strncpy(coutput, buf, PATH_MAX);
+		search(&searcharg);
+		if (mask & NoSaveSearchMask) strncpy(pattern, oldpattern, PATH_MAX);
+	}
 
-			if (wait(&cstatus) != cpid || cstatus != 0) {
-				snprintf(status, NAME_MAX, "error on wait or the child process exited with non-zero status when executing '%s'", command);
-				readok = 0;
-			}
+	if (readok && mask & CdLastLineMask && chdir(lastline.line) == 0) {
+		getcurrentfiles();
+	}
+}
 
-			close(pipefd[0]);
+void
+restorescreen(void)
+{
+	/* curses picks up again where endwin() left it, there's no need to start it over */
+	refresh();
+	getmaxyx(stdscr, maxy, maxx);
+}
+
+void
+feedlastline(LastLine *l, char *data, ssize_t n, int echo)
+{
+	ssize_t i;
+
+	if (echo) {
+		fwrite(data, 1, n, stdout);
+		fflush(stdout);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (l->k == PATH_MAX-1 || data[i] == '\n') {
+			l->buf[l->k] = 0;
+			strncpy(l->line, l->buf, PATH_MAX);
+			l->ok = 1;
+			l->k = 0;
+		} else {
+			l->buf[l->k++] = data[i];
 		}
+	}
+}
 
-		if (cpid < 0) snprintf(status, NAME_MAX, "error on fork() when trying to execute '%s'", command);
-		else if (!(arg->i & NoEndWinMaskBACKEND)) snprintf(status, NAME_MAX, "executed the command '%s'", command);
-	} else if (!(arg->i & NoEndWinMaskBACKEND)) {
-		snprintf(status, NAME_MAX, "didn't execute the command '%s'", command);
+int
+spawncommand(char *command, int echo, LastLine *l) /* returns the exit status of the command or -1 */
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	char *argv[] = {"sh", "-c", command, NULL}, buf[PATH_MAX];
+	int pipefd[2], cstatus;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe2(pipefd, O_CLOEXEC) != 0) return -1;
+
+	/* posix_spawn doesn't copy the page tables of a process that may be big like fork() does */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	cstatus = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(pipefd[1]);
+	if (cstatus != 0) {
+		close(pipefd[0]);
+		return -1;
 	}
 
-skipexecutecommand:
-	if (!(arg->i & NoEndWinMaskBACKEND) && !(arg->i & NoWaitUntilKeyPress)) printf("press any key to continue\n");
-	if (!(arg->i & NoEndWinMaskBACKEND) && !(arg->i & NoWaitUntilKeyPress)) fgetc(stdin);
+	while ((n = read(pipefd[0], buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		feedlastline(l, buf, n, echo);
+	}
+	if (l->k != 0) {
+		l->buf[l->k] = 0;
+		strncpy(l->line, l->buf, PATH_MAX);
+		l->ok = 1;
+	}
+	close(pipefd[0]);
 
-	if (!(arg->i & NoEndWinMaskBACKEND)) initialization();
-	if (!(arg->i & NoReloadMask)) getcurrentfiles();
+	while (waitpid(pid, &cstatus, 0) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	return WIFEXITED(cstatus) ? WEXITSTATUS(cstatus) : -1;
+}
 
-	if (readok && arg->i & SearchLastLineMask) {
-		strncpy(oldpattern, pattern, PATH_MAX);
-		strncpy(pattern, coutput, PATH_MAX);
+int
+startcoprocess(void)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	char *argv[] = {"sh", NULL};
+	int in[2], out[2], ret;
+
+	if (pipe2(in, O_CLOEXEC) != 0) return -1;
+	if (pipe2(out, O_CLOEXEC) != 0) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
 
-		search(&searcharg);
-		printf("%s\n", pattern);
-		if (arg->i & NoSaveSearchMask) strncpy(pattern, oldpattern, PATH_MAX);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	/* in a group of its own, so a command that hangs can be killed with what it started */
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETPGROUP);
+
+	ret = posix_spawn(&coprocesspid, "/bin/sh", &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(in[0]);
+	close(out[1]);
+
+	if (ret != 0) {
+		close(in[1]);
+		close(out[0]);
+		coprocesspid = -1;
+		return -1;
+	}
+
+	/* a shell that died shouldn't take stuifm with it when it's written to */
+	signal(SIGPIPE, SIG_IGN);
+	coprocessin = in[1];
+	coprocessout = out[0];
+	return 0;
+}
+
+void
+stopcoprocess(void)
+{
+	if (coprocesspid < 0) return;
+
+	close(coprocessin);
+	close(coprocessout);
+	waitpid(coprocesspid, NULL, 0);
+	coprocessin = coprocessout = coprocesspid = -1;
+}
+
+int
+coprocesscommand(char *command, LastLine *l) /* returns the exit status of the command, -1 if it couldn't run it, -2 if it was stopped at the deadline */
+{
+	char *framed, buf[PATH_MAX], marker[NAME_MAX], statusbuf[16], *p;
+	size_t len, i, matched = 0, markerlen;
+	int cstatus, tries, k = 0, done = 0;
+	long long deadline;
+	struct pollfd pfd;
+	ssize_t n;
+
+	/* every command runs in a subshell in the current directory, followed by a marker with its exit status
+	 * the command is quoted for eval, so an unbalanced quote or an unfinished heredoc fails in it instead of eating the marker
+	 */
+	len = 4*strlen(cwd) + 4*strlen(command) + 128; /* a ' takes 4 */
+	if ((framed = (char *)malloc(len)) == NULL) return -1;
+	p = framed + sprintf(framed, "cd -- '");
+	for (i = 0; cwd[i]; i++) {
+		if (cwd[i] == '\'') p += sprintf(p, "'\\''");
+		else *p++ = cwd[i];
+	}
+	p += sprintf(p, "' && (eval '");
+	for (i = 0; command[i]; i++) {
+		if (command[i] == '\'') p += sprintf(p, "'\\''");
+		else *p++ = command[i];
+	}
+	coprocessseq++;
+	snprintf(p, len-(p-framed), "') </dev/null; printf '\\036%d:%%d\\036' \"$?\"\n", coprocessseq);
+	markerlen = snprintf(marker, NAME_MAX, "%c%d:", COPROCESS_MARKER, coprocessseq);
+
+	for (tries = 0; tries < 2; tries++) {
+		if (coprocesspid < 0 && startcoprocess() != 0) break;
+		if (write(coprocessin, framed, strlen(framed)) == (ssize_t)strlen(framed)) break;
+		stopcoprocess(); /* it died, start it over once */
+	}
+	free(framed);
+	if (coprocesspid < 0 || tries == 2) return spawncommand(command, 0, l);
+
+	/* everything up to the marker is the output of the command, then comes its status up to another marker character */
+	pfd.fd = coprocessout;
+	pfd.events = POLLIN;
+	deadline = msnow() + COPROCESS_DEADLINE_MS;
+	while (!done) {
+		if (msnow() >= deadline || (n = poll(&pfd, 1, deadline-msnow())) == 0) {
+			/* the shell and whatever the command started are killed, the next command starts a new one */
+			kill(-coprocesspid, SIGKILL);
+			stopcoprocess();
+			l->ok = 0;
+			snprintf(status, NAME_MAX, "'%s' took longer than %d ms and was stopped", command, COPROCESS_DEADLINE_MS);
+			return -2;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 || (n = read(coprocessout, buf, sizeof(buf))) == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (i = 0; i < (size_t)n && !done; i++) {
+			if (matched == markerlen) {
+				if (buf[i] == COPROCESS_MARKER) done = 1;
+				else if (k < (int)sizeof(statusbuf)-1) statusbuf[k++] = buf[i];
+			} else if (buf[i] == marker[matched]) {
+				matched++;
+			} else {
+				if (matched) feedlastline(l, marker, matched, 0);
+				matched = buf[i] == marker[0];
+				if (!matched) feedlastline(l, &buf[i], 1, 0);
+			}
+		}
+	}
+	if (!done) {
+		stopcoprocess();
+		return -1;
 	}
+	statusbuf[k] = 0;
+	cstatus = atoi(statusbuf);
 
-	if (arg->i & CdLastLineMask) {
-		chdir(coutput);
+	if (l->k != 0) {
+		l->buf[l->k] = 0;
+		strncpy(l->line, l->buf, PATH_MAX);
+		l->ok = 1;
 	}
+	return cstatus;
 }
 
 /* main */
 int
 main(int argc, char *argv[])
 {
+	setlocale(LC_CTYPE, ""); /* for the widths of names, sorting stays bytewise */
 	if (argc > 1) {
 		if (strcmp(argv[1], "--version") == 0) {
 			printf("stuifm-%s\n", VERSION);
 			return 0;
 		} else if(strcmp(argv[1], "--help") == 0) {
-			printf("use: stuifm [--version|--help] or stuifm [directory]\n");
+			printf("use: stuifm [--version|--help|--daemon] or stuifm [directory] or stuifm --replay script [directory]\n");
 			printf("check the README.md for a tutorial\n");
 			printf("for using it as a way to cd into a directory, put the following in your .bashrc:\n");
 			printf("alias fm='stuifm; LASTDIR=`cat $HOME/.vcd`; cd \"$LASTDIR\"'\n");
 			printf("and call the program using fm\n\n");
 			printf("in order to use the bulkrename function, you need to define the $EDITOR environment variable with your prefered editor\n");
+			printf("stuifm --daemon keeps directory listings in memory and shares them with every stuifm started by the same user\n");
+			printf("stuifm --replay runs a script of keys without a terminal and prints how long each step took (see perf/)\n");
 			return 0;
+		} else if (strcmp(argv[1], "--daemon") == 0) {
+			return rundaemon();
+		} else if (strcmp(argv[1], "--replay") == 0 && argc > 2) {
+			return replay(argv[2], argc > 3 ? argv[3] : NULL);
 		} else  {
 			chdir(argv[1]);
 		}
 	}
 
 	initialization();
+	buildkeytable();
+	loadplugins();
+	loadfrecency();
 	getcurrentfiles();
 	loop();
 	cleanup();